@@ -0,0 +1,172 @@
+//// ARENA ALLOCATOR
+/// See arena.h.
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// An allocation that did not fit the block. The header takes a whole ARENA_ALIGNMENT so the memory after it stays aligned.
+struct ArenaOverflow {
+    ArenaOverflow* next;
+};
+
+// In front of every big buffer, taking a whole ARENA_ALIGNMENT like the overflow header
+typedef struct {
+    // Length of the mapping that starts at the header, or 0 if the buffer came from aligned_alloc
+    size_t mappedBytes;
+} BufferHeader;
+
+// Rounds bytes up to a multiple of ARENA_ALIGNMENT
+static size_t round_up(size_t bytes) {
+    return (bytes + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+}
+
+
+int arena_init(Arena* arena, size_t capacity) {
+    arena->capacity = round_up(capacity);
+    arena->block = arena->capacity > 0 ? huge_alloc(arena->capacity) : NULL;
+    arena->used = 0;
+    arena->overflow = NULL;
+    if (arena->capacity > 0 && arena->block == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the arena.\n");
+        arena->capacity = 0;
+        return -1;
+    }
+    return 0;
+}
+
+
+void arena_release(Arena* arena) {
+    arena_reset(arena);
+    huge_free(arena->block);
+    arena->block = NULL;
+    arena->capacity = 0;
+}
+
+
+void* arena_alloc(Arena* arena, size_t bytes) {
+    if (arena == NULL) {
+        return huge_alloc(bytes > 0 ? bytes : 1);
+    }
+    size_t rounded = round_up(bytes > 0 ? bytes : 1);
+    size_t offset = arena->used;
+    arena->used += rounded;
+    if (arena->used <= arena->capacity) {
+        return arena->block + offset;
+    }
+
+    // Does not fit: allocate it on its own until the next reset grows the block
+    char* memory = huge_alloc(ARENA_ALIGNMENT + rounded);
+    if (memory == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the arena.\n");
+        arena->used -= rounded;
+        return NULL;
+    }
+    ArenaOverflow* overflow = (ArenaOverflow*) memory;
+    overflow->next = arena->overflow;
+    arena->overflow = overflow;
+    return memory + ARENA_ALIGNMENT;
+}
+
+
+void arena_free(Arena* arena, void* memory) {
+    if (arena == NULL) {
+        huge_free(memory);
+    }
+}
+
+
+void arena_reset(Arena* arena) {
+    while (arena->overflow != NULL) {
+        ArenaOverflow* next = arena->overflow->next;
+        huge_free(arena->overflow);
+        arena->overflow = next;
+    }
+
+    // The last job did not fit: make the block as big as that job needed, so the next job of that size fits.
+    // If the new block can not be allocated, the old one is kept and the next big job overflows again.
+    if (arena->used > arena->capacity) {
+        char* grown = huge_alloc(arena->used);
+        if (grown != NULL) {
+            huge_free(arena->block);
+            arena->block = grown;
+            arena->capacity = arena->used;
+        }
+    }
+    arena->used = 0;
+}
+
+
+//// BIG BUFFERS
+
+// Maps bytes (a multiple of HUGE_PAGE_BYTES) of memory that starts on a huge page boundary, or returns NULL
+static void* map_huge_pages(size_t bytes) {
+#if defined(MAP_ANONYMOUS)
+#ifdef MAP_HUGETLB
+    // Explicit huge pages are always aligned, but only exist if the administrator reserved some (vm.nr_hugepages)
+    void* explicit = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (explicit != MAP_FAILED) {
+        return explicit;
+    }
+#endif
+    // Otherwise map one huge page more than needed, and unmap the parts before the first and after the last boundary,
+    // so that every huge page of the buffer can be backed by a transparent one
+    size_t mappedBytes = bytes + HUGE_PAGE_BYTES;
+    char* mapped = mmap(NULL, mappedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        return NULL;
+    }
+    char* aligned = (char*)(((uintptr_t)mapped + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES);
+    if (aligned > mapped) {
+        munmap(mapped, (size_t)(aligned - mapped));
+    }
+    if (aligned + bytes < mapped + mappedBytes) {
+        munmap(aligned + bytes, (size_t)(mapped + mappedBytes - (aligned + bytes)));
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+    return aligned;
+#else
+    (void)bytes;
+    return NULL;
+#endif
+}
+
+
+void* huge_alloc(size_t bytes) {
+    size_t total = ARENA_ALIGNMENT + round_up(bytes > 0 ? bytes : 1);
+    BufferHeader* header = NULL;
+    if (total >= HUGE_PAGE_BYTES) {
+        size_t mappedBytes = (total + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+        header = map_huge_pages(mappedBytes);
+        if (header != NULL) {
+            header->mappedBytes = mappedBytes;
+        }
+    }
+    // Small buffers, and big ones where mapping failed
+    if (header == NULL) {
+        header = aligned_alloc(ARENA_ALIGNMENT, total);
+        if (header == NULL) {
+            return NULL;
+        }
+        header->mappedBytes = 0;
+    }
+    return (char*)header + ARENA_ALIGNMENT;
+}
+
+
+void huge_free(void* memory) {
+    if (memory == NULL) {
+        return;
+    }
+    BufferHeader* header = (BufferHeader*)((char*)memory - ARENA_ALIGNMENT);
+    if (header->mappedBytes > 0) {
+        munmap(header, header->mappedBytes);
+    } else {
+        free(header);
+    }
+}
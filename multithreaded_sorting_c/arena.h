@@ -0,0 +1,70 @@
+//// ARENA ALLOCATOR
+/// One block of memory that a sort carves all of its scratch buffers and thread parameters out of, and that is
+/// reused by the next sort, so a program that keeps sorting stops calling malloc once the block is big enough.
+///
+/// Allocations only bump an offset; nothing is freed on its own. arena_reset makes the whole block available again
+/// once a sort is done. A sort that needs more than the block holds still gets its memory, from separate overflow
+/// blocks, and the arena remembers how much it took: the next arena_reset replaces the block with one that big,
+/// so the same sort fits from then on.
+///
+/// An arena is used by one thread at a time. The sorting engine allocates on the thread that starts the sort only.
+///
+/// The block, the overflow blocks and the allocations without an arena are big buffers (see huge_alloc), so scans and
+/// scatters over gigabytes of scratch memory take one TLB entry per 2 MB instead of one per 4 KB page.
+
+#ifndef MULTITHREADED_SORTING_ARENA_H
+#define MULTITHREADED_SORTING_ARENA_H
+
+#include <stddef.h>
+
+// Every allocation starts on its own cache line, so buffers and parameters of different threads never share one
+#define ARENA_ALIGNMENT 64
+
+typedef struct ArenaOverflow ArenaOverflow;
+
+typedef struct Arena {
+    char* block;
+    size_t capacity;
+    // Bytes handed out since the last reset, including those that had to come from overflow blocks
+    size_t used;
+    // Allocations that did not fit the block, freed by the next reset
+    ArenaOverflow* overflow;
+} Arena;
+
+// Sets up an arena with a block of capacity bytes (0 allocates nothing until the first reset after a sort).
+// Returns 0, or -1 after printing the reason to stderr.
+int arena_init(Arena* arena, size_t capacity);
+
+// Frees the block and any overflow blocks
+void arena_release(Arena* arena);
+
+// Returns bytes of memory aligned to ARENA_ALIGNMENT, or NULL, after printing the reason to stderr, if even an
+// overflow block could not be allocated. With a NULL arena this is huge_alloc.
+void* arena_alloc(Arena* arena, size_t bytes);
+
+// Gives back memory from arena_alloc. Arena memory is only reclaimed by arena_reset, so this only frees memory
+// of a NULL arena, which lets code that may or may not have an arena free its memory the same way either way.
+void arena_free(Arena* arena, void* memory);
+
+// Makes the whole block available again and frees the overflow blocks. If they were needed, the block is first
+// grown to what was used since the last reset. Nothing allocated from the arena may be used afterwards.
+void arena_reset(Arena* arena);
+
+
+
+//// BIG BUFFERS
+/// For the big buffers of a sort (input copies, results, scratch), which are scanned from end to end by every merge
+/// level and radix pass. Buffers of at least HUGE_PAGE_BYTES are mapped from the kernel on a huge page boundary and
+/// backed by huge pages: explicit ones (MAP_HUGETLB) if the system has reserved any, else transparent huge pages,
+/// which madvise asks for even when they are only enabled on request. Smaller buffers come from aligned_alloc.
+/// Pages are not touched here, so each one is still placed on the NUMA node of the thread that first writes it.
+
+#define HUGE_PAGE_BYTES ((size_t)2 << 20)
+
+// Returns bytes of memory aligned to ARENA_ALIGNMENT, or NULL if there is none, like malloc
+void* huge_alloc(size_t bytes);
+
+// Frees memory from huge_alloc. NULL is ignored.
+void huge_free(void* memory);
+
+#endif //MULTITHREADED_SORTING_ARENA_H
@@ -0,0 +1,150 @@
+//// ARGSORT TEMPLATE
+/// Included by sort_impl.h, with its macros still defined, for every element type that has a descriptor, plus
+///     SORT_ORDER_KEY(a)     an unsigned integer, of type SORT_ORDER_KEY_TYPE, that orders element a the way SORT_LESS
+///     SORT_ORDER_KEY_TYPE   does: equal for elements that compare equal (default: the radix key of radix_impl.h)
+///
+/// An argsort writes the permutation that sorts the input instead of the sorted elements, so that several columns can
+/// be put in the order of one of them without sorting each. Every element becomes a (key, index) pair of its order key
+/// and its position, the pairs are sorted by the engine of an unsigned type, and the indices are read back out of them:
+///     - 32-bit keys and their index are packed into one uint64_t, key in the high half, and sorted as u64. Each pair
+///       is a single 8-byte word, which the radix sort, and the narrowing when the keys span a small range, handle at
+///       full speed.
+///     - 64-bit keys, and 32-bit keys of more than 2^32 elements, are sorted as KeyValueU64 pairs.
+/// Equal keys are ordered by their index either way, so the permutation is that of the stable sort.
+
+#ifndef SORT_ORDER_KEY
+#define SORT_ORDER_KEY(a) SORT_FN(radix_key)(a)
+#define SORT_ORDER_KEY_TYPE SORT_RADIX_KEY
+#endif
+
+
+//// STRUCTS
+// For each thread of the pack and unpack phases
+typedef struct {
+    // The slice [begin, end) of the elements that this thread works on
+    const SORT_TYPE* input;
+    size_t begin;
+    size_t end;
+    // Either packed (uint64_t) or pairs (KeyValueU64) is used
+    uint64_t* packed;
+    KeyValueU64* pairs;
+    // uint32_t or uint64_t indices, by indexSize
+    void* indices;
+    size_t indexSize;
+} SORT_FN(ArgsortThreadParameters);
+
+
+//// THREADS
+
+static void* SORT_FN(argsort_pack_thread)(void* arg) {
+    SORT_FN(ArgsortThreadParameters)* params = (SORT_FN(ArgsortThreadParameters)*) arg;
+    const SORT_TYPE* input = params->input;
+    if (params->packed != NULL) {
+        uint64_t* packed = params->packed;
+        for (size_t i = params->begin; i < params->end; i++) {
+            packed[i] = (uint64_t)SORT_ORDER_KEY(input[i]) << 32 | (uint64_t)i;
+        }
+    } else {
+        KeyValueU64* pairs = params->pairs;
+        for (size_t i = params->begin; i < params->end; i++) {
+            pairs[i].key = (uint64_t)SORT_ORDER_KEY(input[i]);
+            pairs[i].value = (uint64_t)i;
+        }
+    }
+    return NULL;
+}
+
+static void* SORT_FN(argsort_unpack_thread)(void* arg) {
+    SORT_FN(ArgsortThreadParameters)* params = (SORT_FN(ArgsortThreadParameters)*) arg;
+    const uint64_t* packed = params->packed;
+    const KeyValueU64* pairs = params->pairs;
+    if (params->indexSize == sizeof(uint32_t)) {
+        uint32_t* indices = params->indices;
+        for (size_t i = params->begin; i < params->end; i++) {
+            indices[i] = (uint32_t)(packed != NULL ? packed[i] : pairs[i].value);
+        }
+    } else {
+        uint64_t* indices = params->indices;
+        for (size_t i = params->begin; i < params->end; i++) {
+            indices[i] = packed != NULL ? (uint32_t)packed[i] : pairs[i].value;
+        }
+    }
+    return NULL;
+}
+
+
+//// ENTRY POINTS
+
+static int SORT_FN(argsort_with)(const SORT_TYPE* input, void* indices, size_t count, size_t indexSize,
+                                 unsigned int threads, const SortResources* resources) {
+    if (indexSize != sizeof(uint32_t) && indexSize != sizeof(uint64_t)) {
+        fprintf(stderr, "Indices are 4 or 8 bytes wide, not %zu.\n", indexSize);
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    if (indexSize == sizeof(uint32_t) && count - 1 > UINT32_MAX) {
+        fprintf(stderr, "%zu elements need 64-bit indices.\n", count);
+        return -1;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > count) {
+        threads = (unsigned int)count;
+    }
+
+    //// ALLOCATION
+    /// The pairs are sorted in place, so the pair buffer is the only one besides the scratch memory of the sort
+    Arena* arena = resources->arena;
+    int pack = sizeof(SORT_ORDER_KEY_TYPE) <= sizeof(uint32_t) && count - 1 <= UINT32_MAX;
+    SORT_FN(ArgsortThreadParameters)* params = arena_alloc(arena, sizeof(*params) * threads);
+    void* pairs = arena_alloc(arena, (pack ? sizeof(uint64_t) : sizeof(KeyValueU64)) * count);
+    if (params == NULL || pairs == NULL) {
+        fprintf(stderr, "Failed to allocate memory for sorting.\n");
+        arena_free(arena, params);
+        arena_free(arena, pairs);
+        return -1;
+    }
+    for (unsigned int t = 0; t < threads; t++) {
+        params[t].input = input;
+        // Lines of the 32-bit indices hold whole lines of the wider pairs and indices too
+        params[t].begin = slice_begin(t, count, threads, sizeof(uint32_t));
+        params[t].end = slice_begin(t + 1, count, threads, sizeof(uint32_t));
+        params[t].packed = pack ? pairs : NULL;
+        params[t].pairs = pack ? NULL : pairs;
+        params[t].indices = indices;
+        params[t].indexSize = indexSize;
+    }
+
+    //// PACK, SORT AND UNPACK
+    SortTrace* trace = resources->trace;
+    ThreadPool* pool = resources->pool;
+    trace_run(trace, "pack", 0, pool, SORT_FN(argsort_pack_thread), params, sizeof(*params), threads);
+    int status = pack ? parallel_sort_with_u64(pairs, pairs, count, threads, resources)
+                      : parallel_sort_with_kv_u64(pairs, pairs, count, threads, resources);
+    if (status == 0) {
+        trace_run(trace, "unpack", 0, pool, SORT_FN(argsort_unpack_thread), params, sizeof(*params), threads);
+    }
+
+    arena_free(arena, params);
+    arena_free(arena, pairs);
+    return status;
+}
+
+/// See sort.h for the contract.
+int SORT_FN(argsort)(const SORT_TYPE* input, void* indices, size_t count, size_t indexSize, unsigned int threads) {
+    SortResources resources = {shared_pool(), NULL, NULL};
+    return SORT_FN(argsort_with)(input, indices, count, indexSize, threads, &resources);
+}
+
+// For the element type descriptor
+static int SORT_FN(argsort_with_untyped)(const void* input, void* indices, size_t count, size_t indexSize,
+                                         unsigned int threads, const SortResources* resources) {
+    return SORT_FN(argsort_with)(input, indices, count, indexSize, threads, resources);
+}
+
+
+#undef SORT_ORDER_KEY
+#undef SORT_ORDER_KEY_TYPE
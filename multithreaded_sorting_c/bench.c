@@ -0,0 +1,456 @@
+//// BENCHMARK HARNESS
+/// Times the parallel merge sort in sort.c across input sizes, input distributions and thread counts,
+/// and prints one CSV row per combination so results can be compared between releases (and with the Rust
+/// version, whose `cargo bench` prints the same columns).
+///
+/// Usage: multithreaded_sorting_c_bench [-s min] [-n max] [-d dists] [-t threads] [-a algorithm] [-c cutoffs] [-k kernels] [-w narrowing] [-r reps] [-f type]
+///     -s  smallest input size in elements (default: 1000)
+///     -n  largest input size in elements (default: 1000000000); sizes grow by a factor of 10
+///     -d  comma separated distributions (default: all of uniform,sorted,reverse,few-unique,zipf,organ-pipe)
+///     -t  comma separated thread counts (default: 1, 2, 4, ... up to the number of online CPU cores)
+///     -a  sorting algorithm: auto, merge, radix or sample (default: auto, see sort.h)
+///     -c  comma separated insertion sort thresholds to try (default: the engine default, see sort.h)
+///     -k  vector kernels for i32 keys: auto, avx512, avx2, neon or scalar (default: auto, see simd.h)
+///     -w  key narrowing of integer types: on or off (default: on, see set_key_narrowing in sort.h)
+///     -r  timed repetitions per combination; the median is reported (default: 5)
+///     -f  element type: i32, i64, u32, u64, f32, f64, kv_i64 or kv_u64 (default: i32). The values of key-value
+///         pairs are their input positions, so the check of every output also verifies that the sort is stable.
+///
+/// CSV columns:
+///     implementation, type, distribution, size, threads, cutoff, repetitions, median_ns, ns_per_element, speedup
+/// implementation is "c", followed by "-merge", "-radix" or "-sample" when -a chose the algorithm, by "-wide" when -w
+/// turned key narrowing off, and by the name of the vector kernels when the i32 merge sort uses them (e.g. "c-avx512").
+/// cutoff is the insertion sort threshold of the row. speedup is the single-threaded median divided by this row's
+/// median, for the same size, distribution and cutoff.
+/// Every sorted output is checked, and the harness stops with an error if one is out of order.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "simd.h"
+#include "sort.h"
+
+// Distinct values of the few-unique distribution
+#define FEW_UNIQUE_VALUES 16
+// Number of distinct ranks the Zipf distribution draws from, and its exponent
+#define ZIPF_UNIVERSE 1000000
+#define ZIPF_EXPONENT 1.0
+// Upper bound on the thread counts and cutoffs that can be listed with -t and -c
+#define MAX_THREAD_COUNTS 64
+#define MAX_CUTOFFS 64
+
+
+//// INPUT DISTRIBUTIONS
+static const char* const distributions[] = {"uniform", "sorted", "reverse", "few-unique", "zipf", "organ-pipe"};
+#define DISTRIBUTION_COUNT (sizeof(distributions) / sizeof(*distributions))
+
+
+//// FUNCTION PROTOTYPES
+static uint64_t splitmix64(uint64_t* state);
+static int generate(const char* distribution, int64_t* keys, size_t count);
+static int compare_keys(const void* a, const void* b);
+static double median(double* samples, size_t count);
+static uint64_t now_ns(void);
+static int time_sort(const SortType* type, const void* input, void* output, size_t count, unsigned int threads,
+                     unsigned int repetitions, double* medianNs);
+static void convert_keys(const SortType* type, const int64_t* keys, void* elements, size_t count);
+static int is_sorted(const SortType* type, const void* data, size_t count);
+static size_t parse_list(const char* text, unsigned int* values, size_t capacity);
+static int parse_algorithm(const char* name, SortAlgorithm* algorithm);
+
+
+int main(int argc, char* argv[]) {
+    //// COMMAND LINE OPTIONS
+    size_t minSize = 1000;
+    size_t maxSize = 1000000000;
+    const char* distributionList = NULL;
+    unsigned int threadCounts[MAX_THREAD_COUNTS];
+    size_t threadCountCount = 0;
+    unsigned int cutoffs[MAX_CUTOFFS];
+    size_t cutoffCount = 0;
+    unsigned int repetitions = 5;
+    const SortType* type = &sort_type_i32;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:d:t:a:c:k:w:r:f:")) != -1) {
+        switch (opt) {
+            case 's':
+                minSize = strtoull(optarg, NULL, 10);
+                break;
+            case 'n':
+                maxSize = strtoull(optarg, NULL, 10);
+                break;
+            case 'd':
+                distributionList = optarg;
+                break;
+            case 't':
+                threadCountCount = parse_list(optarg, threadCounts, MAX_THREAD_COUNTS);
+                break;
+            case 'a': {
+                SortAlgorithm algorithm;
+                if (parse_algorithm(optarg, &algorithm) != 0) {
+                    fprintf(stderr, "Unknown algorithm: %s\n", optarg);
+                    return 1;
+                }
+                set_sort_algorithm(algorithm);
+                break;
+            }
+            case 'c':
+                cutoffCount = parse_list(optarg, cutoffs, MAX_CUTOFFS);
+                break;
+            case 'k':
+                if (select_simd_kernels(optarg) != 0) {
+                    fprintf(stderr, "Vector kernels not supported on this CPU: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'w':
+                if (strcmp(optarg, "on") != 0 && strcmp(optarg, "off") != 0) {
+                    fprintf(stderr, "Key narrowing is on or off, not %s\n", optarg);
+                    return 1;
+                }
+                set_key_narrowing(strcmp(optarg, "on") == 0);
+                break;
+            case 'r':
+                repetitions = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                type = find_sort_type(optarg);
+                if (type == NULL) {
+                    fprintf(stderr, "Unknown element type: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s min] [-n max] [-d dists] [-t threads] [-a algorithm] [-c cutoffs] [-k kernels] [-w narrowing] [-r reps] [-f type]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (minSize < 1 || repetitions < 1) {
+        fprintf(stderr, "Sizes and repetitions must be at least 1.\n");
+        return 1;
+    }
+
+    // Default thread counts: powers of two up to the core count, plus the core count itself
+    if (threadCountCount == 0) {
+        unsigned int cores = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+        for (unsigned int t = 1; t < cores && threadCountCount < MAX_THREAD_COUNTS - 1; t *= 2) {
+            threadCounts[threadCountCount++] = t;
+        }
+        threadCounts[threadCountCount++] = cores > 0 ? cores : 1;
+    }
+    if (cutoffCount == 0) {
+        cutoffs[cutoffCount++] = (unsigned int)get_insertion_sort_threshold();
+    }
+
+
+    //// ALLOCATION OF THE BENCHMARK BUFFERS
+    /// Keys are generated as int64 and converted to the element type (see convert_keys)
+    int64_t* keys = malloc(sizeof(int64_t) * maxSize);
+    char* input = malloc(type->elementSize * maxSize);
+    char* output = malloc(type->elementSize * maxSize);
+    if (keys == NULL || input == NULL || output == NULL) {
+        fprintf(stderr, "Failed to allocate memory for %zu elements; lower the largest size with -n.\n", maxSize);
+        return 1;
+    }
+
+    // Only the i32 merge sort has vector kernels
+    char implementation[32] = "c";
+    if (get_sort_algorithm() == SORT_ALGORITHM_MERGE) {
+        strcat(implementation, "-merge");
+    } else if (get_sort_algorithm() == SORT_ALGORITHM_RADIX) {
+        strcat(implementation, "-radix");
+    } else if (get_sort_algorithm() == SORT_ALGORITHM_SAMPLE) {
+        strcat(implementation, "-sample");
+    }
+    if (!get_key_narrowing()) {
+        strcat(implementation, "-wide");
+    }
+    if (type == &sort_type_i32 && get_sort_algorithm() != SORT_ALGORITHM_RADIX && simd_kernels()->merge != NULL) {
+        strcat(implementation, "-");
+        strcat(implementation, simd_kernels()->name);
+    }
+
+    printf("implementation,type,distribution,size,threads,cutoff,repetitions,median_ns,ns_per_element,speedup\n");
+    fflush(stdout);
+
+    int status = 0;
+    for (size_t d = 0; status == 0 && d < DISTRIBUTION_COUNT; d++) {
+        // Skip distributions that were not asked for
+        if (distributionList != NULL) {
+            const char* found = strstr(distributionList, distributions[d]);
+            size_t length = strlen(distributions[d]);
+            if (found == NULL || (found != distributionList && found[-1] != ',') ||
+                (found[length] != '\0' && found[length] != ',')) {
+                continue;
+            }
+        }
+
+        for (size_t size = minSize; status == 0 && size <= maxSize; size *= 10) {
+            //// GENERATE THE INPUT
+            if (generate(distributions[d], keys, size) != 0) {
+                status = -1;
+                break;
+            }
+            convert_keys(type, keys, input, size);
+
+            //// TIME EVERY CUTOFF AND THREAD COUNT
+            /// For each cutoff, the single-threaded median is measured first, as the baseline for the speedup column
+            for (size_t c = 0; status == 0 && c < cutoffCount; c++) {
+                set_insertion_sort_threshold(cutoffs[c]);
+                double baseline;
+                if (time_sort(type, input, output, size, 1, repetitions, &baseline) != 0) {
+                    status = -1;
+                    break;
+                }
+                for (size_t t = 0; t < threadCountCount; t++) {
+                    double medianNs = baseline;
+                    if (threadCounts[t] != 1 && time_sort(type, input, output, size, threadCounts[t], repetitions, &medianNs) != 0) {
+                        status = -1;
+                        break;
+                    }
+                    printf("%s,%s,%s,%zu,%u,%u,%u,%.0f,%.3f,%.3f\n", implementation, type->name, distributions[d], size, threadCounts[t],
+                           cutoffs[c], repetitions, medianNs, medianNs / (double)size, baseline / medianNs);
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    free(keys);
+    free(input);
+    free(output);
+    return status == 0 ? 0 : 1;
+}
+
+
+//// RANDOM NUMBERS
+/// splitmix64, a small fast generator with good statistical quality. The Rust benchmark uses the same
+/// generator and seeds, so both implementations sort the same inputs.
+static uint64_t splitmix64(uint64_t* state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+
+// Fills keys with count values drawn from the named distribution. Values fit in an int32.
+static int generate(const char* distribution, int64_t* keys, size_t count) {
+    uint64_t state = 42;
+
+    if (strcmp(distribution, "uniform") == 0) {
+        for (size_t i = 0; i < count; i++) {
+            keys[i] = (int32_t)splitmix64(&state);
+        }
+    } else if (strcmp(distribution, "sorted") == 0 || strcmp(distribution, "reverse") == 0) {
+        for (size_t i = 0; i < count; i++) {
+            keys[i] = (int32_t)splitmix64(&state);
+        }
+        qsort(keys, count, sizeof(int64_t), compare_keys);
+        if (strcmp(distribution, "reverse") == 0) {
+            for (size_t i = 0; i < count / 2; i++) {
+                int64_t swap = keys[i];
+                keys[i] = keys[count - 1 - i];
+                keys[count - 1 - i] = swap;
+            }
+        }
+    } else if (strcmp(distribution, "few-unique") == 0) {
+        for (size_t i = 0; i < count; i++) {
+            keys[i] = (int64_t)(splitmix64(&state) % FEW_UNIQUE_VALUES);
+        }
+    } else if (strcmp(distribution, "zipf") == 0) {
+        // Inverse transform sampling: rank r (1-based) has probability proportional to 1 / r^s.
+        // The cumulative distribution is tabulated once and searched with a binary search per key.
+        double* cdf = malloc(sizeof(double) * ZIPF_UNIVERSE);
+        if (cdf == NULL) {
+            fprintf(stderr, "Failed to allocate memory for the Zipf table.\n");
+            return -1;
+        }
+        double total = 0;
+        for (size_t r = 0; r < ZIPF_UNIVERSE; r++) {
+            total += 1.0 / pow((double)(r + 1), ZIPF_EXPONENT);
+            cdf[r] = total;
+        }
+        for (size_t i = 0; i < count; i++) {
+            double u = (double)(splitmix64(&state) >> 11) / 9007199254740992.0 * total;
+            size_t low = 0, high = ZIPF_UNIVERSE - 1;
+            while (low < high) {
+                size_t mid = low + (high - low) / 2;
+                if (cdf[mid] < u) {
+                    low = mid + 1;
+                } else {
+                    high = mid;
+                }
+            }
+            keys[i] = (int64_t)low;
+        }
+        free(cdf);
+    } else if (strcmp(distribution, "organ-pipe") == 0) {
+        // Ascending to the middle, then descending again
+        for (size_t i = 0; i < count; i++) {
+            keys[i] = (int64_t)(i < count / 2 ? i : count - i);
+        }
+    } else {
+        fprintf(stderr, "Unknown distribution: %s\n", distribution);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int compare_keys(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+
+//// TIMING
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+// Sorts input into output "repetitions" times and stores the median wall time in nanoseconds.
+// The input is only read by the engine, so every repetition sorts the same unsorted data.
+static int time_sort(const SortType* type, const void* input, void* output, size_t count, unsigned int threads,
+                     unsigned int repetitions, double* medianNs) {
+    double* samples = malloc(sizeof(double) * repetitions);
+    if (samples == NULL) {
+        fprintf(stderr, "Failed to allocate memory for timing samples.\n");
+        return -1;
+    }
+    for (unsigned int r = 0; r < repetitions; r++) {
+        uint64_t start = now_ns();
+        if (type->parallel_sort(input, output, count, threads) != 0) {
+            free(samples);
+            return -1;
+        }
+        samples[r] = (double)(now_ns() - start);
+    }
+    if (!is_sorted(type, output, count)) {
+        fprintf(stderr, "Output of %zu elements with %u threads is not sorted.\n", count, threads);
+        free(samples);
+        return -1;
+    }
+    *medianNs = median(samples, repetitions);
+    free(samples);
+    return 0;
+}
+
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double median(double* samples, size_t count) {
+    qsort(samples, count, sizeof(double), compare_doubles);
+    return count % 2 == 1 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+}
+
+
+// Converts the generated keys to the element type. 32-bit types keep the low bits, and the unsigned types order
+// negative keys after positive ones, so the key order of the generators only survives exactly for i64 and f64.
+static void convert_keys(const SortType* type, const int64_t* keys, void* elements, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (type == &sort_type_i32) {
+            ((int32_t*)elements)[i] = (int32_t)keys[i];
+        } else if (type == &sort_type_u32) {
+            ((uint32_t*)elements)[i] = (uint32_t)keys[i];
+        } else if (type == &sort_type_u64) {
+            ((uint64_t*)elements)[i] = (uint64_t)keys[i];
+        } else if (type == &sort_type_f32) {
+            ((float*)elements)[i] = (float)keys[i];
+        } else if (type == &sort_type_f64) {
+            ((double*)elements)[i] = (double)keys[i];
+        } else if (type == &sort_type_kv_i64) {
+            ((KeyValueI64*)elements)[i] = (KeyValueI64){keys[i], i};
+        } else if (type == &sort_type_kv_u64) {
+            ((KeyValueU64*)elements)[i] = (KeyValueU64){(uint64_t)keys[i], i};
+        } else {
+            ((int64_t*)elements)[i] = keys[i];
+        }
+    }
+}
+
+#define IS_SORTED(T)                                   \
+    for (size_t i = 1; i < count; i++) {               \
+        if (((const T*)data)[i] < ((const T*)data)[i - 1]) { \
+            return 0;                                  \
+        }                                              \
+    }
+
+// Pairs with equal keys must also be in the order of their values, which are their input positions
+#define IS_SORTED_STABLE(T)                                                 \
+    for (size_t i = 1; i < count; i++) {                                    \
+        const T* a = (const T*)data + i - 1;                                \
+        const T* b = a + 1;                                                 \
+        if (b->key < a->key || (b->key == a->key && b->value < a->value)) { \
+            return 0;                                                       \
+        }                                                                   \
+    }
+
+static int is_sorted(const SortType* type, const void* data, size_t count) {
+    if (type == &sort_type_i32) {
+        IS_SORTED(int32_t)
+    } else if (type == &sort_type_u32) {
+        IS_SORTED(uint32_t)
+    } else if (type == &sort_type_u64) {
+        IS_SORTED(uint64_t)
+    } else if (type == &sort_type_f32) {
+        IS_SORTED(float)
+    } else if (type == &sort_type_f64) {
+        IS_SORTED(double)
+    } else if (type == &sort_type_kv_i64) {
+        IS_SORTED_STABLE(KeyValueI64)
+    } else if (type == &sort_type_kv_u64) {
+        IS_SORTED_STABLE(KeyValueU64)
+    } else {
+        IS_SORTED(int64_t)
+    }
+    return 1;
+}
+
+
+// Parses a comma separated list of positive numbers into values. Returns how many were parsed.
+static size_t parse_list(const char* text, unsigned int* values, size_t capacity) {
+    size_t count = 0;
+    while (*text != '\0' && count < capacity) {
+        char* end;
+        unsigned long value = strtoul(text, &end, 10);
+        if (end == text) {
+            break;
+        }
+        if (value > 0) {
+            values[count++] = (unsigned int)value;
+        }
+        text = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+// Parses the name of a sorting algorithm. Returns 0 on success, or -1 if the name is unknown.
+static int parse_algorithm(const char* name, SortAlgorithm* algorithm) {
+    if (strcmp(name, "auto") == 0) {
+        *algorithm = SORT_ALGORITHM_AUTO;
+    } else if (strcmp(name, "merge") == 0) {
+        *algorithm = SORT_ALGORITHM_MERGE;
+    } else if (strcmp(name, "radix") == 0) {
+        *algorithm = SORT_ALGORITHM_RADIX;
+    } else if (strcmp(name, "sample") == 0) {
+        *algorithm = SORT_ALGORITHM_SAMPLE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,589 @@
+//// DISTRIBUTED SORT
+/// See distsort.h for an overview. Every pair of nodes shares one TCP connection, opened by the node of the higher
+/// rank. Messages are raw native-endian uint64_t counts and elements, in a fixed order that every node follows, so
+/// none of them needs a header:
+///     hello       rank, node count and element size of the connecting node, checked by the accepting one
+///     samples     a count and that many sampled elements, from every node to node 0
+///     splitters   nodeCount - 1 elements, from node 0 to every node
+///     counts      the number of elements of the range that a node sends to another
+///     range       those elements
+
+// For getaddrinfo and the other socket calls, which strict C leaves out
+#define _POSIX_C_SOURCE 200809L
+
+#include "distsort.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "io.h"
+#include "mtsort.h"
+
+// Samples that every node takes of its sorted input. With s samples per node, no node receives much more than
+// count / nodeCount + count / s elements, unless many elements are equal.
+#define SAMPLES_PER_NODE 1024
+
+// How long a node keeps trying to reach the nodes that have not started listening yet
+#define CONNECT_TIMEOUT_SECONDS 60
+
+// Pause between two attempts to reach a node
+#define CONNECT_RETRY_NANOSECONDS 100000000L
+
+// Most bytes handed to one send or recv call, so that a huge range does not hog one connection
+#define TRANSFER_BYTES ((size_t)1 << 20)
+
+
+//// STRUCTS
+
+// The connections of one node, set up by the mesh thread while the input is sorted
+typedef struct {
+    const DistributedSortOptions* options;
+    // The socket connected to every other node, -1 for this node
+    int* sockets;
+    // 0, or -1 if the mesh could not be set up (the reason was printed)
+    int status;
+} Mesh;
+
+// The sender thread of the exchange
+typedef struct {
+    const Mesh* mesh;
+    // The sorted input, and where the range of every node starts in it: node i gets [bounds[i], bounds[i + 1])
+    const char* sorted;
+    const size_t* bounds;
+    size_t elementSize;
+    // 0, or errno of the failed send
+    int error;
+} Sender;
+
+
+//// FUNCTION PROTOTYPES
+
+static int send_all(int socket, const void* data, size_t bytes);
+static int recv_all(int socket, void* data, size_t bytes);
+static int split_node(const char* node, char* host, size_t hostSize, char* port, size_t portSize);
+static int listen_on(const char* node);
+static int connect_to(const char* node);
+static void* mesh_thread(void* arg);
+static int agree_on_splitters(const Mesh* mesh, const char* sorted, size_t count, char* splitters);
+static int exchange_ranges(const Mesh* mesh, const char* sorted, const size_t* bounds, char** shard,
+                           size_t* shardCount);
+static void* sender_thread(void* arg);
+
+
+//// ENTRY POINT
+
+int distributed_sort(const char* inputPath, const char* outputPath, const DistributedSortOptions* options) {
+    if (options->rank >= options->nodeCount) {
+        fprintf(stderr, "Node %u is not one of the %u nodes.\n", options->rank, options->nodeCount);
+        return -1;
+    }
+    const SortType* type = options->type;
+    size_t elementSize = type->elementSize;
+    InputBuffer input = {0};
+    if (read_input(inputPath, elementSize, &input) != 0) {
+        return -1;
+    }
+    size_t count = input.count;
+    unsigned int nodeCount = options->nodeCount;
+
+    //// CONNECT WHILE SORTING
+    /// The other nodes may still be starting, so the mesh is set up in the background while the input is sorted
+    Mesh mesh = {options, malloc(sizeof(int) * nodeCount), -1};
+    char* sorted = huge_alloc(count * elementSize);
+    char* splitters = malloc(nodeCount > 1 ? (nodeCount - 1) * elementSize : 1);
+    size_t* bounds = malloc(sizeof(size_t) * (nodeCount + 1));
+    MtsortContext* context = mtsort_ctx_create(options->threads, count * elementSize);
+    if (mesh.sockets == NULL || sorted == NULL || splitters == NULL || bounds == NULL || context == NULL) {
+        fprintf(stderr, "Failed to allocate memory for sorting.\n");
+        free(mesh.sockets);
+        huge_free(sorted);
+        free(splitters);
+        free(bounds);
+        mtsort_ctx_destroy(context);
+        release_input(&input);
+        return -1;
+    }
+    for (unsigned int n = 0; n < nodeCount; n++) {
+        mesh.sockets[n] = -1;
+    }
+    pthread_t connector;
+    int connecting = pthread_create(&connector, NULL, mesh_thread, &mesh) == 0;
+    if (!connecting) {
+        fprintf(stderr, "Failed to create the thread that connects the nodes.\n");
+    }
+    int status = mtsort_sort_into(context, type, input.data, sorted, count);
+    release_input(&input);
+    if (connecting) {
+        pthread_join(connector, NULL);
+    }
+    status = status == 0 && connecting ? mesh.status : -1;
+
+    //// SPLIT, EXCHANGE AND MERGE
+    char* shard = NULL;
+    size_t shardCount = 0;
+    if (status == 0) {
+        status = agree_on_splitters(&mesh, sorted, count, splitters);
+    }
+    if (status == 0) {
+        bounds[0] = 0;
+        for (unsigned int n = 1; n < nodeCount; n++) {
+            bounds[n] = type->upper_bound(sorted, count, splitters + (n - 1) * elementSize);
+            // Splitters come sorted, but equal ones must not make a range end before it starts
+            bounds[n] = bounds[n] < bounds[n - 1] ? bounds[n - 1] : bounds[n];
+        }
+        bounds[nodeCount] = count;
+        status = exchange_ranges(&mesh, sorted, bounds, &shard, &shardCount);
+    }
+    huge_free(sorted);
+    if (status == 0) {
+        status = mtsort_sort(context, type, shard, shardCount);
+    }
+    if (status == 0) {
+        status = write_output(outputPath, shard, shardCount, elementSize);
+    }
+
+    for (unsigned int n = 0; n < nodeCount; n++) {
+        if (mesh.sockets[n] >= 0) {
+            close(mesh.sockets[n]);
+        }
+    }
+    free(mesh.sockets);
+    huge_free(shard);
+    free(splitters);
+    free(bounds);
+    mtsort_ctx_destroy(context);
+    return status;
+}
+
+
+//// SOCKETS
+
+// Sends all bytes, retrying short sends. Returns 0, or -1 with errno set. A closed connection fails with EPIPE
+// instead of raising SIGPIPE.
+static int send_all(int socket, const void* data, size_t bytes) {
+    const char* next = data;
+    while (bytes > 0) {
+        ssize_t sent = send(socket, next, bytes < TRANSFER_BYTES ? bytes : TRANSFER_BYTES, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        next += sent;
+        bytes -= (size_t)sent;
+    }
+    return 0;
+}
+
+// Receives exactly bytes bytes. Returns 0, or -1 with errno set, to ECONNRESET if the other node closed the
+// connection first.
+static int recv_all(int socket, void* data, size_t bytes) {
+    char* next = data;
+    while (bytes > 0) {
+        ssize_t got = recv(socket, next, bytes < TRANSFER_BYTES ? bytes : TRANSFER_BYTES, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            errno = got == 0 ? ECONNRESET : errno;
+            return -1;
+        }
+        next += got;
+        bytes -= (size_t)got;
+    }
+    return 0;
+}
+
+// Splits "host:port", or "[host]:port" for IPv6 addresses. Returns 0, or -1 if node has no port or is too long.
+static int split_node(const char* node, char* host, size_t hostSize, char* port, size_t portSize) {
+    const char* colon = strrchr(node, ':');
+    if (colon == NULL || colon[1] == '\0' || strlen(colon + 1) >= portSize) {
+        return -1;
+    }
+    const char* begin = node;
+    const char* end = colon;
+    if (*begin == '[' && end > begin && end[-1] == ']') {
+        begin++;
+        end--;
+    }
+    if ((size_t)(end - begin) >= hostSize) {
+        return -1;
+    }
+    memcpy(host, begin, (size_t)(end - begin));
+    host[end - begin] = '\0';
+    strcpy(port, colon + 1);
+    return 0;
+}
+
+// Listens on the port of node, on all addresses. Returns the socket, or -1 after printing the reason to stderr.
+static int listen_on(const char* node) {
+    char host[256];
+    char port[16];
+    if (split_node(node, host, sizeof(host), port, sizeof(port)) != 0) {
+        fprintf(stderr, "Invalid node address: %s\n", node);
+        return -1;
+    }
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo* addresses;
+    int result = getaddrinfo(NULL, port, &hints, &addresses);
+    if (result != 0) {
+        fprintf(stderr, "Invalid port of %s: %s\n", node, gai_strerror(result));
+        return -1;
+    }
+    int listener = -1;
+    for (struct addrinfo* address = addresses; address != NULL && listener < 0; address = address->ai_next) {
+        listener = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (listener < 0) {
+            continue;
+        }
+        int yes = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(listener, address->ai_addr, address->ai_addrlen) != 0 || listen(listener, SOMAXCONN) != 0) {
+            close(listener);
+            listener = -1;
+        }
+    }
+    if (listener < 0) {
+        fprintf(stderr, "Failed to listen on port %s: %s\n", port, strerror(errno));
+    }
+    freeaddrinfo(addresses);
+    return listener;
+}
+
+// Connects to node, retrying while it is not listening yet. Returns the socket, or -1 after printing the reason.
+static int connect_to(const char* node) {
+    char host[256];
+    char port[16];
+    if (split_node(node, host, sizeof(host), port, sizeof(port)) != 0) {
+        fprintf(stderr, "Invalid node address: %s\n", node);
+        return -1;
+    }
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    time_t deadline = time(NULL) + CONNECT_TIMEOUT_SECONDS;
+    int error = 0;
+    do {
+        struct addrinfo* addresses;
+        int result = getaddrinfo(host, port, &hints, &addresses);
+        if (result != 0) {
+            fprintf(stderr, "Failed to resolve %s: %s\n", node, gai_strerror(result));
+            return -1;
+        }
+        for (struct addrinfo* address = addresses; address != NULL; address = address->ai_next) {
+            int connection = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (connection < 0) {
+                error = errno;
+                continue;
+            }
+            if (connect(connection, address->ai_addr, address->ai_addrlen) == 0) {
+                freeaddrinfo(addresses);
+                return connection;
+            }
+            error = errno;
+            close(connection);
+        }
+        freeaddrinfo(addresses);
+        struct timespec pause = {0, CONNECT_RETRY_NANOSECONDS};
+        nanosleep(&pause, NULL);
+    } while (time(NULL) < deadline);
+    fprintf(stderr, "Failed to connect to %s: %s\n", node, strerror(error));
+    return -1;
+}
+
+
+//// MESH
+/// Every node listens first, then connects to the nodes before it and accepts the nodes after it. Connections are
+/// queued by the listening socket until they are accepted, so no order of starting the nodes can deadlock.
+
+static void* mesh_thread(void* arg) {
+    Mesh* mesh = (Mesh*) arg;
+    const DistributedSortOptions* options = mesh->options;
+    unsigned int rank = options->rank;
+    unsigned int nodeCount = options->nodeCount;
+    uint64_t hello[3] = {rank, nodeCount, options->type->elementSize};
+    mesh->status = -1;
+    // The last node is only ever the connecting side
+    int listener = -1;
+    if (rank + 1 < nodeCount && (listener = listen_on(options->nodes[rank])) < 0) {
+        return NULL;
+    }
+
+    int status = 0;
+    for (unsigned int n = 0; n < rank && status == 0; n++) {
+        mesh->sockets[n] = connect_to(options->nodes[n]);
+        if (mesh->sockets[n] < 0 || send_all(mesh->sockets[n], hello, sizeof(hello)) != 0) {
+            if (mesh->sockets[n] >= 0) {
+                fprintf(stderr, "Failed to greet %s: %s\n", options->nodes[n], strerror(errno));
+            }
+            status = -1;
+        }
+    }
+    for (unsigned int accepted = rank + 1; accepted < nodeCount && status == 0; accepted++) {
+        // A node that failed before connecting would otherwise be waited for forever
+        struct pollfd waiting = {listener, POLLIN, 0};
+        int ready = poll(&waiting, 1, CONNECT_TIMEOUT_SECONDS * 1000);
+        int connection = ready > 0 ? accept(listener, NULL, NULL) : -1;
+        uint64_t peer[3];
+        if (ready == 0) {
+            fprintf(stderr, "Timed out waiting for %u more nodes to connect.\n", nodeCount - accepted);
+            status = -1;
+        } else if (connection < 0 || recv_all(connection, peer, sizeof(peer)) != 0) {
+            fprintf(stderr, "Failed to accept a node: %s\n", strerror(errno));
+            status = -1;
+        } else if (peer[0] <= rank || peer[0] >= nodeCount || peer[1] != nodeCount || peer[2] != hello[2] ||
+                   mesh->sockets[peer[0]] >= 0) {
+            fprintf(stderr, "Node %" PRIu64 " of %" PRIu64 " with %" PRIu64 "-byte elements does not belong with "
+                    "node %u of %u with %" PRIu64 "-byte elements.\n", peer[0], peer[1], peer[2], rank, nodeCount,
+                    hello[2]);
+            status = -1;
+        } else {
+            mesh->sockets[peer[0]] = connection;
+            connection = -1;
+        }
+        if (connection >= 0) {
+            close(connection);
+        }
+    }
+    if (listener >= 0) {
+        close(listener);
+    }
+
+    // Small messages such as the splitters must not wait for more data to fill a packet
+    for (unsigned int n = 0; n < nodeCount && status == 0; n++) {
+        int yes = 1;
+        if (mesh->sockets[n] >= 0) {
+            setsockopt(mesh->sockets[n], IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        }
+    }
+    mesh->status = status;
+    return NULL;
+}
+
+
+//// SPLITTERS
+/// Node 0 gathers evenly spaced samples of every sorted input, sorts them, and takes the samples at every
+/// 1/nodeCount of the way as the splitters, so the ranges between them hold about the same number of elements.
+
+// Writes the nodeCount - 1 splitters to splitters. Returns 0, or -1 after printing the reason to stderr.
+static int agree_on_splitters(const Mesh* mesh, const char* sorted, size_t count, char* splitters) {
+    const DistributedSortOptions* options = mesh->options;
+    unsigned int nodeCount = options->nodeCount;
+    size_t elementSize = options->type->elementSize;
+    if (nodeCount == 1) {
+        return 0;
+    }
+    uint64_t sampleCount = count < SAMPLES_PER_NODE ? count : SAMPLES_PER_NODE;
+    char* samples = malloc((options->rank == 0 ? nodeCount * SAMPLES_PER_NODE : sampleCount) * elementSize + 1);
+    if (samples == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the samples.\n");
+        return -1;
+    }
+    for (uint64_t s = 0; s < sampleCount; s++) {
+        memcpy(samples + s * elementSize, sorted + (2 * s + 1) * count / (2 * sampleCount) * elementSize, elementSize);
+    }
+
+    int status = 0;
+    if (options->rank != 0) {
+        int socket = mesh->sockets[0];
+        if (send_all(socket, &sampleCount, sizeof(sampleCount)) != 0 ||
+            send_all(socket, samples, sampleCount * elementSize) != 0 ||
+            recv_all(socket, splitters, (nodeCount - 1) * elementSize) != 0) {
+            fprintf(stderr, "Failed to agree on the splitters with %s: %s\n", options->nodes[0], strerror(errno));
+            status = -1;
+        }
+        free(samples);
+        return status;
+    }
+
+    // Node 0 appends the samples of the other nodes to its own
+    uint64_t total = sampleCount;
+    for (unsigned int n = 1; n < nodeCount && status == 0; n++) {
+        uint64_t got = 0;
+        if (recv_all(mesh->sockets[n], &got, sizeof(got)) != 0 || got > SAMPLES_PER_NODE ||
+            recv_all(mesh->sockets[n], samples + total * elementSize, got * elementSize) != 0) {
+            fprintf(stderr, "Failed to receive the samples of %s: %s\n", options->nodes[n],
+                    got > SAMPLES_PER_NODE ? "too many" : strerror(errno));
+            status = -1;
+            break;
+        }
+        total += got;
+    }
+    if (status == 0) {
+        status = options->type->parallel_sort(samples, samples, total, options->threads);
+    }
+    if (status == 0) {
+        // Without any elements there is nothing to split, but the other nodes still wait for splitters
+        memset(splitters, 0, (nodeCount - 1) * elementSize);
+        for (unsigned int n = 1; n < nodeCount && total > 0; n++) {
+            memcpy(splitters + (n - 1) * elementSize, samples + n * total / nodeCount * elementSize, elementSize);
+        }
+        for (unsigned int n = 1; n < nodeCount && status == 0; n++) {
+            if (send_all(mesh->sockets[n], splitters, (nodeCount - 1) * elementSize) != 0) {
+                fprintf(stderr, "Failed to send the splitters to %s: %s\n", options->nodes[n], strerror(errno));
+                status = -1;
+            }
+        }
+    }
+    free(samples);
+    return status;
+}
+
+
+//// EXCHANGE
+/// Every node first tells every other how many elements it is going to send, so that the shard can be allocated
+/// with the range of every node at its place: the ranges are laid out in node order. Then the sender thread sends
+/// the ranges, starting with the next node, so that not every node sends to node 0 first, while the calling thread
+/// copies the node's own range and polls all connections, receiving whatever arrives.
+
+// Sets *shard to a buffer from huge_alloc with the *shardCount elements that this node received, and its own.
+// Returns 0, or -1 after printing the reason to stderr.
+static int exchange_ranges(const Mesh* mesh, const char* sorted, const size_t* bounds, char** shard,
+                           size_t* shardCount) {
+    const DistributedSortOptions* options = mesh->options;
+    unsigned int nodeCount = options->nodeCount;
+    unsigned int rank = options->rank;
+    size_t elementSize = options->type->elementSize;
+
+    //// COUNTS
+    /// Ranges arrive at receivedBytes[n] of the shard, which starts at offsets[n]
+    size_t* offsets = calloc(nodeCount + 1, sizeof(size_t));
+    size_t* receivedBytes = calloc(nodeCount, sizeof(size_t));
+    struct pollfd* polls = malloc(sizeof(struct pollfd) * nodeCount);
+    if (offsets == NULL || receivedBytes == NULL || polls == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the exchange.\n");
+        free(offsets);
+        free(receivedBytes);
+        free(polls);
+        return -1;
+    }
+    int status = 0;
+    for (unsigned int n = 0; n < nodeCount && status == 0; n++) {
+        uint64_t sending = bounds[n + 1] - bounds[n];
+        if (n != rank && send_all(mesh->sockets[n], &sending, sizeof(sending)) != 0) {
+            fprintf(stderr, "Failed to send the range size to %s: %s\n", options->nodes[n], strerror(errno));
+            status = -1;
+        }
+    }
+    for (unsigned int n = 0; n < nodeCount && status == 0; n++) {
+        uint64_t receiving = bounds[n + 1] - bounds[n];
+        if (n != rank && recv_all(mesh->sockets[n], &receiving, sizeof(receiving)) != 0) {
+            fprintf(stderr, "Failed to receive the range size of %s: %s\n", options->nodes[n], strerror(errno));
+            status = -1;
+        }
+        offsets[n + 1] = offsets[n] + (size_t)receiving * elementSize;
+    }
+    *shard = status == 0 ? huge_alloc(offsets[nodeCount]) : NULL;
+    if (status == 0 && *shard == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the shard.\n");
+        status = -1;
+    }
+
+    //// SEND AND RECEIVE
+    Sender sender = {mesh, sorted, bounds, elementSize, 0};
+    pthread_t thread;
+    int sending = status == 0 && pthread_create(&thread, NULL, sender_thread, &sender) == 0;
+    if (status == 0 && !sending) {
+        fprintf(stderr, "Failed to create the sender thread.\n");
+        status = -1;
+    }
+    if (status == 0) {
+        memcpy(*shard + offsets[rank], sorted + bounds[rank] * elementSize, offsets[rank + 1] - offsets[rank]);
+        receivedBytes[rank] = offsets[rank + 1] - offsets[rank];
+    }
+    while (status == 0) {
+        nfds_t pollCount = 0;
+        for (unsigned int n = 0; n < nodeCount; n++) {
+            if (receivedBytes[n] < offsets[n + 1] - offsets[n]) {
+                polls[pollCount].fd = mesh->sockets[n];
+                polls[pollCount].events = POLLIN;
+                pollCount++;
+            }
+        }
+        if (pollCount == 0) {
+            break;
+        }
+        if (poll(polls, pollCount, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to wait for the other nodes: %s\n", strerror(errno));
+            status = -1;
+            break;
+        }
+        for (unsigned int n = 0, p = 0; n < nodeCount && status == 0; n++) {
+            size_t wanted = offsets[n + 1] - offsets[n] - receivedBytes[n];
+            if (wanted == 0 || !(polls[p++].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            ssize_t got = recv(mesh->sockets[n], *shard + offsets[n] + receivedBytes[n],
+                               wanted < TRANSFER_BYTES ? wanted : TRANSFER_BYTES, 0);
+            if (got > 0) {
+                receivedBytes[n] += (size_t)got;
+            } else if (got == 0 || errno != EINTR) {
+                fprintf(stderr, "Failed to receive the range of %s: %s\n", options->nodes[n],
+                        got == 0 ? "connection closed" : strerror(errno));
+                status = -1;
+            }
+        }
+    }
+    if (sending) {
+        // A failed receive leaves the sender nothing to wait for: this unblocks it, and tells the other nodes
+        if (status != 0) {
+            for (unsigned int n = 0; n < nodeCount; n++) {
+                if (mesh->sockets[n] >= 0) {
+                    shutdown(mesh->sockets[n], SHUT_RDWR);
+                }
+            }
+        }
+        pthread_join(thread, NULL);
+        if (status == 0 && sender.error != 0) {
+            fprintf(stderr, "Failed to send a range: %s\n", strerror(sender.error));
+            status = -1;
+        }
+    }
+
+    *shardCount = offsets[nodeCount] / elementSize;
+    if (status != 0) {
+        huge_free(*shard);
+        *shard = NULL;
+        *shardCount = 0;
+    }
+    free(offsets);
+    free(receivedBytes);
+    free(polls);
+    return status;
+}
+
+static void* sender_thread(void* arg) {
+    Sender* sender = (Sender*) arg;
+    const DistributedSortOptions* options = sender->mesh->options;
+    unsigned int nodeCount = options->nodeCount;
+    for (unsigned int step = 1; step < nodeCount; step++) {
+        unsigned int n = (options->rank + step) % nodeCount;
+        const char* range = sender->sorted + sender->bounds[n] * sender->elementSize;
+        size_t bytes = (sender->bounds[n + 1] - sender->bounds[n]) * sender->elementSize;
+        if (send_all(sender->mesh->sockets[n], range, bytes) != 0) {
+            sender->error = errno;
+            break;
+        }
+    }
+    return NULL;
+}
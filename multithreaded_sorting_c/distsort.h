@@ -0,0 +1,47 @@
+//// DISTRIBUTED SORT
+/// Sorts an input that is spread over several machines, each of which holds a shard of it, so that every node ends up
+/// with one range of the sorted whole: the shard of node 0 holds the smallest elements, that of the last node the
+/// biggest ones, and the shards written by the nodes, concatenated in node order, are the sorted input.
+///
+/// How a distributed sort runs, on every node at once:
+///     1. Local sort: the node's input is sorted by the parallel engine, while a background thread connects it to
+///        every other node over TCP.
+///     2. Splitters: every node takes evenly spaced samples of its sorted input and sends them to node 0, which sorts
+///        them all and sends back one splitter per boundary between two shards.
+///     3. Exchange: the splitters cut the sorted input into one range per node, and every range is sent to its node
+///        straight out of the sorted array. A sender thread sends while the calling thread receives from all nodes
+///        at once, so the node's links carry data both ways.
+///     4. Merge: the ranges that arrived, each one sorted, are sorted by the parallel engine, which finds them as
+///        presorted runs and merges them.
+/// Equal elements end up on the same node, in the order of the node they came from, then of their input order, so
+/// the sort is stable over the inputs concatenated in node order. Many copies of one value all go to one node, which
+/// can make its shard bigger than the others.
+/// All nodes must run the same element type and the same list of nodes, and share their byte order.
+
+#ifndef MULTITHREADED_SORTING_DISTSORT_H
+#define MULTITHREADED_SORTING_DISTSORT_H
+
+#include <stddef.h>
+
+#include "sort.h"
+
+// Settings of one distributed sort
+typedef struct {
+    // Element type of the input and output
+    const SortType* type;
+    // Number of sorting threads of this node
+    unsigned int threads;
+    // "host:port" of every node, in the same order on every node
+    const char* const* nodes;
+    unsigned int nodeCount;
+    // This node's place in nodes. It listens on the port of its own entry, on all of its addresses.
+    unsigned int rank;
+} DistributedSortOptions;
+
+// Sorts the binary file at inputPath ("-" for stdin) together with the inputs of the other nodes, and writes this
+// node's range of the sorted whole to outputPath ("-" for stdout). Nodes that have not started yet are waited for
+// for up to a minute. Returns 0 on success, or -1 (after printing the reason to stderr) on failure, including that of
+// another node, which ends the sort on all of them.
+int distributed_sort(const char* inputPath, const char* outputPath, const DistributedSortOptions* options);
+
+#endif //MULTITHREADED_SORTING_DISTSORT_H
@@ -0,0 +1,706 @@
+//// EXTERNAL (OUT-OF-CORE) SORT
+/// See extsort.h for an overview.
+
+#include "extsort.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "io.h"
+#include "mtsort.h"
+
+// Smallest read buffer per run worth merging with. Below this, reads get too small for the disk to stream,
+// and it is better to merge fewer runs at a time and make an extra pass.
+#define MIN_MERGE_BUFFER_BYTES (1 << 20)
+
+// Chunk-sized buffers of run generation: the chunk being sorted, the one the I/O thread writes and then reads the next
+// chunk into, and the scratch buffer of the sort
+#define RUN_GENERATION_BUFFERS 3
+
+
+//// STRUCTS
+
+// A sorted run in a temporary file
+typedef struct {
+    // Byte offset of the first element in the file
+    off_t offset;
+    // Length of the run in bytes
+    off_t bytes;
+} Run;
+
+// Streams one run through two buffers: the merge consumes the active buffer while the prefetch thread fills the other.
+// active and position only change with the prefetcher's lock held.
+typedef struct {
+    const Run* run;
+    // Offset of the next byte of the run that has not been read yet
+    off_t position;
+    char* buffers[2];
+    // Number of bytes held by each buffer
+    size_t filled[2];
+    // Index of the buffer being merged
+    int active;
+    // Set when the other buffer holds the next part of the run
+    int spareReady;
+} RunReader;
+
+// Shared state of the prefetch thread and the merge that waits on it
+typedef struct {
+    pthread_mutex_t lock;
+    // Signalled whenever a buffer is filled or handed back, or on shutdown
+    pthread_cond_t changed;
+    // The file that holds the runs
+    int fd;
+    RunReader* readers;
+    size_t readerCount;
+    size_t bufferBytes;
+    // Set by the merge to stop the prefetch thread
+    int stop;
+    // errno of a failed read, or 0
+    int error;
+} Prefetcher;
+
+// The I/O thread of run generation and of the merge output (see BACKGROUND I/O). The job fields are set by
+// chunk_io_submit, and the results by the thread; either side only touches them while pending says it owns them.
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // Signalled when a job is submitted or done, or on shutdown
+    pthread_cond_t changed;
+    int writeFd;
+    const void* writeData;
+    size_t writeBytes;
+    int readFd;
+    void* readBuffer;
+    size_t readBytes;
+    // Bytes read by the last job (less than readBytes only at the end of the input, -1 if reading failed), and the
+    // errno of its failed write or read, or 0
+    ssize_t got;
+    int writeError;
+    int readError;
+    // Set while a job is in flight
+    int pending;
+    // Set to stop the thread
+    int stop;
+} ChunkIo;
+
+
+//// FUNCTION PROTOTYPES
+static int create_temp_file(const char* tempDir);
+static int generate_runs(int inFd, const char* inputName, int outFd, const char* outputName, int* tempFd,
+                         Run** runs, size_t* runCount, const ExternalSortOptions* options);
+static int merge_runs(int fd, const Run* runs, size_t runCount, int outFd, const char* outputName,
+                      size_t bufferBytes, const SortType* type);
+static void* prefetch_thread(void* arg);
+static size_t refill(Prefetcher* prefetcher, RunReader* reader);
+static int chunk_io_start(ChunkIo* io);
+static void chunk_io_stop(ChunkIo* io);
+static void chunk_io_submit(ChunkIo* io, int writeFd, const void* writeData, size_t writeBytes, int readFd,
+                            void* readBuffer, size_t readBytes);
+static void chunk_io_wait(ChunkIo* io);
+static void* chunk_io_thread(void* arg);
+
+
+int external_sort(const char* inputPath, const char* outputPath, const ExternalSortOptions* options) {
+    const SortType* type = options->type;
+
+    //// OPEN THE INPUT AND OUTPUT
+    /// "-" stands for stdin and stdout. The input is read front to back exactly once, so read-ahead can be aggressive.
+    int inFd = strcmp(inputPath, "-") == 0 ? STDIN_FILENO : open(inputPath, O_RDONLY);
+    const char* inputName = inFd == STDIN_FILENO ? "stdin" : inputPath;
+    if (inFd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", inputName, strerror(errno));
+        return -1;
+    }
+    posix_fadvise(inFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int outFd = strcmp(outputPath, "-") == 0 ? STDOUT_FILENO : open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    const char* outputName = outFd == STDOUT_FILENO ? "stdout" : outputPath;
+    if (outFd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", outputName, strerror(errno));
+        if (inFd != STDIN_FILENO) {
+            close(inFd);
+        }
+        return -1;
+    }
+
+
+    //// RUN GENERATION
+    /// If the whole input fits into one chunk, generate_runs sorts it straight into the output and no runs are made
+    int tempFd = -1;
+    Run* runs = NULL;
+    size_t runCount = 0;
+    int status = generate_runs(inFd, inputName, outFd, outputName, &tempFd, &runs, &runCount, options);
+    if (inFd != STDIN_FILENO) {
+        close(inFd);
+    }
+
+
+    //// MERGE PASSES
+    /// Each run needs two read buffers, plus two buffers for the output, all of the same size.
+    /// The fan-in is as large as the budget allows while keeping every buffer at least MIN_MERGE_BUFFER_BYTES.
+    size_t fanIn = options->memoryBudget / MIN_MERGE_BUFFER_BYTES;
+    fanIn = fanIn > 4 ? (fanIn - 2) / 2 : 1;
+    if (fanIn < 2) {
+        fanIn = 2;
+    }
+    if (fanIn > KWAY_MAX_CURSORS) {
+        fanIn = KWAY_MAX_CURSORS;
+    }
+
+    while (status == 0 && runCount > fanIn) {
+        // Too many runs to merge at once: merge groups of fanIn runs into longer runs in a new temporary file
+        int nextFd = create_temp_file(options->tempDir);
+        size_t groupCount = (runCount + fanIn - 1) / fanIn;
+        Run* merged = malloc(sizeof(Run) * groupCount);
+        if (nextFd < 0 || merged == NULL) {
+            if (merged == NULL) {
+                fprintf(stderr, "Failed to allocate memory for merging.\n");
+            }
+            if (nextFd >= 0) {
+                close(nextFd);
+            }
+            free(merged);
+            status = -1;
+            break;
+        }
+
+        off_t offset = 0;
+        for (size_t g = 0; status == 0 && g < groupCount; g++) {
+            size_t first = g * fanIn;
+            size_t count = runCount - first < fanIn ? runCount - first : fanIn;
+            merged[g].offset = offset;
+            merged[g].bytes = 0;
+            for (size_t r = first; r < first + count; r++) {
+                merged[g].bytes += runs[r].bytes;
+            }
+            size_t bufferBytes = options->memoryBudget / (2 * count + 2);
+            status = merge_runs(tempFd, runs + first, count, nextFd, "temporary run file", bufferBytes, type);
+            offset += merged[g].bytes;
+        }
+
+        close(tempFd);
+        free(runs);
+        tempFd = nextFd;
+        runs = merged;
+        runCount = groupCount;
+    }
+
+    if (status == 0 && runCount > 0) {
+        status = merge_runs(tempFd, runs, runCount, outFd, outputName, options->memoryBudget / (2 * runCount + 2), type);
+    }
+
+
+    //// CLEAN UP
+    if (tempFd >= 0) {
+        close(tempFd);
+    }
+    free(runs);
+    if (outFd != STDOUT_FILENO && close(outFd) != 0 && status == 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", outputName, strerror(errno));
+        status = -1;
+    }
+    return status;
+}
+
+
+// Creates an anonymous temporary file in tempDir. It is unlinked right away and disappears when closed.
+static int create_temp_file(const char* tempDir) {
+    size_t length = strlen(tempDir) + sizeof("/mtsort-XXXXXX");
+    char* path = malloc(length);
+    if (path == NULL) {
+        fprintf(stderr, "Failed to allocate memory for a temporary file name.\n");
+        return -1;
+    }
+    snprintf(path, length, "%s/mtsort-XXXXXX", tempDir);
+
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create a temporary file in %s: %s\n", tempDir, strerror(errno));
+    } else {
+        unlink(path);
+    }
+    free(path);
+    return fd;
+}
+
+
+//// BACKGROUND I/O
+/// One job at a time: write a buffer out, then read the next one in, on a thread of its own, while the calling thread
+/// keeps the cores busy. Run generation writes the previous sorted chunk and reads the next chunk while the current
+/// chunk is being sorted, and the merge writes one output buffer while it fills the other, so the disk and the cores
+/// work at the same time and a pass takes about as long as the slower of the two.
+
+static int chunk_io_start(ChunkIo* io) {
+    memset(io, 0, sizeof(*io));
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->changed, NULL);
+    if (pthread_create(&io->thread, NULL, chunk_io_thread, io) != 0) {
+        perror("Failed to create I/O thread");
+        pthread_mutex_destroy(&io->lock);
+        pthread_cond_destroy(&io->changed);
+        return -1;
+    }
+    return 0;
+}
+
+// Waits for the job in flight, if any, and stops the thread
+static void chunk_io_stop(ChunkIo* io) {
+    chunk_io_wait(io);
+    pthread_mutex_lock(&io->lock);
+    io->stop = 1;
+    pthread_cond_broadcast(&io->changed);
+    pthread_mutex_unlock(&io->lock);
+    pthread_join(io->thread, NULL);
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->changed);
+}
+
+// Starts a job: writes writeBytes at writeData to writeFd (nothing if writeBytes is 0), and then reads up to readBytes
+// of readFd into readBuffer (nothing if readBuffer is NULL). The buffers must not be touched until chunk_io_wait.
+static void chunk_io_submit(ChunkIo* io, int writeFd, const void* writeData, size_t writeBytes, int readFd,
+                            void* readBuffer, size_t readBytes) {
+    pthread_mutex_lock(&io->lock);
+    io->writeFd = writeFd;
+    io->writeData = writeData;
+    io->writeBytes = writeBytes;
+    io->readFd = readFd;
+    io->readBuffer = readBuffer;
+    io->readBytes = readBytes;
+    io->pending = 1;
+    pthread_cond_broadcast(&io->changed);
+    pthread_mutex_unlock(&io->lock);
+}
+
+// Waits until the job in flight, if any, is done. Its results are then in got, writeError and readError.
+static void chunk_io_wait(ChunkIo* io) {
+    pthread_mutex_lock(&io->lock);
+    while (io->pending) {
+        pthread_cond_wait(&io->changed, &io->lock);
+    }
+    pthread_mutex_unlock(&io->lock);
+}
+
+static void* chunk_io_thread(void* arg) {
+    ChunkIo* io = arg;
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+        while (!io->pending && !io->stop) {
+            pthread_cond_wait(&io->changed, &io->lock);
+        }
+        if (!io->pending) {
+            break;
+        }
+        // The submitter leaves the job alone until pending is cleared, so it is carried out without the lock
+        pthread_mutex_unlock(&io->lock);
+        int writeError = 0;
+        int readError = 0;
+        ssize_t got = 0;
+        if (io->writeBytes > 0 && write_all(io->writeFd, io->writeData, io->writeBytes) != 0) {
+            writeError = errno;
+        }
+        if (io->readBuffer != NULL && writeError == 0) {
+            got = read_all(io->readFd, io->readBuffer, io->readBytes);
+            readError = got < 0 ? errno : 0;
+        }
+        pthread_mutex_lock(&io->lock);
+        io->got = got;
+        io->writeError = writeError;
+        io->readError = readError;
+        io->pending = 0;
+        pthread_cond_broadcast(&io->changed);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+
+//// RUN GENERATION
+/// Chunks are sorted in place by one sorting context (see mtsort.h), which keeps its threads and its scratch buffer
+/// from chunk to chunk. While a chunk is sorted, the I/O thread writes the previous one to the run file and then reads
+/// the next one into the same buffer, so two chunks are in memory next to the scratch buffer: a chunk takes a third
+/// of the budget.
+/// An input that fits into the first chunk is sorted straight into the output, without the I/O thread.
+static int generate_runs(int inFd, const char* inputName, int outFd, const char* outputName, int* tempFd,
+                         Run** runs, size_t* runCount, const ExternalSortOptions* options) {
+    size_t elementSize = options->type->elementSize;
+    size_t chunkElements = options->memoryBudget / (RUN_GENERATION_BUFFERS * elementSize);
+    if (chunkElements == 0) {
+        fprintf(stderr, "The memory budget of %zu bytes is too small to sort anything.\n", options->memoryBudget);
+        return -1;
+    }
+    size_t chunkBytes = chunkElements * elementSize;
+    // No need for chunks bigger than a regular input file; the first read then sees the end of the input
+    struct stat info;
+    if (fstat(inFd, &info) == 0 && S_ISREG(info.st_mode) && (off_t)chunkBytes > info.st_size) {
+        chunkBytes = (size_t)info.st_size + elementSize;
+    }
+
+    // The chunk being sorted and the one being written and read. Only the first is allocated up front.
+    char* chunks[2] = {huge_alloc(chunkBytes), NULL};
+    if (chunks[0] == NULL) {
+        fprintf(stderr, "Failed to allocate memory for sorting.\n");
+        return -1;
+    }
+    MtsortContext* context = mtsort_ctx_create(options->threads, chunkBytes);
+    if (context == NULL) {
+        huge_free(chunks[0]);
+        return -1;
+    }
+
+    //// READ THE FIRST CHUNK
+    int status = 0;
+    char* current = chunks[0];
+    ssize_t got = read_all(inFd, current, chunkBytes);
+    if (got < 0) {
+        fprintf(stderr, "Failed to read %s: %s\n", inputName, strerror(errno));
+        status = -1;
+    }
+
+    //// SHORTCUT FOR SMALL INPUTS
+    /// A first chunk that ends the input holds everything, so it is already the final output once sorted
+    if (status == 0 && (size_t)got < chunkBytes) {
+        if ((size_t)got % elementSize != 0) {
+            fprintf(stderr, "%s is not a whole number of %zu-byte elements\n", inputName, elementSize);
+            status = -1;
+        } else if (mtsort_sort(context, options->type, current, (size_t)got / elementSize) != 0) {
+            status = -1;
+        } else if (write_all(outFd, current, (size_t)got) != 0) {
+            fprintf(stderr, "Failed to write %s: %s\n", outputName, strerror(errno));
+            status = -1;
+        }
+        mtsort_ctx_destroy(context);
+        huge_free(current);
+        return status;
+    }
+
+    //// PIPELINE
+    /// Every step sorts the current chunk while the I/O thread writes the sorted chunk of the step before ("spill")
+    /// and then reads the chunk of the next step into its buffer. A short read ends the input.
+    ChunkIo io;
+    int ioStarted = 0;
+    if (status == 0) {
+        *tempFd = create_temp_file(options->tempDir);
+        status = *tempFd < 0 || chunk_io_start(&io) != 0 ? -1 : 0;
+        ioStarted = status == 0;
+    }
+    char* spill = NULL;
+    size_t spillBytes = 0;
+    size_t capacity = 0;
+    off_t offset = 0;
+    while (status == 0 && got > 0) {
+        if ((size_t)got % elementSize != 0) {
+            fprintf(stderr, "%s is not a whole number of %zu-byte elements\n", inputName, elementSize);
+            status = -1;
+            break;
+        }
+        // A full chunk may be followed by more input
+        char* next = NULL;
+        if ((size_t)got == chunkBytes) {
+            if (chunks[1] == NULL && (chunks[1] = huge_alloc(chunkBytes)) == NULL) {
+                fprintf(stderr, "Failed to allocate memory for sorting.\n");
+                status = -1;
+                break;
+            }
+            next = current == chunks[0] ? chunks[1] : chunks[0];
+        }
+        if (*runCount == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            Run* bigger = realloc(*runs, sizeof(Run) * capacity);
+            if (bigger == NULL) {
+                fprintf(stderr, "Failed to allocate memory for the run list.\n");
+                status = -1;
+                break;
+            }
+            *runs = bigger;
+        }
+
+        // Write the previous chunk and read the next one in the background, and sort this one meanwhile
+        chunk_io_submit(&io, *tempFd, spill, spillBytes, inFd, next, chunkBytes);
+        status = mtsort_sort(context, options->type, current, (size_t)got / elementSize);
+        chunk_io_wait(&io);
+        if (io.writeError != 0) {
+            fprintf(stderr, "Failed to write a temporary run: %s\n", strerror(io.writeError));
+            status = -1;
+        } else if (next != NULL && io.got < 0) {
+            fprintf(stderr, "Failed to read %s: %s\n", inputName, strerror(io.readError));
+            status = -1;
+        }
+
+        (*runs)[*runCount].offset = offset;
+        (*runs)[*runCount].bytes = (off_t)got;
+        (*runCount)++;
+        offset += (off_t)got;
+        spill = current;
+        spillBytes = (size_t)got;
+        current = next;
+        got = next != NULL ? io.got : 0;
+    }
+
+    //// SPILL THE LAST RUN
+    /// Nothing is left to overlap it with
+    if (status == 0 && spillBytes > 0 && write_all(*tempFd, spill, spillBytes) != 0) {
+        fprintf(stderr, "Failed to write a temporary run: %s\n", strerror(errno));
+        status = -1;
+    }
+
+    if (ioStarted) {
+        chunk_io_stop(&io);
+    }
+    mtsort_ctx_destroy(context);
+    huge_free(chunks[0]);
+    huge_free(chunks[1]);
+    return status;
+}
+
+
+//// K-WAY MERGE
+/// Merges runCount runs of fd into outFd. Every run streams through two buffers of bufferBytes each, and the merged
+/// output is collected in two more buffers of the same size: the I/O thread writes one out with a single large write
+/// while the merge fills the other.
+static int merge_runs(int fd, const Run* runs, size_t runCount, int outFd, const char* outputName,
+                      size_t bufferBytes, const SortType* type) {
+    size_t elementSize = type->elementSize;
+    // Buffers hold whole elements only, so a cursor never ends in the middle of one
+    bufferBytes -= bufferBytes % elementSize;
+    if (bufferBytes < elementSize) {
+        bufferBytes = elementSize;
+    }
+
+    //// ALLOCATION OF THE MERGE STATE
+    Prefetcher prefetcher;
+    prefetcher.fd = fd;
+    prefetcher.readerCount = runCount;
+    prefetcher.bufferBytes = bufferBytes;
+    prefetcher.stop = 0;
+    prefetcher.error = 0;
+    prefetcher.readers = calloc(runCount, sizeof(RunReader));
+    MergeCursor* cursors = malloc(sizeof(MergeCursor) * runCount);
+    // Maps each cursor to the reader that feeds it; cursors are dropped as their runs end
+    size_t* cursorReader = malloc(sizeof(size_t) * runCount);
+    char* outputs[2] = {huge_alloc(bufferBytes), huge_alloc(bufferBytes)};
+    int status = 0;
+    if (prefetcher.readers == NULL || cursors == NULL || cursorReader == NULL || outputs[0] == NULL ||
+        outputs[1] == NULL) {
+        status = -1;
+    }
+    for (size_t r = 0; status == 0 && r < runCount; r++) {
+        RunReader* reader = &prefetcher.readers[r];
+        reader->run = &runs[r];
+        reader->position = runs[r].offset;
+        reader->buffers[0] = huge_alloc(bufferBytes);
+        reader->buffers[1] = huge_alloc(bufferBytes);
+        if (reader->buffers[0] == NULL || reader->buffers[1] == NULL) {
+            status = -1;
+        }
+    }
+    if (status != 0) {
+        fprintf(stderr, "Failed to allocate memory for merging.\n");
+    }
+
+
+    //// START PREFETCHING
+    pthread_t thread;
+    int threadStarted = 0;
+    if (status == 0) {
+        pthread_mutex_init(&prefetcher.lock, NULL);
+        pthread_cond_init(&prefetcher.changed, NULL);
+        if (pthread_create(&thread, NULL, prefetch_thread, &prefetcher) != 0) {
+            perror("Failed to create prefetch thread");
+            pthread_mutex_destroy(&prefetcher.lock);
+            pthread_cond_destroy(&prefetcher.changed);
+            status = -1;
+        } else {
+            threadStarted = 1;
+        }
+    }
+    ChunkIo writer;
+    int writerStarted = status == 0 && chunk_io_start(&writer) == 0;
+    if (!writerStarted) {
+        status = -1;
+    }
+
+
+    //// MERGE LOOP
+    /// Every cursor that runs dry is refilled from its reader, or dropped when its run is over. Dropping keeps
+    /// the remaining cursors in run order, so equal keys still come out in the order of their runs.
+    size_t cursorCount = 0;
+    for (size_t r = 0; status == 0 && r < runCount; r++) {
+        size_t bytes = refill(&prefetcher, &prefetcher.readers[r]);
+        if (bytes > 0) {
+            cursors[cursorCount].next = prefetcher.readers[r].buffers[prefetcher.readers[r].active];
+            cursors[cursorCount].remaining = bytes / elementSize;
+            cursorReader[cursorCount] = r;
+            cursorCount++;
+        }
+    }
+
+    size_t outputCapacity = bufferBytes / elementSize;
+    size_t outputCount = 0;
+    char* output = outputs[0];
+    while (status == 0 && cursorCount > 0) {
+        outputCount += type->kway_merge(cursors, cursorCount, output + outputCount * elementSize, outputCapacity - outputCount);
+
+        if (outputCount == outputCapacity) {
+            // The other buffer is free once its write is done; then this one is written while the merge goes on
+            chunk_io_wait(&writer);
+            if (writer.writeError != 0) {
+                fprintf(stderr, "Failed to write %s: %s\n", outputName, strerror(writer.writeError));
+                status = -1;
+            }
+            chunk_io_submit(&writer, outFd, output, outputCount * elementSize, -1, NULL, 0);
+            output = output == outputs[0] ? outputs[1] : outputs[0];
+            outputCount = 0;
+        }
+
+        size_t kept = 0;
+        for (size_t c = 0; c < cursorCount; c++) {
+            RunReader* reader = &prefetcher.readers[cursorReader[c]];
+            if (cursors[c].remaining == 0) {
+                size_t bytes = refill(&prefetcher, reader);
+                if (bytes == 0) {
+                    continue;
+                }
+                cursors[c].next = reader->buffers[reader->active];
+                cursors[c].remaining = bytes / elementSize;
+            }
+            cursors[kept] = cursors[c];
+            cursorReader[kept] = cursorReader[c];
+            kept++;
+        }
+        cursorCount = kept;
+    }
+
+
+
+    //// STOP PREFETCHING
+    /// A failed read ends every run early (refill returns 0), so the merge loop above finishes quickly and the
+    /// error is reported here, once the prefetch thread can no longer change it.
+    if (threadStarted) {
+        pthread_mutex_lock(&prefetcher.lock);
+        prefetcher.stop = 1;
+        pthread_cond_broadcast(&prefetcher.changed);
+        pthread_mutex_unlock(&prefetcher.lock);
+        pthread_join(thread, NULL);
+        pthread_mutex_destroy(&prefetcher.lock);
+        pthread_cond_destroy(&prefetcher.changed);
+    }
+    if (status == 0 && prefetcher.error != 0) {
+        fprintf(stderr, "Failed to read a temporary run: %s\n", strerror(prefetcher.error));
+        status = -1;
+    }
+    if (writerStarted) {
+        chunk_io_stop(&writer);
+        if (status == 0 && writer.writeError != 0) {
+            fprintf(stderr, "Failed to write %s: %s\n", outputName, strerror(writer.writeError));
+            status = -1;
+        }
+    }
+    if (status == 0 && outputCount > 0 && write_all(outFd, output, outputCount * elementSize) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", outputName, strerror(errno));
+        status = -1;
+    }
+
+
+    //// CLEAN UP
+    if (prefetcher.readers != NULL) {
+        for (size_t r = 0; r < runCount; r++) {
+            huge_free(prefetcher.readers[r].buffers[0]);
+            huge_free(prefetcher.readers[r].buffers[1]);
+        }
+    }
+    free(prefetcher.readers);
+    free(cursors);
+    free(cursorReader);
+    huge_free(outputs[0]);
+    huge_free(outputs[1]);
+    return status;
+}
+
+
+//// PREFETCH THREAD
+/// Keeps the spare buffer of every run full. Runs are visited round robin, so all runs stay about equally far ahead
+/// of the merge. The thread sleeps when every spare buffer is full or every run has been read completely.
+static void* prefetch_thread(void* arg) {
+    Prefetcher* prefetcher = arg;
+    size_t next = 0;
+
+    pthread_mutex_lock(&prefetcher->lock);
+    while (!prefetcher->stop) {
+        // Find a run whose spare buffer is free and that still has data on disk
+        RunReader* reader = NULL;
+        for (size_t i = 0; i < prefetcher->readerCount; i++) {
+            RunReader* candidate = &prefetcher->readers[(next + i) % prefetcher->readerCount];
+            if (!candidate->spareReady && candidate->position < candidate->run->offset + candidate->run->bytes) {
+                reader = candidate;
+                next = (size_t)(candidate - prefetcher->readers) + 1;
+                break;
+            }
+        }
+        if (reader == NULL) {
+            pthread_cond_wait(&prefetcher->changed, &prefetcher->lock);
+            continue;
+        }
+
+        // The merge never touches the spare buffer while spareReady is clear, so it can be filled without the lock
+        int spare = 1 - reader->active;
+        off_t left = reader->run->offset + reader->run->bytes - reader->position;
+        size_t want = (off_t)prefetcher->bufferBytes < left ? prefetcher->bufferBytes : (size_t)left;
+        off_t position = reader->position;
+        pthread_mutex_unlock(&prefetcher->lock);
+
+        size_t total = 0;
+        int error = 0;
+        while (total < want) {
+            ssize_t got = pread(prefetcher->fd, reader->buffers[spare] + total, want - total, position + (off_t)total);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                error = got < 0 ? errno : EIO;
+                break;
+            }
+            total += (size_t)got;
+        }
+
+        pthread_mutex_lock(&prefetcher->lock);
+        if (error != 0) {
+            prefetcher->error = error;
+            pthread_cond_broadcast(&prefetcher->changed);
+            break;
+        }
+        reader->filled[spare] = total;
+        reader->position += (off_t)total;
+        reader->spareReady = 1;
+        pthread_cond_broadcast(&prefetcher->changed);
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+    return NULL;
+}
+
+
+// Makes the prefetched spare buffer of reader the active one, waiting for the prefetch thread if it is not full yet.
+// Returns the number of bytes in the new active buffer, or 0 once the run is over (or reading failed).
+static size_t refill(Prefetcher* prefetcher, RunReader* reader) {
+    size_t bytes = 0;
+    pthread_mutex_lock(&prefetcher->lock);
+    while (!reader->spareReady && prefetcher->error == 0 &&
+           reader->position < reader->run->offset + reader->run->bytes) {
+        pthread_cond_wait(&prefetcher->changed, &prefetcher->lock);
+    }
+    if (reader->spareReady) {
+        reader->active = 1 - reader->active;
+        reader->spareReady = 0;
+        bytes = reader->filled[reader->active];
+        // The old buffer is free now, so wake the prefetch thread to refill it
+        pthread_cond_broadcast(&prefetcher->changed);
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+    return bytes;
+}
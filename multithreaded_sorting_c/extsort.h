@@ -0,0 +1,38 @@
+//// EXTERNAL (OUT-OF-CORE) SORT
+/// Sorts inputs that are larger than the memory available for sorting.
+///
+/// How an external sort runs:
+///     1. Run generation: the input is read in chunks of a third of the memory budget. Each chunk is sorted by the
+///        parallel merge sort in sort.c and appended to a temporary file as one sorted run. An I/O thread writes
+///        the previous run and reads the next chunk while a chunk is being sorted.
+///     2. Merging: the runs are streamed back through large buffers and combined by a k-way merge. A prefetch
+///        thread reads the next buffer of every run while the current one is being merged, and the output is
+///        double-buffered so that a writer thread writes one half while the merge fills the other. When there are more
+///        runs than the budget (or KWAY_MAX_CURSORS) allows to merge at once, groups of runs are first merged
+///        into longer runs in another temporary file.
+/// Temporary files are unlinked as soon as they are created, so nothing is left behind if the program dies.
+
+#ifndef MULTITHREADED_SORTING_EXTSORT_H
+#define MULTITHREADED_SORTING_EXTSORT_H
+
+#include <stddef.h>
+
+#include "sort.h"
+
+// Settings of one external sort
+typedef struct {
+    // Element type of the input and output
+    const SortType* type;
+    // Number of sorting threads used for run generation
+    unsigned int threads;
+    // Upper bound, in bytes, on the buffers used for sorting and merging
+    size_t memoryBudget;
+    // Directory that holds the temporary run files
+    const char* tempDir;
+} ExternalSortOptions;
+
+// Sorts the binary file at inputPath ("-" for stdin) into outputPath ("-" for stdout).
+// Returns 0 on success, or -1 (after printing the reason to stderr) on failure.
+int external_sort(const char* inputPath, const char* outputPath, const ExternalSortOptions* options);
+
+#endif //MULTITHREADED_SORTING_EXTSORT_H
@@ -0,0 +1,217 @@
+//// INPUT AND OUTPUT
+/// See io.h for the file format.
+
+#include "io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The first chunk size used when streaming a pipe; the buffer doubles whenever it fills up
+#define STREAM_CHUNK_BYTES (1 << 20)
+
+
+//// FUNCTION PROTOTYPES
+static int map_file(int fd, size_t bytes, size_t elementSize, InputBuffer* input, const char* path);
+static int read_stream(int fd, size_t elementSize, InputBuffer* input, const char* path);
+
+
+int read_input(const char* path, size_t elementSize, InputBuffer* input) {
+    input->data = NULL;
+    input->count = 0;
+    input->mappedBytes = 0;
+
+    //// OPEN THE INPUT
+    /// "-" stands for stdin, which is usually a pipe but may also be redirected from a regular file
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd == STDIN_FILENO) {
+        path = "stdin";
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    //// PICK A LOADING STRATEGY
+    /// Only regular files have a known size and can be memory mapped
+    struct stat info;
+    int status;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+        status = map_file(fd, (size_t)info.st_size, elementSize, input, path);
+    } else {
+        status = read_stream(fd, elementSize, input, path);
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return status;
+}
+
+
+void release_input(InputBuffer* input) {
+    if (input->mappedBytes > 0) {
+        munmap(input->data, input->mappedBytes);
+    } else {
+        free(input->data);
+    }
+    input->data = NULL;
+    input->count = 0;
+    input->mappedBytes = 0;
+}
+
+
+int write_output(const char* path, const void* data, size_t count, size_t elementSize) {
+    int fd = strcmp(path, "-") == 0 ? STDOUT_FILENO : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == STDOUT_FILENO) {
+        path = "stdout";
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (write_all(fd, data, count * elementSize) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+        if (fd != STDOUT_FILENO) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    if (fd != STDOUT_FILENO && close(fd) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+ssize_t read_all(int fd, void* buffer, size_t bytes) {
+    //// READ LOOP
+    /// read() may return fewer bytes than asked for (pipes hand out whatever is buffered), so keep going until
+    /// the buffer is full or the stream ends
+    char* next = buffer;
+    size_t total = 0;
+    while (total < bytes) {
+        ssize_t got = read(fd, next + total, bytes - total);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (got == 0) {
+            break;
+        }
+        total += (size_t)got;
+    }
+    return (ssize_t)total;
+}
+
+
+int write_all(int fd, const void* data, size_t bytes) {
+    //// WRITE LOOP
+    /// write() may write fewer bytes than asked for (for example into a full pipe), so keep going until everything is out
+    const char* next = data;
+    while (bytes > 0) {
+        ssize_t written = write(fd, next, bytes);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        next += written;
+        bytes -= (size_t)written;
+    }
+    return 0;
+}
+
+
+// Maps a regular file of "bytes" bytes read-only
+static int map_file(int fd, size_t bytes, size_t elementSize, InputBuffer* input, const char* path) {
+    if (bytes % elementSize != 0) {
+        fprintf(stderr, "%s is %zu bytes, which is not a whole number of %zu-byte elements\n", path, bytes, elementSize);
+        return -1;
+    }
+    // mmap refuses zero-length mappings, and an empty file is simply an empty array
+    if (bytes == 0) {
+        return 0;
+    }
+
+    // MAP_POPULATE (Linux only) faults the whole file in up front with read-ahead, instead of taking one
+    // page fault per 4 KB page while the sorting threads run
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    void* data = mmap(NULL, bytes, PROT_READ, flags, fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // Every partition is scanned from front to back, so tell the kernel to read ahead aggressively
+    posix_madvise(data, bytes, POSIX_MADV_SEQUENTIAL);
+
+    input->data = data;
+    input->count = bytes / elementSize;
+    input->mappedBytes = bytes;
+    return 0;
+}
+
+
+// Reads a stream of unknown length until end of file
+static int read_stream(int fd, size_t elementSize, InputBuffer* input, const char* path) {
+    size_t capacity = STREAM_CHUNK_BYTES;
+    size_t length = 0;
+    char* buffer = malloc(capacity);
+    if (buffer == NULL) {
+        fprintf(stderr, "Failed to allocate memory for reading %s.\n", path);
+        return -1;
+    }
+
+    for (;;) {
+        // Double the buffer when it is full, so the total copying stays linear in the input size
+        if (length == capacity) {
+            char* bigger = realloc(buffer, capacity * 2);
+            if (bigger == NULL) {
+                fprintf(stderr, "Failed to allocate memory for reading %s.\n", path);
+                free(buffer);
+                return -1;
+            }
+            buffer = bigger;
+            capacity *= 2;
+        }
+
+        ssize_t got = read(fd, buffer + length, capacity - length);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+            free(buffer);
+            return -1;
+        }
+        if (got == 0) {
+            break;
+        }
+        length += (size_t)got;
+    }
+
+    if (length % elementSize != 0) {
+        fprintf(stderr, "%s is %zu bytes, which is not a whole number of %zu-byte elements\n", path, length, elementSize);
+        free(buffer);
+        return -1;
+    }
+
+    input->data = buffer;
+    input->count = length / elementSize;
+    return 0;
+}
@@ -0,0 +1,42 @@
+//// INPUT AND OUTPUT
+/// Loads the array to sort from a binary file or from stdin, and writes the sorted array back out.
+/// Files hold raw native-endian integers with no header, so an int32 file of n elements is exactly 4 * n bytes.
+
+#ifndef MULTITHREADED_SORTING_IO_H
+#define MULTITHREADED_SORTING_IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// The elements of a loaded input, and what must be done to release them
+typedef struct {
+    // Pointer to the first element. Read-only when the file is memory mapped.
+    void* data;
+    // Number of elements (not bytes)
+    size_t count;
+    // Length of the memory mapping, or 0 when data was allocated with malloc
+    size_t mappedBytes;
+} InputBuffer;
+
+// Loads the elements of "path" into input, where each element is elementSize bytes wide.
+// "-" reads stdin. Regular files are memory mapped read-only, so loading them costs no copy: the sorting threads
+// read straight from the page cache. Pipes, terminals and other streams that cannot be mapped are read in chunks
+// into a growing heap buffer instead.
+// Returns 0 on success, or -1 (after printing the reason to stderr) on failure.
+int read_input(const char* path, size_t elementSize, InputBuffer* input);
+
+// Unmaps or frees the memory held by input
+void release_input(InputBuffer* input);
+
+// Writes count elements of elementSize bytes to "path" ("-" writes stdout), replacing any existing file.
+// Returns 0 on success, or -1 (after printing the reason to stderr) on failure.
+int write_output(const char* path, const void* data, size_t count, size_t elementSize);
+
+// Reads from fd until "bytes" bytes have been read or end of file is reached, retrying short reads.
+// Returns the number of bytes read (less than "bytes" only at end of file), or -1 with errno set on failure.
+ssize_t read_all(int fd, void* buffer, size_t bytes);
+
+// Writes all "bytes" bytes to fd, retrying short writes. Returns 0 on success, or -1 with errno set on failure.
+int write_all(int fd, const void* data, size_t bytes);
+
+#endif //MULTITHREADED_SORTING_IO_H
@@ -1,276 +1,673 @@
 //// MULTITHREADED SORTING PROGRAM
-/// Note: No Mutex is used
-/// To incorporate the mutex into your program, you would typically do so in areas where threads access or modify shared resources concurrently.
-/// This program does not need a Mutex for 2 reasons:
-///     1. There's no  concurrent modification of shared resources by threads that would necessitate a Mutex for synchronization.
-///     2. The sorting and merging operations are structured to work on distinct data segments or are sequenced in a way (sorting first, followed by merging) that inherently avoids concurrent access issues.
-
-#include <pthread.h>
+/// Sorts an array of integers with the parallel merge sort in sort.c, through the library interface in mtsort.h.
+///
+/// Usage: main [-t threads] [-p] [-a algorithm] [-c cutoff] [-k kernels] [-w narrowing] [-f type] [-i input] [-o output] [-m budget [-T tempdir]] [-D nodes -R rank] [-s trace] [-C columns] [-K k | -N rank | -b batch | -A width]
+///     -t  number of sorting threads (default: number of online CPU cores)
+///     -p  pin the sorting threads to cores, spread evenly over the NUMA nodes (see mtsort_ctx_create_pinned)
+///     -a  sorting algorithm: auto, merge, radix or sample (default: auto, radix sort for large integer inputs; see sort.h)
+///     -c  partitions of at most this many elements are insertion sorted (default: see sort.h)
+///     -k  vector kernels for i32 keys: auto, avx512, avx2, neon or scalar (default: auto, the best the CPU supports)
+///     -w  key narrowing of integer types: on or off (default: on, see set_key_narrowing in sort.h)
+///     -f  element type of the input and output files: i32, i64, u32, u64, f32, f64, kv_i64 or kv_u64 for
+///         16-byte pairs of a native key and a uint64 value, or recN for records of N bytes that start with a native
+///         uint64 key (default: i32). Pairs and records with equal keys keep their input order.
+///     -C  sort records by these fields instead of their leading key: a comma-separated list of type@offset, where type
+///         is i32, i64, u32, u64, f32, f64 or strN for a NUL-padded string of N bytes, and a leading - sorts the field
+///         in descending order, e.g. -C str16@8,-u32@0 (see sort_rows in sort.h)
+///     -i  binary file to sort, or "-" for stdin (default: the built-in demo array below)
+///     -o  binary file to write the sorted array to, or "-" for stdout (default: print the sorted array as text)
+///     -m  external sort: sort inputs larger than memory using at most this many bytes of buffers
+///         (K, M and G suffixes are accepted, e.g. -m 8G). Requires -i and -o.
+///     -T  directory for the temporary run files of the external sort (default: $TMPDIR, or /tmp)
+///     -D  distributed sort: sort the inputs of all of these nodes, a comma-separated list of host:port, the same on
+///         every node, so that each writes one range of the sorted whole (see distsort.h). Requires -R, -i and -o.
+///     -R  this node's place in the list of -D, from 0 for the node that writes the smallest elements
+///     -s  write the time and hardware counters of every phase and task of the sort to this file as CSV, or "-" for
+///         stderr (see trace.h)
+///     -K  only find the k smallest elements, and write or print them in sorted order (see partial_sort_i32)
+///     -N  only find the element at this rank of the sorted order, 0 for the smallest, or a percentile such as 50% for
+///         the median, and write or print it alone (see nth_element_i32)
+///     -b  append the input to a sorted stream in batches of this many elements, as an ingest would, and write or
+///         print the stream's sorted view at the end (see mtsort_stream_append)
+///     -A  write or print the permutation that sorts the input instead of the sorted elements, as 32 or 64-bit
+///         unsigned indices (see argsort_i32), to put other columns in the same order
+
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "distsort.h"
+#include "extsort.h"
+#include "io.h"
+#include "mtsort.h"
+#include "simd.h"
+#include "sort.h"
+#include "trace.h"
 
 //// GLOBALS
-/// These variables hold our global data which we will handle across threads
+/// Built-in demo array, sorted when no input file is given
+static const int32_t list[] = {7, 12, 19, 3, 18, 4, 2, -5, 6, 15, 8};
+
+
+//// ELEMENT TYPES
+/// Scalar keys and key-value pairs are sorted by a sorting context through their SortType descriptor. Records have
+/// no descriptor: they are sorted as key-value pairs of their key and their index, or by several fields with -C (see
+/// sort_records), and only their keys are printed.
 
-// A SIZE constant which we can use when allocating memory for each subarray
-#define SIZE (sizeof(list) / sizeof(*list))
-// Original unsorted global array
-int list[] = {7, 12, 19, 3, 18, 4, 2, -5, 6, 15, 8};
-// Global array to hold original array when sorted
-int result[SIZE] = {0};
+// Smallest record that can hold the uint64 key
+#define RECORD_KEY_BYTES sizeof(uint64_t)
 
+// Most nodes that -D can list
+#define DISTRIBUTED_MAX_NODES 1024
 
-//// STRUCTS
-/// These structs encapsulate and organize the necessary data for sorting and merging operations in a way that's easy to manage and pass between threads.
+// Most fields that -C can sort records by
+#define RECORD_MAX_COLUMNS 16
 
-// For the 2 sorting threads
+// The fields that -C sorts records by: columns[c] starts fieldOffsets[c] bytes into a record. Its values are set once
+// the records are loaded. No columns sorts by the leading uint64 key.
 typedef struct {
-    // a pointer to the beginning of the subarray that the thread will sort.
-    // In C, arrays are often managed through pointers
-    int* subArray;
-    // This tells the thread how many elements are in the subarray it needs to sort.
-    unsigned int size;
-} SortingThreadParameters;
-
-// For merging thread
+    SortColumn columns[RECORD_MAX_COLUMNS];
+    size_t fieldOffsets[RECORD_MAX_COLUMNS];
+    size_t count;
+} RecordKey;
+
+// What is computed from the input: the whole sorted array, its topK smallest elements (-K), or the element at rank (-N).
+// With a batch size (-b), the whole array is sorted through a stream instead of at once. With an index size (-A), the
+// permutation that sorts it is computed instead of the sorted array.
 typedef struct {
-    // Uses the same SortingThreadParameters structure to say, "Here's the first sorted part you need to merge."
-    SortingThreadParameters left;
-    SortingThreadParameters right;
-} MergingThreadParameters;
+    size_t topK;
+    int selectRank;
+    size_t rank;
+    size_t batch;
+    size_t indexSize;
+} Selection;
 
 
 //// FUNCTION PROTOTYPES
-void* sorting_thread(void* arg);
-void* merging_thread(void* arg);
-void sort(int* subArray, unsigned int size);
-void merge_sort(int* arr, int start, int end, int* result);
-void merge(int* arr, int start, int mid, int end, int* result);
-
-
-int main() {
-    //// INITIALIZE THREADS
-    pthread_t leftThread, rightThread, mergeThread;
-
-
-    //// ALLOCATION OF SORTING THEAD PARAMETERS
-    /// 1. Create a pointer to new allocated memory to hold thread parameters
-    /// 2. Set each thread parameter (pointer to subArray and size)
-
-    //  This allocates memory on the heap that is large enough to store a SortingThreadParameters structure.
-    //  The malloc function returns a pointer to the allocated memory.
-    SortingThreadParameters* paramsLeft = malloc(sizeof(SortingThreadParameters));
-    // Set the subArray pointer to the beginning of global array (left half)
-    // Essentially, this tells the thread that its working array starts at the beginning of list.
-    paramsLeft->subArray = list;
-    // Set the size to half the total size of the array.
-    // It indicates how many elements the thread should consider for sorting.
-    // If SIZE is the total number of elements in list, then SIZE / 2 is half of that, rounding down if SIZE is odd.
-    paramsLeft->size = SIZE / 2;
-
-    // Prepare another set of thread parameters for the right half of the array
-    // "paramsRight" variable points to the beginning of the memory chunk holding the parameters.
-    SortingThreadParameters* paramsRight = malloc(sizeof(SortingThreadParameters));
-    // Set the starting point of the right half of the array to the midpoint of the array
-    // "list" points to the beginning of the array, and "+ paramsLeft->size" moves the pointer
-    // to the end of the left array, which is where the right half begins.
-    paramsRight->subArray = list + paramsLeft->size;
-    // Set the size of the right half of the array, which is the full size of the array minus the left half
-    paramsRight->size = SIZE - paramsLeft->size;
-
-
-    //// CREATING THE SORTING THREADS
-    /// pthread_create()  is used to create a new thread in a POSIX-compliant system.
-    /// takes 4 arguments:
-    ///   1. pthread_t *thread
-    ///         A pointer to a pthread variable that will store the thread ID of the newly created thread.
-    ///         This variable can be used later to join the thread
-    ///   2. const pthread_attr_t *attr
-    ///         Points to the attributes for the thread.
-    ///         Passing NULL means the thread is created with default attributes.
-    ///   3. void *(*start_routine) (void *)
-    ///         The function that the thread will execute once it starts.
-    ///         This function must take a single void* argument and return a void*
-    ///  4. void *arg
-    ///         The argument that will be passed to the start_routine function.
-    ///         This allows you to pass data to the thread when it starts.
-
-    //  Create a new thread (leftThread), which will run the sorting_thread function with paramsLeft as its argument.
-    //  This will handle the left half of the array that needs sorting.
-    if (pthread_create(&leftThread, NULL, sorting_thread, (void*)paramsLeft) != 0) {
-        perror("Failed to create thread1");
+static void print_usage(const char* program);
+static int parse_size(const char* text, size_t* bytes);
+static int parse_algorithm(const char* name, SortAlgorithm* algorithm);
+static int parse_rank(const char* text, size_t count, size_t* rank);
+static int parse_record_key(const char* text, size_t recordSize, RecordKey* key);
+static size_t selected_count(const Selection* selection, size_t count);
+static int sort_in_batches(MtsortContext* context, const SortType* type, const void* input, void* output, size_t count,
+                           size_t batch);
+static int run_selection(MtsortContext* context, const SortType* type, const Selection* selection, const void* input,
+                         void* output, size_t count);
+static int sort_records(MtsortContext* context, SortTrace* trace, const Selection* selection, const RecordKey* key,
+                        const void* input, void* output, size_t count, size_t recordSize);
+static int write_trace(const SortTrace* trace, const char* path);
+static void print_result(const SortType* type, size_t elementSize, const void* data, size_t count);
+
+
+int main(int argc, char* argv[]) {
+    //// COMMAND LINE OPTIONS
+    /// The number of sorting threads defaults to the number of online CPU cores
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    int pinned = 0;
+    // NULL when sorting records of recordSize bytes
+    const SortType* type = &sort_type_i32;
+    size_t recordSize = 0;
+    const char* inputPath = NULL;
+    const char* outputPath = NULL;
+    size_t memoryBudget = 0;
+    const char* tempDir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    char* nodesText = NULL;
+    long rank = -1;
+    const char* tracePath = NULL;
+    Selection selection = {0, 0, 0, 0, 0};
+    const char* rankText = NULL;
+    const char* columnsText = NULL;
+    RecordKey recordKey = {0};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:pa:c:k:w:f:i:o:m:T:D:R:s:C:K:N:b:A:")) != -1) {
+        switch (opt) {
+            case 't':
+                threadCount = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                pinned = 1;
+                break;
+            case 'a': {
+                SortAlgorithm algorithm;
+                if (parse_algorithm(optarg, &algorithm) != 0) {
+                    fprintf(stderr, "Unknown algorithm: %s\n", optarg);
+                    return 1;
+                }
+                set_sort_algorithm(algorithm);
+                break;
+            }
+            case 'c':
+                set_insertion_sort_threshold(strtoul(optarg, NULL, 10));
+                break;
+            case 'k':
+                if (select_simd_kernels(optarg) != 0) {
+                    fprintf(stderr, "Vector kernels not supported on this CPU: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'w':
+                if (strcmp(optarg, "on") != 0 && strcmp(optarg, "off") != 0) {
+                    fprintf(stderr, "Key narrowing is on or off, not %s\n", optarg);
+                    return 1;
+                }
+                set_key_narrowing(strcmp(optarg, "on") == 0);
+                break;
+            case 'f':
+                type = find_sort_type(optarg);
+                recordSize = 0;
+                if (type == NULL && strncmp(optarg, "rec", 3) == 0) {
+                    recordSize = strtoul(optarg + 3, NULL, 10);
+                }
+                if (type == NULL && recordSize < RECORD_KEY_BYTES) {
+                    fprintf(stderr, "Unknown element type: %s\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'i':
+                inputPath = optarg;
+                break;
+            case 'o':
+                outputPath = optarg;
+                break;
+            case 'm':
+                if (parse_size(optarg, &memoryBudget) != 0) {
+                    fprintf(stderr, "Invalid memory budget: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'T':
+                tempDir = optarg;
+                break;
+            case 'D':
+                nodesText = optarg;
+                break;
+            case 'R':
+                rank = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                tracePath = optarg;
+                break;
+            case 'C':
+                columnsText = optarg;
+                break;
+            case 'K':
+                selection.topK = strtoul(optarg, NULL, 10);
+                if (selection.topK == 0) {
+                    fprintf(stderr, "Invalid number of smallest elements: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'N':
+                rankText = optarg;
+                break;
+            case 'b':
+                selection.batch = strtoul(optarg, NULL, 10);
+                if (selection.batch == 0) {
+                    fprintf(stderr, "Invalid batch size: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'A':
+                if (strcmp(optarg, "32") != 0 && strcmp(optarg, "64") != 0) {
+                    fprintf(stderr, "Indices are 32 or 64 bits wide, not %s\n", optarg);
+                    return 1;
+                }
+                selection.indexSize = strcmp(optarg, "32") == 0 ? sizeof(uint32_t) : sizeof(uint64_t);
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    unsigned int threads = (unsigned int)threadCount;
+    if ((selection.topK > 0) + (rankText != NULL) + (selection.batch > 0) + (selection.indexSize > 0) > 1) {
+        fprintf(stderr, "Choose only one of the smallest elements (-K), a rank (-N), batches (-b) or indices (-A).\n");
         return 1;
     }
-
-    // Create a second thread for the right half of the array.
-    // Calls the same 'sorting_thread' function, only with the right side parameters instead of left side.
-    if (pthread_create(&rightThread, NULL, sorting_thread, (void*)paramsRight) != 0) {
-        perror("Failed to create thread1");
+    if (selection.indexSize > 0 && type == NULL) {
+        fprintf(stderr, "Records are already written in the order of their sorted indices; -A needs a scalar or pair type.\n");
         return 1;
     }
+    if (columnsText != NULL) {
+        if (type != NULL) {
+            fprintf(stderr, "Only records (-f recN) are sorted by fields (-C).\n");
+            return 1;
+        }
+        if (selection.topK > 0 || rankText != NULL || selection.batch > 0) {
+            fprintf(stderr, "Records sorted by fields (-C) are sorted as a whole; -K, -N and -b need their leading key.\n");
+            return 1;
+        }
+        if (parse_record_key(columnsText, recordSize, &recordKey) != 0) {
+            fprintf(stderr, "Invalid fields: %s\n", columnsText);
+            return 1;
+        }
+    }
+    size_t elementSize = type != NULL ? type->elementSize : recordSize;
 
 
-    //// WAIT FOR SORTING THREADS TO COMPLETE
-    /// The pthread_join function is used to wait for a specific thread to finish executing
+    //// EXTERNAL SORT
+    /// With a memory budget the input is streamed through extsort.c and never held in memory as a whole
+    if (memoryBudget > 0) {
+        if (inputPath == NULL || outputPath == NULL) {
+            fprintf(stderr, "The external sort (-m) needs an input file (-i) and an output file (-o).\n");
+            return 1;
+        }
+        if (type == NULL) {
+            fprintf(stderr, "The external sort (-m) does not support records; sort them as kv_u64 pairs instead.\n");
+            return 1;
+        }
+        if (nodesText != NULL) {
+            fprintf(stderr, "Choose either the external sort (-m) or the distributed sort (-D).\n");
+            return 1;
+        }
+        if (selection.topK > 0 || rankText != NULL || selection.batch > 0 || selection.indexSize > 0) {
+            fprintf(stderr, "The external sort (-m) sorts the whole input at once; -K, -N, -b and -A need it to fit in memory.\n");
+            return 1;
+        }
+        ExternalSortOptions options = {type, threads, memoryBudget, tempDir};
+        return external_sort(inputPath, outputPath, &options) == 0 ? 0 : 1;
+    }
+
 
-    // Tells the main thread to wait here until thread1 (the left sorting thread) has finished executing.
-    // If thread1 is already complete by the time this line runs, pthread_join will return immediately.
-    // Otherwise, it will block/pause the main thread until thread1 completes.
-    // The NULL argument indicates that the main thread does not need to capture any exit status from thread1.
-    pthread_join(leftThread, NULL);
-    pthread_join(rightThread, NULL);
+    //// DISTRIBUTED SORT
+    /// With a list of nodes this process sorts its input together with those of the other nodes, and writes its shard
+    if (nodesText != NULL) {
+        if (inputPath == NULL || outputPath == NULL || rank < 0) {
+            fprintf(stderr, "The distributed sort (-D) needs this node's rank (-R), an input file (-i) and an output file (-o).\n");
+            return 1;
+        }
+        if (type == NULL || columnsText != NULL) {
+            fprintf(stderr, "The distributed sort (-D) does not support records; sort them as kv_u64 pairs instead.\n");
+            return 1;
+        }
+        if (selection.topK > 0 || rankText != NULL || selection.batch > 0 || selection.indexSize > 0) {
+            fprintf(stderr, "The distributed sort (-D) sorts the whole input at once; -K, -N, -b and -A work on one node.\n");
+            return 1;
+        }
+        // The list is split in place, at its commas
+        const char* nodes[DISTRIBUTED_MAX_NODES];
+        unsigned int nodeCount = 0;
+        for (char* node = strtok(nodesText, ","); node != NULL; node = strtok(NULL, ",")) {
+            if (nodeCount == DISTRIBUTED_MAX_NODES) {
+                fprintf(stderr, "A distributed sort takes at most %d nodes.\n", DISTRIBUTED_MAX_NODES);
+                return 1;
+            }
+            nodes[nodeCount++] = node;
+        }
+        DistributedSortOptions options = {type, threads, nodes, nodeCount, (unsigned int)rank};
+        return distributed_sort(inputPath, outputPath, &options) == 0 ? 0 : 1;
+    }
 
 
-    //// ALLOCATION OF MERGING THEAD PARAMETERS
-    MergingThreadParameters* paramsMerge = malloc(sizeof(MergingThreadParameters));
-    // The left field of the paramsMerge structure is populated with the data pointed to by paramsLeft.
-    // This effectively copies the sorting parameters for the left half of the array
-    // (which include the pointer to the subarray and its size) into the left part of the paramsMerge structure.
-    // The dereference operator * is used here because paramsLeft is a pointer to a SortingThreadParameters structure,
-    // and you need to store the actual structure (not the pointer) in paramsMerge->left.
-    paramsMerge->left = *paramsLeft;
-    // Similarly, the right field of the paramsMerge structure is populated with the data pointed to by paramsRight,
-    // copying the sorting parameters for the right half of the array into the right part of the paramsMerge structure.
-    paramsMerge->right = *paramsRight;
+    //// LOAD THE INPUT
+    /// Either the file given with -i, or the built-in demo array
+    InputBuffer input = {0};
+    const void* data;
+    size_t count;
+    if (inputPath != NULL) {
+        if (read_input(inputPath, elementSize, &input) != 0) {
+            return 1;
+        }
+        data = input.data;
+        count = input.count;
+    } else {
+        if (type != &sort_type_i32) {
+            fprintf(stderr, "The built-in demo array holds i32 elements; use -i to sort other element types.\n");
+            return 1;
+        }
+        data = list;
+        count = sizeof(list) / sizeof(*list);
+    }
 
 
-    //// CREATE THE MERGING THREAD
-    /// Pass in the merging thread parameters that contain both the left and right array
-    /// parameters and execute the thread
-    pthread_create(&mergeThread, NULL, merging_thread, (void*)paramsMerge);
-    pthread_join(mergeThread, NULL);
+    if (rankText != NULL) {
+        selection.selectRank = 1;
+        if (parse_rank(rankText, count, &selection.rank) != 0) {
+            fprintf(stderr, "Invalid rank: %s\n", rankText);
+            release_input(&input);
+            return 1;
+        }
+    }
 
 
-    //// CLEAN UP MEMORY
-    /// Free the previously allocated memory after the merge thread is complete.
-    free(paramsLeft);
-    free(paramsRight);
-    free(paramsMerge);
+    //// ALLOCATION OF THE RESULT ARRAY
+    /// Holds the sorted array, or the part of it that was asked for, or the indices that sort it, which are written and
+    /// printed as u32 or u64 elements. The input is only read, so a memory-mapped file is never copied.
+    size_t resultCount = selected_count(&selection, count);
+    size_t resultSize = selection.indexSize > 0 ? selection.indexSize : elementSize;
+    const SortType* resultType = selection.indexSize == 0 ? type
+                                 : selection.indexSize == sizeof(uint32_t) ? &sort_type_u32 : &sort_type_u64;
+    void* result = huge_alloc(resultCount > 0 ? resultCount * resultSize : 1);
+    if (result == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the result.\n");
+        release_input(&input);
+        return 1;
+    }
 
 
-    //// VERIFY CORRECT RESULTS
-    /// Print the array to make sure it is sorted
-    for (unsigned int i = 0; i < SIZE; i++) {
-        printf("%d ", result[i]);
+    //// SORT
+    /// The context is created with the scratch memory this sort needs, so the sort itself allocates nothing big.
+    /// With -s the sort is traced, with hardware counters where the system allows reading them.
+    int status = -1;
+    // An argsort sorts (key, index) pairs, of 8 bytes for 32-bit keys and 16 for the others, next to as much scratch
+    size_t pairBytes = elementSize <= sizeof(uint32_t) ? sizeof(uint64_t) : sizeof(KeyValueU64);
+    // Records sorted by fields sort one 24-byte entry per record (see sort_rows), next to as much scratch
+    size_t scratchBytes = count * (selection.indexSize > 0 ? 2 * pairBytes : type != NULL ? elementSize
+                                   : recordKey.count > 0 ? 6 * sizeof(uint64_t) : sizeof(KeyValueU64));
+    MtsortContext* context = pinned ? mtsort_ctx_create_pinned(threads, scratchBytes) : mtsort_ctx_create(threads, scratchBytes);
+    SortTrace* trace = tracePath != NULL ? sort_trace_create(SORT_TRACE_COUNTERS) : NULL;
+    if (context != NULL && (tracePath == NULL || trace != NULL)) {
+        mtsort_set_trace(context, trace);
+        if (type != NULL) {
+            status = run_selection(context, type, &selection, data, result, count);
+        } else {
+            status = sort_records(context, trace, &selection, &recordKey, data, result, count, recordSize);
+        }
+        if (status == 0 && trace != NULL) {
+            status = write_trace(trace, tracePath);
+        }
     }
-    printf("\n");
+    mtsort_ctx_destroy(context);
+    sort_trace_destroy(trace);
 
-    return 0;
-}
 
-//// THREADS
-/// Includes a sorting thread for both halves of global array, and a merging thread that copies
-/// both sorted halves into the global result array
+    //// WRITE THE RESULT
+    /// Binary output goes to the file given with -o; without -o the array is printed so it can be checked by eye
+    if (status == 0) {
+        if (outputPath != NULL) {
+            status = write_output(outputPath, result, resultCount, resultSize);
+        } else {
+            print_result(resultType, resultSize, result, resultCount);
+        }
+    }
 
-void* sorting_thread(void* arg) {
-    // The arg argument is cast from void* to SortingThreadParameters*.
-    // This allows you to access the sorting parameters (subArray and size) passed to the thread.
-    // The arg pointer is expected to point to a SortingThreadParameters struct containing the subset of the array this thread will sort.
-    SortingThreadParameters* params = (SortingThreadParameters*) arg;
 
-    // Calls the merge_sort function on the subarray defined by params
-    merge_sort(params->subArray, 0, params->size - 1, result);
+    //// CLEAN UP MEMORY
+    huge_free(result);
+    release_input(&input);
 
-    // Returning NULL  is a common practice for thread routines
-    // that perform work but don't need to directly communicate a result back
-    return NULL;
+    return status == 0 ? 0 : 1;
 }
 
 
-void* merging_thread(void* arg) {
-    //// PARAMETER EXTRACTION
-    /// Casts the void* argument back to a MergingThreadParameters*.
-    /// This allows the function to access the parameters for the left and right subarrays that need to be merged
-    MergingThreadParameters* params = (MergingThreadParameters*) arg;
+static void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-t threads] [-p] [-a algorithm] [-c cutoff] [-k kernels] [-w narrowing] [-f type] [-i input] [-o output] [-m budget [-T tempdir]] [-D nodes -R rank] [-s trace] [-C columns] [-K k | -N rank | -b batch | -A width]\n", program);
+}
 
-    //// PREPARING FOR MERGE
-    // Initialize parameters to pass to merge function
-    int start = 0; // Start of the first subarray
-    int mid = params->left.size - 1; // End of the first subarray, assuming 'start' is 0
-    int end = params->left.size + params->right.size - 1; // End of the second subarray
 
+// Parses a byte count such as "4096", "512K", "64M" or "8G". Returns 0 on success, or -1 if text is not a positive size.
+static int parse_size(const char* text, size_t* bytes) {
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text || value == 0) {
+        return -1;
+    }
+    switch (*end) {
+        case 'G': case 'g': value <<= 10; // fall through
+        case 'M': case 'm': value <<= 10; // fall through
+        case 'K': case 'k': value <<= 10; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *bytes = (size_t)value;
+    return 0;
+}
 
-    //// MEMORY ALLOCATION
-    /// Reserves memory for a temporary array (tempResult) that will store the merged result of the two subarrays.
-    /// The size is end + 1 to accommodate the total number of elements from both subarrays.
-    int* tempResult = (int*)malloc(sizeof(int) * (end + 1));
 
-    //// ERROR HANDLING
-    // Handle memory allocation failure
-    if (tempResult == NULL) {
-        fprintf(stderr, "Failed to allocate memory for merging.\n");
-        exit(EXIT_FAILURE);
+// Parses the name of a sorting algorithm. Returns 0 on success, or -1 if the name is unknown.
+static int parse_algorithm(const char* name, SortAlgorithm* algorithm) {
+    if (strcmp(name, "auto") == 0) {
+        *algorithm = SORT_ALGORITHM_AUTO;
+    } else if (strcmp(name, "merge") == 0) {
+        *algorithm = SORT_ALGORITHM_MERGE;
+    } else if (strcmp(name, "radix") == 0) {
+        *algorithm = SORT_ALGORITHM_RADIX;
+    } else if (strcmp(name, "sample") == 0) {
+        *algorithm = SORT_ALGORITHM_SAMPLE;
+    } else {
+        return -1;
     }
+    return 0;
+}
 
-    //// MERGING SUBARRAYS
-    // Calls the merge function to merge the two sorted subarrays into tempResult.
-    merge(params->left.subArray, start, mid, params->left.size + params->right.size - 1, tempResult);
 
+// Parses the -N option: a rank, or a percentile of the count elements with a % suffix (0% is the smallest element,
+// 100% the biggest). Returns 0, or -1 if it is neither.
+static int parse_rank(const char* text, size_t count, size_t* rank) {
+    char* end;
+    if (strchr(text, '%') != NULL) {
+        double percentile = strtod(text, &end);
+        if (end == text || strcmp(end, "%") != 0 || !(percentile >= 0.0 && percentile <= 100.0)) {
+            return -1;
+        }
+        *rank = count > 0 ? (size_t)((double)(count - 1) * percentile / 100.0) : 0;
+        return 0;
+    }
+    *rank = strtoull(text, &end, 10);
+    return end == text || *end != '\0' ? -1 : 0;
+}
 
-    //// COPY THE MERGED RESULT
-    // Copy the merged array back into the appropriate place in the global 'result' array
-    for (int i = 0; i <= end; i++) {
-        result[i] = tempResult[i];
+// Parses the fields of -C, such as "str16@8,-u32@0", into key. Returns 0 on success, or -1 if text is not a list of
+// at most RECORD_MAX_COLUMNS fields that lie within records of recordSize bytes.
+static int parse_record_key(const char* text, size_t recordSize, RecordKey* key) {
+    static const struct {
+        const char* name;
+        SortColumnType type;
+        size_t width;
+    } types[] = {
+        {"i32", SORT_COLUMN_I32, sizeof(int32_t)}, {"i64", SORT_COLUMN_I64, sizeof(int64_t)},
+        {"u32", SORT_COLUMN_U32, sizeof(uint32_t)}, {"u64", SORT_COLUMN_U64, sizeof(uint64_t)},
+        {"f32", SORT_COLUMN_F32, sizeof(float)}, {"f64", SORT_COLUMN_F64, sizeof(double)},
+    };
+    key->count = 0;
+    while (*text != '\0') {
+        if (key->count == RECORD_MAX_COLUMNS) {
+            return -1;
+        }
+        SortColumn* column = &key->columns[key->count];
+        memset(column, 0, sizeof(*column));
+        column->stride = recordSize;
+        column->descending = *text == '-';
+        text += column->descending;
+        char* end = NULL;
+        if (strncmp(text, "str", 3) == 0) {
+            column->type = SORT_COLUMN_STRING;
+            column->width = strtoul(text + 3, &end, 10);
+            if (end == text + 3) {
+                return -1;
+            }
+        } else {
+            for (size_t t = 0; t < sizeof(types) / sizeof(*types); t++) {
+                if (strncmp(text, types[t].name, 3) == 0) {
+                    column->type = types[t].type;
+                    column->width = types[t].width;
+                    end = (char*)text + 3;
+                }
+            }
+            if (end == NULL) {
+                return -1;
+            }
+        }
+        if (*end != '@') {
+            return -1;
+        }
+        text = end + 1;
+        size_t offset = strtoul(text, &end, 10);
+        if (end == text || (*end != ',' && *end != '\0') || offset > recordSize || column->width > recordSize - offset) {
+            return -1;
+        }
+        key->fieldOffsets[key->count++] = offset;
+        text = *end == ',' ? end + 1 : end;
     }
+    return key->count > 0 ? 0 : -1;
+}
 
-    //// CLEAN UP ALLOCATED MEMORY
-    free(tempResult);
+// The number of elements the selection produces from count elements
+static size_t selected_count(const Selection* selection, size_t count) {
+    if (selection->selectRank) {
+        return 1;
+    }
+    if (selection->topK > 0 && selection->topK < count) {
+        return selection->topK;
+    }
+    return count;
+}
 
-    return NULL;
+// Writes the selected elements of input to output: the sorted array, its smallest elements or the one at the rank, or
+// the indices that sort it. input and output may be the same, except for indices. Returns 0, or -1 after printing the
+// reason to stderr.
+static int run_selection(MtsortContext* context, const SortType* type, const Selection* selection, const void* input,
+                         void* output, size_t count) {
+    if (selection->selectRank) {
+        return mtsort_nth_element(context, type, input, count, selection->rank, output);
+    }
+    if (selection->topK > 0) {
+        return mtsort_partial_sort(context, type, input, output, count, selection->topK);
+    }
+    if (selection->batch > 0) {
+        return sort_in_batches(context, type, input, output, count, selection->batch);
+    }
+    if (selection->indexSize > 0) {
+        return mtsort_argsort(context, type, input, output, count, selection->indexSize);
+    }
+    return mtsort_sort_into(context, type, input, output, count);
 }
 
+// Appends input to a sorted stream batch by batch, and copies the stream's sorted view to output, which may be input.
+// Returns 0, or -1 after printing the reason to stderr.
+static int sort_in_batches(MtsortContext* context, const SortType* type, const void* input, void* output, size_t count,
+                           size_t batch) {
+    MtsortStream* stream = mtsort_stream_create(context, type);
+    if (stream == NULL) {
+        return -1;
+    }
+    int status = 0;
+    for (size_t first = 0; status == 0 && first < count; first += batch) {
+        size_t size = count - first < batch ? count - first : batch;
+        status = mtsort_stream_append(stream, (const char*)input + first * type->elementSize, size);
+    }
+    const void* sorted;
+    size_t sortedCount;
+    if (status == 0) {
+        status = mtsort_stream_view(stream, &sorted, &sortedCount);
+    }
+    if (status == 0 && sortedCount > 0) {
+        memcpy(output, sorted, sortedCount * type->elementSize);
+    }
+    mtsort_stream_destroy(stream);
+    return status;
+}
 
-//// SORTING FUNCTIONS (MERGE SORT)
-
-// Helper function that recursively breaks the array in half
-void merge_sort(int* arr, int start, int end, int* result) {
-    // Base case
-    // checks if the starting index is less than the ending index.
-    // stops the recursion when the segment to be sorted is reduced to a single element or when the start and end cross over, indicating an invalid range.
-    if (start < end) {
-        // Get midpoint
-        int mid = start + (end - start) / 2;
-        // Recursively break the array in half until there is only 1 element
-        merge_sort(arr, start, mid, result);
-        merge_sort(arr, mid + 1, end, result);
-        // Repeatedly merge the two arrays until everything is added to the global sorted array
-        merge(arr, start, mid, end, result);
-        // Copy the sorted result back into the original array segment
-        for (int i = start; i <= end; i++) {
-            arr[i] = result[i];
+// Sorts records by the uint64 key at their start without moving them while sorting: one (key, index) pair per record
+// is sorted (or selected from), and the selected records are then copied to output once, in the order of their sorted
+// indices. With the fields of key, the indices come from sort_rows instead. The sort is stable, so records with equal
+// keys keep their input order. The copy is recorded in trace as the "gather" phase.
+// Returns 0, or -1 after printing the reason to stderr.
+static int sort_records(MtsortContext* context, SortTrace* trace, const Selection* selection, const RecordKey* key,
+                        const void* input, void* output, size_t count, size_t recordSize) {
+    if (key->count > 0) {
+        SortColumn columns[RECORD_MAX_COLUMNS];
+        for (size_t c = 0; c < key->count; c++) {
+            columns[c] = key->columns[c];
+            columns[c].values = (const char*)input + key->fieldOffsets[c];
+        }
+        uint64_t* indices = huge_alloc(count > 0 ? sizeof(uint64_t) * count : 1);
+        if (indices == NULL) {
+            fprintf(stderr, "Failed to allocate memory for the record indices.\n");
+            return -1;
+        }
+        int status = mtsort_sort_rows(context, columns, key->count, count, indices, sizeof(uint64_t));
+        if (status == 0) {
+            TraceSpan gather = trace_span_begin(trace);
+            for (size_t i = 0; i < count; i++) {
+                memcpy((char*)output + i * recordSize, (const char*)input + indices[i] * recordSize, recordSize);
+            }
+            trace_span_end(trace, "gather", 0, &gather);
         }
+        huge_free(indices);
+        return status;
     }
-}
 
-//
-void merge(int* arr, int start, int mid, int end, int* result) {
-    // Initialize three indices.
-    // i starts at the beginning of the first sorted subarray.
-    // j starts at the beginning of the second sorted subarray (mid + 1).
-    // k is used to track the current position in the result array where the
-    // next smallest element from either subarray will be placed. It starts at the same position as i
-    int i = start, j = mid + 1, k = start;
-
-    // Continues as long as there are elements in both subarrays yet to be compared and merged
-    while (i <= mid && j <= end) {
-        // Compares the current elements of both subarrays.
-        // If the element in the first subarray (arr[i]) is smaller,
-        // it is placed into the result array at k, and both i and k are incremented.
-        // If the element in the second subarray (arr[j]) is smaller or equal,
-        // it is placed into result at k, and both j and k are incremented.
-        // This ensures that the merged array is in ascending order.
-        if (arr[i] < arr[j]) {
-            result[k++] = arr[i++];
-        } else {
-            result[k++] = arr[j++];
+    KeyValueU64* pairs = huge_alloc(count > 0 ? sizeof(KeyValueU64) * count : 1);
+    if (pairs == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the record keys.\n");
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        memcpy(&pairs[i].key, (const char*)input + i * recordSize, sizeof(pairs[i].key));
+        pairs[i].value = i;
+    }
+    int status = run_selection(context, &sort_type_kv_u64, selection, pairs, pairs, count);
+    if (status == 0) {
+        TraceSpan gather = trace_span_begin(trace);
+        for (size_t i = 0; i < selected_count(selection, count); i++) {
+            memcpy((char*)output + i * recordSize, (const char*)input + pairs[i].value * recordSize, recordSize);
         }
+        trace_span_end(trace, "gather", 0, &gather);
     }
-    // if any elements are left in the left or right subarray after the main loop exits,
-    // these loops adds the remaining elements from the  subarrays to result.
-    while (i <= mid) {
-        result[k++] = arr[i++];
+    huge_free(pairs);
+    return status;
+}
+
+
+// Writes the trace as CSV to path, or to stderr for "-". Returns 0, or -1 after printing the reason to stderr.
+static int write_trace(const SortTrace* trace, const char* path) {
+    FILE* file = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    int status = sort_trace_print(trace, file);
+    if (file != stderr && fclose(file) != 0) {
+        status = -1;
     }
-    while (j <= end) {
-        result[k++] = arr[j++];
+    if (status != 0) {
+        fprintf(stderr, "Failed to write the trace to %s.\n", path);
+    }
+    return status;
+}
+
+
+//// VERIFY CORRECT RESULTS
+/// Print the array to make sure it is sorted. Records are printed by their key.
+static void print_result(const SortType* type, size_t elementSize, const void* data, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const void* element = (const char*)data + i * elementSize;
+        if (type == &sort_type_i32) {
+            printf("%" PRId32 " ", *(const int32_t*)element);
+        } else if (type == &sort_type_i64) {
+            printf("%" PRId64 " ", *(const int64_t*)element);
+        } else if (type == &sort_type_u32) {
+            printf("%" PRIu32 " ", *(const uint32_t*)element);
+        } else if (type == &sort_type_u64) {
+            printf("%" PRIu64 " ", *(const uint64_t*)element);
+        } else if (type == &sort_type_f32) {
+            printf("%g ", *(const float*)element);
+        } else if (type == &sort_type_f64) {
+            printf("%g ", *(const double*)element);
+        } else if (type == &sort_type_kv_i64) {
+            const KeyValueI64* pair = element;
+            printf("%" PRId64 ":%" PRIu64 " ", pair->key, pair->value);
+        } else if (type == &sort_type_kv_u64) {
+            const KeyValueU64* pair = element;
+            printf("%" PRIu64 ":%" PRIu64 " ", pair->key, pair->value);
+        } else {
+            uint64_t key;
+            memcpy(&key, element, sizeof(key));
+            printf("%" PRIu64 " ", key);
+        }
     }
+    printf("\n");
 }
@@ -0,0 +1,252 @@
+//// LIBMTSORT
+/// See mtsort.h. A context is a worker pool, a thread count and an arena, handed to the engine as the
+/// SortResources of every sort. The arena supplies the scratch buffer and all thread parameters, and is reset after
+/// every sort, so a sort that outgrew it is the last one to touch the heap.
+
+#include "mtsort.h"
+#include "arena.h"
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Arena space set aside per thread on top of the scratch memory, for the thread parameters of one sort. The biggest
+// are the digit counts of a radix sort of 64-bit keys: 8 passes of 256 counters per thread.
+#define PARAMETER_BYTES_PER_THREAD ((size_t)24 << 10)
+
+// Most levels a stream can have. Each level is more than twice the size of the next newer one, so this is never
+// reached, unless merges keep failing for lack of memory.
+#define STREAM_MAX_LEVELS 64
+
+// A level is merged with the newer one after it while it is at most this many times as big
+#define STREAM_LEVEL_GROWTH 2
+
+struct MtsortContext {
+    ThreadPool* pool;
+    unsigned int threads;
+    Arena arena;
+    SortTrace* trace;
+};
+
+// A sorted run of a stream
+typedef struct {
+    void* data;
+    size_t count;
+} StreamLevel;
+
+struct MtsortStream {
+    MtsortContext* context;
+    const SortType* type;
+    // The oldest, and biggest, level first
+    StreamLevel levels[STREAM_MAX_LEVELS];
+    size_t levelCount;
+    size_t count;
+};
+
+
+// A pinned pool has a worker per thread, because the caller only waits (see pool_create_pinned); a plain pool has
+// one less, because the caller does its share of the work
+static MtsortContext* create_context(unsigned int threads, size_t scratchBytes, int pinned) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    MtsortContext* context = calloc(1, sizeof(*context));
+    if (context == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the sorting context.\n");
+        return NULL;
+    }
+    context->threads = threads;
+    if (arena_init(&context->arena, scratchBytes + PARAMETER_BYTES_PER_THREAD * threads) != 0) {
+        free(context);
+        return NULL;
+    }
+    context->pool = pinned ? pool_create_pinned(threads) : pool_create(threads - 1);
+    if (context->pool == NULL) {
+        mtsort_ctx_destroy(context);
+        return NULL;
+    }
+    return context;
+}
+
+
+MtsortContext* mtsort_ctx_create(unsigned int threads, size_t scratchBytes) {
+    return create_context(threads, scratchBytes, 0);
+}
+
+
+MtsortContext* mtsort_ctx_create_pinned(unsigned int threads, size_t scratchBytes) {
+    return create_context(threads, scratchBytes, 1);
+}
+
+
+void mtsort_ctx_destroy(MtsortContext* context) {
+    if (context == NULL) {
+        return;
+    }
+    pool_destroy(context->pool);
+    arena_release(&context->arena);
+    free(context);
+}
+
+
+void mtsort_set_trace(MtsortContext* context, SortTrace* trace) {
+    context->trace = trace;
+}
+
+
+int mtsort_sort(MtsortContext* context, const SortType* type, void* data, size_t count) {
+    return mtsort_sort_into(context, type, data, data, count);
+}
+
+
+int mtsort_sort_into(MtsortContext* context, const SortType* type, const void* input, void* output, size_t count) {
+    SortResources resources = {context->pool, &context->arena, context->trace};
+    int status = type->parallel_sort_with(input, output, count, context->threads, &resources);
+    // Only a sort bigger than any before needs the reset to grow the arena
+    arena_reset(&context->arena);
+    return status;
+}
+
+
+int mtsort_partial_sort(MtsortContext* context, const SortType* type, const void* input, void* output, size_t count,
+                        size_t k) {
+    SortResources resources = {context->pool, &context->arena, context->trace};
+    int status = type->partial_sort_with(input, output, count, k, context->threads, &resources);
+    arena_reset(&context->arena);
+    return status;
+}
+
+
+int mtsort_nth_element(MtsortContext* context, const SortType* type, const void* input, size_t count, size_t rank,
+                       void* element) {
+    SortResources resources = {context->pool, &context->arena, context->trace};
+    int status = type->nth_element_with(input, count, rank, element, context->threads, &resources);
+    arena_reset(&context->arena);
+    return status;
+}
+
+
+int mtsort_argsort(MtsortContext* context, const SortType* type, const void* input, void* indices, size_t count,
+                   size_t indexSize) {
+    SortResources resources = {context->pool, &context->arena, context->trace};
+    int status = type->argsort_with(input, indices, count, indexSize, context->threads, &resources);
+    arena_reset(&context->arena);
+    return status;
+}
+
+
+int mtsort_sort_rows(MtsortContext* context, const SortColumn* columns, size_t columnCount, size_t count,
+                     void* indices, size_t indexSize) {
+    SortResources resources = {context->pool, &context->arena, context->trace};
+    int status = sort_rows_with(columns, columnCount, count, indices, indexSize, context->threads, &resources);
+    arena_reset(&context->arena);
+    return status;
+}
+
+
+//// SORTED STREAMS
+
+MtsortStream* mtsort_stream_create(MtsortContext* context, const SortType* type) {
+    MtsortStream* stream = calloc(1, sizeof(*stream));
+    if (stream == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the sorted stream.\n");
+        return NULL;
+    }
+    stream->context = context;
+    stream->type = type;
+    return stream;
+}
+
+
+void mtsort_stream_destroy(MtsortStream* stream) {
+    if (stream == NULL) {
+        return;
+    }
+    for (size_t l = 0; l < stream->levelCount; l++) {
+        huge_free(stream->levels[l].data);
+    }
+    free(stream);
+}
+
+// Merges the two newest levels into one. Returns 0, or -1 after printing the reason to stderr, leaving the levels as
+// they were.
+static int merge_newest_levels(MtsortStream* stream) {
+    MtsortContext* context = stream->context;
+    StreamLevel* older = &stream->levels[stream->levelCount - 2];
+    StreamLevel* newer = &stream->levels[stream->levelCount - 1];
+    size_t elementSize = stream->type->elementSize;
+    void* merged = huge_alloc((older->count + newer->count) * elementSize);
+    if (merged == NULL) {
+        fprintf(stderr, "Failed to allocate memory for merging the stream.\n");
+        return -1;
+    }
+    // The older level goes left, so its elements come first among equal keys
+    SortResources resources = {context->pool, &context->arena, context->trace};
+    stream->type->merge_runs_with(older->data, older->count, newer->data, newer->count, merged, context->threads,
+                                  &resources);
+    arena_reset(&context->arena);
+    huge_free(older->data);
+    huge_free(newer->data);
+    older->data = merged;
+    older->count += newer->count;
+    stream->levelCount--;
+    return 0;
+}
+
+
+int mtsort_stream_append(MtsortStream* stream, const void* batch, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    if (stream->levelCount == STREAM_MAX_LEVELS && merge_newest_levels(stream) != 0) {
+        return -1;
+    }
+    void* level = huge_alloc(count * stream->type->elementSize);
+    if (level == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the batch.\n");
+        return -1;
+    }
+    if (mtsort_sort_into(stream->context, stream->type, batch, level, count) != 0) {
+        huge_free(level);
+        return -1;
+    }
+    stream->levels[stream->levelCount].data = level;
+    stream->levels[stream->levelCount].count = count;
+    stream->levelCount++;
+    stream->count += count;
+
+    // Keep every level more than STREAM_LEVEL_GROWTH times as big as the next newer one
+    while (stream->levelCount >= 2 &&
+           stream->levels[stream->levelCount - 2].count <= STREAM_LEVEL_GROWTH * stream->levels[stream->levelCount - 1].count) {
+        if (merge_newest_levels(stream) != 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+
+size_t mtsort_stream_count(const MtsortStream* stream) {
+    return stream->count;
+}
+
+
+int mtsort_stream_view(MtsortStream* stream, const void** data, size_t* count) {
+    while (stream->levelCount > 1) {
+        if (merge_newest_levels(stream) != 0) {
+            return -1;
+        }
+    }
+    *data = stream->levelCount > 0 ? stream->levels[0].data : NULL;
+    *count = stream->count;
+    return 0;
+}
+
+
+size_t mtsort_stream_cursors(const MtsortStream* stream, MergeCursor* cursors, size_t capacity) {
+    for (size_t l = 0; l < stream->levelCount && l < capacity; l++) {
+        cursors[l].next = stream->levels[l].data;
+        cursors[l].remaining = stream->levels[l].count;
+    }
+    return stream->levelCount;
+}
@@ -0,0 +1,113 @@
+//// LIBMTSORT
+/// The library interface of the sorting engine, for programs that sort many arrays one after the other, such as a
+/// service that sorts every request it handles. A context owns what a sort runs on: a pool of worker threads and
+/// an arena (see arena.h) for the scratch buffer that sorting ping-pongs with the output and for the parameters of
+/// its threads. Both are set up once, so once the arena has grown to fit the largest array, repeated sorts start
+/// no threads and make no heap allocations at all.
+///
+/// A context sorts one array at a time: use one context per thread that sorts. Element types are given by their
+/// SortType descriptor (see sort.h), e.g. mtsort_sort(context, &sort_type_u64, keys, count).
+/// The global settings of sort.h (set_sort_algorithm, set_insertion_sort_threshold) and simd.h apply as well.
+
+#ifndef MULTITHREADED_SORTING_MTSORT_H
+#define MULTITHREADED_SORTING_MTSORT_H
+
+#include <stddef.h>
+
+#include "sort.h"
+#include "trace.h"
+
+typedef struct MtsortContext MtsortContext;
+
+// Creates a context that sorts with up to threads threads (at least 1), which starts threads - 1 workers: the thread
+// that calls mtsort_sort does its share of the work. scratchBytes of scratch memory, plus room for the parameters of
+// the threads, are allocated up front. Sorting count elements of elementSize bytes needs count * elementSize, and the
+// sample sort count bytes more (see SORT_ALGORITHM_SAMPLE); a sort that needs more still gets it, and grows the
+// context's memory for good.
+// Returns NULL, after printing the reason to stderr, if the threads or the memory could not be allocated.
+MtsortContext* mtsort_ctx_create(unsigned int threads, size_t scratchBytes);
+
+// Like mtsort_ctx_create, for machines with several NUMA nodes: the context starts one worker per thread instead, each
+// pinned to its own core with the workers spread evenly over the nodes (see pool_create_pinned). Every partition of
+// the array is then sorted and merged on the same core throughout a sort, so the scratch memory and the output it
+// writes first are placed on that core's node, and only the last merge levels read memory of another node.
+// The caller of mtsort_sort just waits for the workers.
+MtsortContext* mtsort_ctx_create_pinned(unsigned int threads, size_t scratchBytes);
+
+// Stops the workers and frees the context and its scratch memory. NULL is ignored.
+void mtsort_ctx_destroy(MtsortContext* context);
+
+// Records the phases and tasks of every following sort of the context in trace (see trace.h), or stops recording
+// them if trace is NULL. The context does not own the trace. Tracing allocates, so it is for finding out where the
+// time goes, not for every sort of a service.
+void mtsort_set_trace(MtsortContext* context, SortTrace* trace);
+
+// Sorts count elements of the given type at data in place, in ascending order.
+// Returns 0 on success, or -1 (after printing the reason to stderr) if memory could not be allocated.
+int mtsort_sort(MtsortContext* context, const SortType* type, void* data, size_t count);
+
+// Sorts count elements of the given type from input into output, which must not overlap input.
+// input is only read, so it may point into a read-only memory mapping. Returns like mtsort_sort.
+int mtsort_sort_into(MtsortContext* context, const SortType* type, const void* input, void* output, size_t count);
+
+// Writes the k smallest of count elements at input, sorted, to output (see partial_sort_i32 in sort.h). k is clamped
+// to count, and output may be input itself. Returns like mtsort_sort.
+int mtsort_partial_sort(MtsortContext* context, const SortType* type, const void* input, void* output, size_t count,
+                        size_t k);
+
+// Stores the element of count elements at input that a sort would put at position rank in *element (see
+// nth_element_i32 in sort.h). Returns 0, or -1 (after printing the reason to stderr) if rank is not below count or
+// memory could not be allocated.
+int mtsort_nth_element(MtsortContext* context, const SortType* type, const void* input, size_t count, size_t rank,
+                       void* element);
+
+// Writes the permutation that sorts count elements at input to indices, as uint32_t (indexSize 4) or uint64_t
+// (indexSize 8) indices (see argsort_i32 in sort.h). Returns like mtsort_sort, or -1 if indexSize does not fit.
+int mtsort_argsort(MtsortContext* context, const SortType* type, const void* input, void* indices, size_t count,
+                   size_t indexSize);
+
+// Writes the permutation that sorts count rows by the given columns to indices, as mtsort_argsort does (see sort_rows
+// in sort.h). Returns like mtsort_argsort, or -1 if a column has no valid type.
+int mtsort_sort_rows(MtsortContext* context, const SortColumn* columns, size_t columnCount, size_t count,
+                     void* indices, size_t indexSize);
+
+
+//// SORTED STREAMS
+/// For data that arrives in batches, such as an ingest that keeps appending: a stream keeps everything appended so
+/// far as a few sorted levels, like an LSM tree, instead of sorting all of it again for every batch. A batch is sorted
+/// on its own by the context's workers and becomes the newest level; while the level before it is at most twice as
+/// big, the two are merged in parallel. Every level is then more than twice as big as the next newer one, so there
+/// are at most about log2(count / batch size) levels, and an element takes part in that many merges over its whole
+/// life: the cost of a batch grows with its size, and only logarithmically with the stream's.
+/// Elements with equal keys come out in the order they were appended. A stream uses its context for every sort and
+/// merge, so it is used by one thread at a time, like the context; the levels themselves come from huge_alloc.
+
+typedef struct MtsortStream MtsortStream;
+
+// Creates an empty stream of elements of the given type, sorted and merged by context, which must outlive it.
+// Returns NULL, after printing the reason to stderr, if it could not be allocated.
+MtsortStream* mtsort_stream_create(MtsortContext* context, const SortType* type);
+
+// Frees the stream and its levels. NULL is ignored.
+void mtsort_stream_destroy(MtsortStream* stream);
+
+// Sorts count elements at batch into the stream. batch is only read, and may be reused once this returns.
+// Returns 0, or -1 (after printing the reason to stderr) if the batch could not be sorted; the stream is then left as
+// it was. Levels that could not be merged for lack of memory stay as they are until the next batch.
+int mtsort_stream_append(MtsortStream* stream, const void* batch, size_t count);
+
+// Number of elements appended so far
+size_t mtsort_stream_count(const MtsortStream* stream);
+
+// Merges all levels into one and points *data at all elements of the stream in sorted order (NULL while the stream is
+// empty), which stay valid until the next append or the stream is destroyed. Merging costs one pass over the stream,
+// but only after appends: reading the view again costs nothing. Returns 0, or -1 (after printing the reason to
+// stderr) if memory for the merge could not be allocated.
+int mtsort_stream_view(MtsortStream* stream, const void** data, size_t* count);
+
+// Points one cursor per level, the oldest first, at the level's elements, to read the stream in sorted order with
+// the type's k-way merge (see kway_merge_i32 in sort.h) without merging the levels. Fills at most capacity cursors,
+// and returns the number of levels, which is below 64.
+size_t mtsort_stream_cursors(const MtsortStream* stream, MergeCursor* cursors, size_t capacity);
+
+#endif //MULTITHREADED_SORTING_MTSORT_H
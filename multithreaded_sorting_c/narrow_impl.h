@@ -0,0 +1,191 @@
+//// KEY NARROWING TEMPLATE
+/// Included by sort_impl.h for integer element types that are their own key (no payload), with its macros still
+/// defined, plus SORT_NARROW. Needs the radix key of radix_impl.h, and the engines that sort.c instantiates before
+/// the wide types: u16 for keys that span at most 16 bits, and i32 for the 64-bit types whose keys span at most 32.
+///
+/// Keys often span a much smaller range than their type can hold, such as 64-bit timestamps of one day or ids below a
+/// few billion. A parallel pass finds the smallest and the largest key first. When their difference fits a narrower
+/// integer, every key is replaced by its offset from the smallest one, the offsets are sorted by the engine of the
+/// narrower type, and the smallest key is added back while the offsets are copied out into output. Every merge level
+/// or radix pass then moves a half or a quarter of the bytes, and the 32-bit offsets use the vector kernels of i32.
+/// Keys only become 16-bit offsets when they are going to be radix sorted (see narrow_sort_with).
+/// Offsets are stored as unsigned (u16), or with their top bit flipped for i32, so both orders match that of the keys.
+/// Since equal keys are indistinguishable, the element order is the same as that of the wide sort.
+
+// Returned by narrow_sort_with when the keys span too wide a range to be narrowed
+#define NARROW_TOO_WIDE 1
+// Flips the top bit of 32-bit offsets, so they sort as i32 in their unsigned order
+#define NARROW_I32_FLIP 0x80000000u
+
+
+//// STRUCTS
+// For each thread of the range, narrow and widen phases
+typedef struct {
+    // The slice [begin, end) of the keys that this thread works on
+    const SORT_TYPE* input;
+    size_t begin;
+    size_t end;
+    // The smallest and largest radix key of the slice, found by the range phase
+    SORT_RADIX_KEY low;
+    SORT_RADIX_KEY high;
+    // The radix key that offsets count from, and the narrowed keys (uint16_t or int32_t)
+    SORT_RADIX_KEY base;
+    void* narrow;
+    SORT_TYPE* output;
+} SORT_FN(NarrowThreadParameters);
+
+
+//// KEYS
+// The key whose radix key (see radix_impl.h) is key
+static inline SORT_TYPE SORT_FN(narrow_from_radix_key)(SORT_RADIX_KEY key) {
+    return (SORT_TYPE)(key ^ (SORT_RADIX_SIGNED ? (SORT_RADIX_KEY)1 << (sizeof(SORT_RADIX_KEY) * 8 - 1) : 0));
+}
+
+
+//// THREADS
+
+static void* SORT_FN(narrow_range_thread)(void* arg) {
+    SORT_FN(NarrowThreadParameters)* params = (SORT_FN(NarrowThreadParameters)*) arg;
+    const SORT_TYPE* input = params->input;
+    SORT_RADIX_KEY low = SORT_FN(radix_key)(input[params->begin]);
+    SORT_RADIX_KEY high = low;
+    for (size_t i = params->begin + 1; i < params->end; i++) {
+        SORT_RADIX_KEY key = SORT_FN(radix_key)(input[i]);
+        low = key < low ? key : low;
+        high = key > high ? key : high;
+    }
+    params->low = low;
+    params->high = high;
+    return NULL;
+}
+
+static void* SORT_FN(narrow_u16_thread)(void* arg) {
+    SORT_FN(NarrowThreadParameters)* params = (SORT_FN(NarrowThreadParameters)*) arg;
+    const SORT_TYPE* input = params->input;
+    uint16_t* narrow = params->narrow;
+    SORT_RADIX_KEY base = params->base;
+    for (size_t i = params->begin; i < params->end; i++) {
+        narrow[i] = (uint16_t)(SORT_FN(radix_key)(input[i]) - base);
+    }
+    return NULL;
+}
+
+static void* SORT_FN(widen_u16_thread)(void* arg) {
+    SORT_FN(NarrowThreadParameters)* params = (SORT_FN(NarrowThreadParameters)*) arg;
+    const uint16_t* narrow = params->narrow;
+    SORT_TYPE* output = params->output;
+    SORT_RADIX_KEY base = params->base;
+    for (size_t i = params->begin; i < params->end; i++) {
+        output[i] = SORT_FN(narrow_from_radix_key)((SORT_RADIX_KEY)(base + narrow[i]));
+    }
+    return NULL;
+}
+
+static void* SORT_FN(narrow_i32_thread)(void* arg) {
+    SORT_FN(NarrowThreadParameters)* params = (SORT_FN(NarrowThreadParameters)*) arg;
+    const SORT_TYPE* input = params->input;
+    int32_t* narrow = params->narrow;
+    SORT_RADIX_KEY base = params->base;
+    for (size_t i = params->begin; i < params->end; i++) {
+        narrow[i] = (int32_t)((uint32_t)(SORT_FN(radix_key)(input[i]) - base) ^ NARROW_I32_FLIP);
+    }
+    return NULL;
+}
+
+static void* SORT_FN(widen_i32_thread)(void* arg) {
+    SORT_FN(NarrowThreadParameters)* params = (SORT_FN(NarrowThreadParameters)*) arg;
+    const int32_t* narrow = params->narrow;
+    SORT_TYPE* output = params->output;
+    SORT_RADIX_KEY base = params->base;
+    for (size_t i = params->begin; i < params->end; i++) {
+        output[i] = SORT_FN(narrow_from_radix_key)((SORT_RADIX_KEY)(base + ((uint32_t)narrow[i] ^ NARROW_I32_FLIP)));
+    }
+    return NULL;
+}
+
+
+//// NARROW SORT
+// Sorts like wide_sort_with if the keys can be narrowed (see above), and returns its result. Returns NARROW_TOO_WIDE,
+// without touching output, if they cannot, or if key narrowing is off or there are too few keys for it to pay off.
+static int SORT_FN(narrow_sort_with)(const SORT_TYPE* input, SORT_TYPE* output, size_t count, unsigned int threads,
+                                     const SortResources* resources) {
+    // 16-bit offsets halve the passes of a radix sort, but the merge kernels are only vectorized for i32, which merges
+    // faster than u16 despite the wider keys. So the merge and sample sorts only narrow 64-bit types, to 32 bits.
+    int radix = sortAlgorithm == SORT_ALGORITHM_RADIX || (sortAlgorithm == SORT_ALGORITHM_AUTO && count >= RADIX_SORT_MIN_COUNT);
+    if (!keyNarrowing || count < NARROW_KEYS_MIN_COUNT || (!radix && sizeof(SORT_TYPE) <= sizeof(int32_t))) {
+        return NARROW_TOO_WIDE;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > count) {
+        threads = (unsigned int)count;
+    }
+    Arena* arena = resources->arena;
+    SORT_FN(NarrowThreadParameters)* params = arena_alloc(arena, sizeof(*params) * threads);
+    if (params == NULL) {
+        fprintf(stderr, "Failed to allocate memory for sorting.\n");
+        return -1;
+    }
+
+    //// KEY RANGE
+    SortTrace* trace = resources->trace;
+    ThreadPool* pool = resources->pool;
+    for (unsigned int t = 0; t < threads; t++) {
+        params[t].input = input;
+        // Lines of the 16-bit offsets hold whole lines of the wider keys, so these slices line up with both
+        params[t].begin = slice_begin(t, count, threads, sizeof(uint16_t));
+        params[t].end = slice_begin(t + 1, count, threads, sizeof(uint16_t));
+        params[t].output = output;
+    }
+    trace_run(trace, "range", 0, pool, SORT_FN(narrow_range_thread), params, sizeof(*params), threads);
+    SORT_RADIX_KEY low = params[0].low;
+    SORT_RADIX_KEY high = params[0].high;
+    for (unsigned int t = 1; t < threads; t++) {
+        low = params[t].low < low ? params[t].low : low;
+        high = params[t].high > high ? params[t].high : high;
+    }
+    SORT_RADIX_KEY span = high - low;
+    int to16 = radix && sizeof(SORT_TYPE) > sizeof(uint16_t) && span <= UINT16_MAX;
+    int to32 = !to16 && sizeof(SORT_TYPE) > sizeof(int32_t) && span <= UINT32_MAX;
+    if (!to16 && !to32) {
+        arena_free(arena, params);
+        return NARROW_TOO_WIDE;
+    }
+
+    //// NARROW, SORT AND WIDEN
+    /// The offsets are sorted in place, in a buffer of their own, so output is only written by the widening, and may
+    /// be input itself.
+    void* narrow = arena_alloc(arena, (to16 ? sizeof(uint16_t) : sizeof(int32_t)) * count);
+    if (narrow == NULL) {
+        fprintf(stderr, "Failed to allocate memory for sorting.\n");
+        arena_free(arena, params);
+        return -1;
+    }
+    for (unsigned int t = 0; t < threads; t++) {
+        params[t].base = low;
+        params[t].narrow = narrow;
+    }
+    int status;
+    if (to16) {
+        trace_run(trace, "narrow", 0, pool, SORT_FN(narrow_u16_thread), params, sizeof(*params), threads);
+        // u16 never narrows, so its whole sort is the wide one; i32 below narrows, so its wide sort is called directly
+        status = parallel_sort_with_u16(narrow, narrow, count, threads, resources);
+        if (status == 0) {
+            trace_run(trace, "widen", 0, pool, SORT_FN(widen_u16_thread), params, sizeof(*params), threads);
+        }
+    } else {
+        trace_run(trace, "narrow", 0, pool, SORT_FN(narrow_i32_thread), params, sizeof(*params), threads);
+        status = wide_sort_with_i32(narrow, narrow, count, threads, resources);
+        if (status == 0) {
+            trace_run(trace, "widen", 0, pool, SORT_FN(widen_i32_thread), params, sizeof(*params), threads);
+        }
+    }
+
+    arena_free(arena, narrow);
+    arena_free(arena, params);
+    return status;
+}
+
+
+#undef NARROW_I32_FLIP
@@ -0,0 +1,587 @@
+//// WORKER THREAD POOL
+/// See pool.h. One mutex guards the whole pool: the batch queue, the task counters of every batch and the worker
+/// list. Tasks are coarse (a partition to sort, or a slice of a merge level), so the lock is taken rarely compared
+/// to the work done per task. The work-stealing deques at the end of the file are separate and have a lock each.
+
+// For the CPU affinity calls of pinned pools
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "pool.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Upper bound on the workers pool_run starts for a single batch
+#define POOL_MAX_WORKERS 1024u
+
+// Where the CPUs of every NUMA node are listed, e.g. "0-15,32-47"
+#define NUMA_NODE_CPULIST "/sys/devices/system/node/node%u/cpulist"
+#define NUMA_MAX_NODES 64
+
+// A batch lives on the stack of the pool_run call that submitted it, and is queued until all its tasks are handed out
+typedef struct PoolBatch {
+    void* (*routine)(void*);
+    char* args;
+    size_t argSize;
+    size_t count;
+    // The next task to hand out, and the number of tasks that have finished
+    size_t next;
+    size_t done;
+    // Pinned pools only: the batch's place in the order of submission, and the number of workers that ran their
+    // share of its tasks
+    unsigned long serial;
+    unsigned int served;
+    // The next batch in the queue
+    struct PoolBatch* queued;
+} PoolBatch;
+
+// A worker of a pinned pool, which runs a fixed share of the tasks of every batch
+typedef struct {
+    ThreadPool* pool;
+    unsigned int index;
+    // The serial of the last batch this worker ran its share of
+    unsigned long served;
+} PinnedWorker;
+
+struct ThreadPool {
+    pthread_mutex_t lock;
+    // Signalled when a batch is queued, or when the pool stops
+    pthread_cond_t work;
+    // Signalled when the last task of a batch finishes
+    pthread_cond_t finished;
+    // Batches that still have tasks to hand out, oldest first
+    PoolBatch* head;
+    PoolBatch* tail;
+    pthread_t* workers;
+    unsigned int workerCount;
+    unsigned int workerCapacity;
+    int stopping;
+    // NULL unless the pool was created by pool_create_pinned, which fixes its workers
+    PinnedWorker* pinned;
+    // The serial of the last batch submitted to a pinned pool
+    unsigned long batchSerial;
+};
+
+
+//// FUNCTION PROTOTYPES
+static void* worker_thread(void* arg);
+static void* pinned_worker_thread(void* arg);
+static void run_pinned(ThreadPool* pool, PoolBatch* batch);
+static void queue_batch(ThreadPool* pool, PoolBatch* batch);
+static void unqueue_batch(ThreadPool* pool, PoolBatch* batch);
+static size_t take_task(ThreadPool* pool, PoolBatch* batch);
+static void finish_task(ThreadPool* pool, PoolBatch* batch);
+static void grow(ThreadPool* pool, unsigned int workers);
+static unsigned int place_workers(unsigned int workers, int* cpus);
+
+
+ThreadPool* pool_create(unsigned int workers) {
+    ThreadPool* pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the thread pool.\n");
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    grow(pool, workers);
+    pthread_mutex_unlock(&pool->lock);
+    return pool;
+}
+
+
+ThreadPool* pool_create_pinned(unsigned int workers) {
+    ThreadPool* pool = calloc(1, sizeof(*pool));
+    int* cpus = calloc(workers > 0 ? workers : 1, sizeof(int));
+    if (pool != NULL) {
+        pool->workers = calloc(workers > 0 ? workers : 1, sizeof(pthread_t));
+        pool->pinned = calloc(workers > 0 ? workers : 1, sizeof(PinnedWorker));
+    }
+    if (pool == NULL || cpus == NULL || pool->workers == NULL || pool->pinned == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the thread pool.\n");
+        if (pool != NULL) {
+            free(pool->workers);
+            free(pool->pinned);
+        }
+        free(pool);
+        free(cpus);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    pool->workerCapacity = workers;
+
+    int placed = place_workers(workers, cpus) == workers;
+    pthread_mutex_lock(&pool->lock);
+    for (unsigned int w = 0; w < workers; w++) {
+        pool->pinned[w].pool = pool;
+        pool->pinned[w].index = w;
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+#ifdef __linux__
+        // Pinned from the start, so even the worker's stack is allocated on its own node
+        if (placed) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[w], &set);
+            pthread_attr_setaffinity_np(&attributes, sizeof(set), &set);
+        }
+#else
+        (void)placed;
+#endif
+        int failed = pthread_create(&pool->workers[w], &attributes, pinned_worker_thread, &pool->pinned[w]);
+        pthread_attr_destroy(&attributes);
+        if (failed) {
+            perror("Failed to create pool worker");
+            break;
+        }
+        pool->workerCount++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(cpus);
+    return pool;
+}
+
+
+void pool_destroy(ThreadPool* pool) {
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned int w = 0; w < pool->workerCount; w++) {
+        pthread_join(pool->workers[w], NULL);
+    }
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool->pinned);
+    free(pool);
+}
+
+
+void pool_run(ThreadPool* pool, void* (*routine)(void*), void* args, size_t argSize, size_t count) {
+    if (pool == NULL || count <= 1) {
+        // Nothing to gain from handing a single task to another thread
+        for (size_t i = 0; i < count; i++) {
+            routine((char*)args + i * argSize);
+        }
+        return;
+    }
+
+    PoolBatch batch = {routine, args, argSize, count, 0, 0, 0, 0, NULL};
+    if (pool->pinned != NULL) {
+        run_pinned(pool, &batch);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    grow(pool, count - 1 < POOL_MAX_WORKERS ? (unsigned int)(count - 1) : POOL_MAX_WORKERS);
+    queue_batch(pool, &batch);
+
+    // Help with the batch until all of its tasks are handed out, then wait for the ones still running elsewhere
+    while (batch.next < batch.count) {
+        size_t task = take_task(pool, &batch);
+        pthread_mutex_unlock(&pool->lock);
+        routine((char*)args + task * argSize);
+        pthread_mutex_lock(&pool->lock);
+        finish_task(pool, &batch);
+    }
+    while (batch.done < batch.count) {
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+static ThreadPool* sharedPool;
+static pthread_once_t sharedPoolOnce = PTHREAD_ONCE_INIT;
+
+static void create_shared_pool(void) {
+    sharedPool = pool_create(0);
+}
+
+ThreadPool* shared_pool(void) {
+    pthread_once(&sharedPoolOnce, create_shared_pool);
+    return sharedPool;
+}
+
+
+//// PINNED POOLS
+/// Task i of every batch runs on worker i % workers, so the tasks that work on the same part of an array in
+/// consecutive batches, such as a partition and its slice of every merge level, always run on the same core, and
+/// the memory they touch first is allocated on that core's node. The caller only waits: its own thread is not
+/// pinned, so it would run its tasks wherever it happens to be.
+
+static void run_pinned(ThreadPool* pool, PoolBatch* batch) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->workerCount == 0) {
+        pthread_mutex_unlock(&pool->lock);
+        for (size_t i = 0; i < batch->count; i++) {
+            batch->routine(batch->args + i * batch->argSize);
+        }
+        return;
+    }
+    batch->serial = ++pool->batchSerial;
+    queue_batch(pool, batch);
+    // The last worker to serve the batch takes it off the queue, after which no worker looks at it again
+    while (batch->served < pool->workerCount) {
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Serves every batch in the order of submission: runs its share of the tasks, which may be none
+static void* pinned_worker_thread(void* arg) {
+    PinnedWorker* worker = (PinnedWorker*) arg;
+    ThreadPool* pool = worker->pool;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        PoolBatch* batch = pool->head;
+        while (batch != NULL && batch->serial <= worker->served) {
+            batch = batch->queued;
+        }
+        if (pool->stopping) {
+            break;
+        }
+        if (batch == NULL) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+            continue;
+        }
+        worker->served = batch->serial;
+        pthread_mutex_unlock(&pool->lock);
+        for (size_t i = worker->index; i < batch->count; i += pool->workerCount) {
+            batch->routine(batch->args + i * batch->argSize);
+        }
+        pthread_mutex_lock(&pool->lock);
+        batch->served++;
+        if (batch->served == pool->workerCount) {
+            unqueue_batch(pool, batch);
+            pthread_cond_broadcast(&pool->finished);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Reads a cpulist such as "0-3,8,10-11" into a CPU set
+#ifdef __linux__
+static int read_cpulist(const char* path, cpu_set_t* set) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    CPU_ZERO(set);
+    unsigned int first, last;
+    while (fscanf(file, "%u", &first) == 1) {
+        last = first;
+        int separator = fgetc(file);
+        if (separator == '-') {
+            if (fscanf(file, "%u", &last) != 1) {
+                break;
+            }
+            separator = fgetc(file);
+        }
+        for (unsigned int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (separator != ',') {
+            break;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+#endif
+
+// Picks a CPU for every worker among those the process may run on. The nodes get equal shares of the workers, in
+// node order, so neighbouring tasks share a node and only the last merge levels read memory of another node; within
+// a node every worker gets its own CPU as long as there are enough. Machines without NUMA nodes count as one node.
+// Returns the number of workers placed: all of them, or 0 if the CPUs could not be found out.
+static unsigned int place_workers(unsigned int workers, int* cpus) {
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (workers == 0 || sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return 0;
+    }
+    // The allowed CPUs of every node that has some
+    cpu_set_t nodes[NUMA_MAX_NODES];
+    unsigned int nodeCount = 0;
+    for (unsigned int node = 0; node < NUMA_MAX_NODES; node++) {
+        char path[64];
+        snprintf(path, sizeof(path), NUMA_NODE_CPULIST, node);
+        cpu_set_t cpusOfNode;
+        if (read_cpulist(path, &cpusOfNode) != 0) {
+            break;
+        }
+        CPU_AND(&nodes[nodeCount], &cpusOfNode, &allowed);
+        if (CPU_COUNT(&nodes[nodeCount]) > 0) {
+            nodeCount++;
+        }
+    }
+    if (nodeCount == 0) {
+        nodes[0] = allowed;
+        nodeCount = 1;
+    }
+
+    for (unsigned int w = 0; w < workers; w++) {
+        unsigned int node = (unsigned int)((unsigned long long)w * nodeCount / workers);
+        unsigned int firstOfNode = (unsigned int)(((unsigned long long)node * workers + nodeCount - 1) / nodeCount);
+        // The (w - firstOfNode)-th CPU of the node, counting around if the node has fewer CPUs than workers
+        int wanted = (int)((w - firstOfNode) % (unsigned int)CPU_COUNT(&nodes[node]));
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &nodes[node]) && wanted-- == 0) {
+                cpus[w] = cpu;
+                break;
+            }
+        }
+    }
+    return workers;
+#else
+    (void)workers;
+    (void)cpus;
+    return 0;
+#endif
+}
+
+
+//// HELPERS
+/// All of them expect the pool lock to be held.
+
+static void queue_batch(ThreadPool* pool, PoolBatch* batch) {
+    if (pool->tail != NULL) {
+        pool->tail->queued = batch;
+    } else {
+        pool->head = batch;
+    }
+    pool->tail = batch;
+    pthread_cond_broadcast(&pool->work);
+}
+
+static void unqueue_batch(ThreadPool* pool, PoolBatch* batch) {
+    PoolBatch** link = &pool->head;
+    PoolBatch* previous = NULL;
+    while (*link != batch) {
+        previous = *link;
+        link = &(*link)->queued;
+    }
+    *link = batch->queued;
+    if (pool->tail == batch) {
+        pool->tail = previous;
+    }
+}
+
+// Hands out the next task of batch, and takes the batch off the queue once its last task is handed out
+static size_t take_task(ThreadPool* pool, PoolBatch* batch) {
+    size_t task = batch->next++;
+    if (batch->next == batch->count) {
+        unqueue_batch(pool, batch);
+    }
+    return task;
+}
+
+static void finish_task(ThreadPool* pool, PoolBatch* batch) {
+    batch->done++;
+    if (batch->done == batch->count) {
+        pthread_cond_broadcast(&pool->finished);
+    }
+}
+
+// Starts workers until the pool has at least the given number
+static void grow(ThreadPool* pool, unsigned int workers) {
+    if (workers <= pool->workerCount) {
+        return;
+    }
+    if (workers > pool->workerCapacity) {
+        pthread_t* grown = realloc(pool->workers, sizeof(pthread_t) * workers);
+        if (grown == NULL) {
+            fprintf(stderr, "Failed to allocate memory for pool workers.\n");
+            return;
+        }
+        pool->workers = grown;
+        pool->workerCapacity = workers;
+    }
+    while (pool->workerCount < workers) {
+        if (pthread_create(&pool->workers[pool->workerCount], NULL, worker_thread, pool) != 0) {
+            perror("Failed to create pool worker");
+            return;
+        }
+        pool->workerCount++;
+    }
+}
+
+
+//// WORKERS
+/// Each worker takes tasks from the oldest queued batch until the pool stops.
+static void* worker_thread(void* arg) {
+    ThreadPool* pool = (ThreadPool*) arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stopping && pool->head == NULL) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        PoolBatch* batch = pool->head;
+        size_t task = take_task(pool, batch);
+        pthread_mutex_unlock(&pool->lock);
+        batch->routine(batch->args + task * batch->argSize);
+        pthread_mutex_lock(&pool->lock);
+        finish_task(pool, batch);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+//// WORK STEALING
+/// Every deque has its own lock. Tasks are only forked above a grain size, so the lock of a deque is taken a few
+/// thousand times per sort at most, and a member hardly ever finds it held by a thief.
+
+// Forked tasks a single member can have waiting. A fork beyond that runs right away instead.
+#define STEAL_DEQUE_CAPACITY 64
+
+// The owner pushes and pops at bottom, thieves steal at top. Live tasks are tasks[top..bottom).
+typedef struct {
+    pthread_mutex_t lock;
+    StealTask* tasks[STEAL_DEQUE_CAPACITY];
+    size_t top;
+    size_t bottom;
+} StealDeque;
+
+struct StealGroup {
+    unsigned int members;
+    // Members that are running their root task
+    atomic_uint active;
+    StealDeque deques[];
+};
+
+
+size_t steal_group_size(unsigned int members) {
+    return sizeof(StealGroup) + sizeof(StealDeque) * members;
+}
+
+
+StealGroup* steal_group_init(void* memory, unsigned int members) {
+    StealGroup* group = (StealGroup*) memory;
+    group->members = members;
+    atomic_init(&group->active, 0);
+    for (unsigned int m = 0; m < members; m++) {
+        pthread_mutex_init(&group->deques[m].lock, NULL);
+        group->deques[m].top = 0;
+        group->deques[m].bottom = 0;
+    }
+    return group;
+}
+
+
+void steal_group_destroy(StealGroup* group) {
+    if (group == NULL) {
+        return;
+    }
+    for (unsigned int m = 0; m < group->members; m++) {
+        pthread_mutex_destroy(&group->deques[m].lock);
+    }
+}
+
+
+static void run_task(StealGroup* group, unsigned int member, StealTask* task) {
+    task->routine(group, member, task->arg);
+    // Release: whoever sees done also sees everything the task wrote
+    atomic_store_explicit(&task->done, 1, memory_order_release);
+}
+
+// Steals the oldest task of the first other member that has one, and runs it. Returns 0 if there was none.
+static int steal_one(StealGroup* group, unsigned int member) {
+    for (unsigned int i = 1; i < group->members; i++) {
+        StealDeque* victim = &group->deques[(member + i) % group->members];
+        StealTask* task = NULL;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->top < victim->bottom) {
+            task = victim->tasks[victim->top++];
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (task != NULL) {
+            run_task(group, member, task);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+void steal_run(StealGroup* group, unsigned int member, void (*routine)(StealGroup*, unsigned int, void*), void* arg) {
+    atomic_fetch_add(&group->active, 1);
+    routine(group, member, arg);
+    atomic_fetch_sub(&group->active, 1);
+
+    // A member only finishes its root task after joining everything it forked, so once no member is active, every
+    // task has run. Members that have not started yet are not waited for: when the pool runs fewer threads than
+    // there are members, they start after this one returns and do their own work.
+    while (atomic_load(&group->active) > 0) {
+        if (!steal_one(group, member)) {
+            sched_yield();
+        }
+    }
+}
+
+
+void steal_fork(StealGroup* group, unsigned int member, StealTask* task) {
+    StealDeque* deque = &group->deques[member];
+    atomic_store_explicit(&task->done, 0, memory_order_relaxed);
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == STEAL_DEQUE_CAPACITY && deque->top > 0) {
+        // Slide the live tasks back to the front to make room
+        memmove(deque->tasks, deque->tasks + deque->top, sizeof(StealTask*) * (deque->bottom - deque->top));
+        deque->bottom -= deque->top;
+        deque->top = 0;
+    }
+    int queued = deque->bottom < STEAL_DEQUE_CAPACITY;
+    if (queued) {
+        deque->tasks[deque->bottom++] = task;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    if (!queued) {
+        run_task(group, member, task);
+    }
+}
+
+
+void steal_join(StealGroup* group, unsigned int member, StealTask* task) {
+    StealDeque* deque = &group->deques[member];
+
+    // Tasks are joined newest first, so the task is either still at the bottom of the deque or was stolen
+    pthread_mutex_lock(&deque->lock);
+    int popped = deque->bottom > deque->top && deque->tasks[deque->bottom - 1] == task;
+    if (popped) {
+        deque->bottom--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    if (popped) {
+        run_task(group, member, task);
+        return;
+    }
+
+    // Thieves steal the oldest task first, so every older task of this member was stolen too and the deque is empty.
+    // Help with the rest of the group's work instead of waiting idle.
+    while (!atomic_load_explicit(&task->done, memory_order_acquire)) {
+        if (!steal_one(group, member)) {
+            sched_yield();
+        }
+    }
+}
@@ -0,0 +1,83 @@
+//// WORKER THREAD POOL
+/// Long-lived worker threads that run the tasks of the sorting engine, so sorting many small batches does not pay
+/// for creating and joining threads in every phase of every sort.
+///
+/// Work is submitted as a batch: one routine and an array of arguments, one task per argument. pool_run queues the
+/// batch, lets the workers take its tasks in order, and returns once all of them have finished. The calling thread
+/// runs tasks of its own batch too instead of just waiting, so a pool with n workers runs n + 1 tasks at a time.
+/// Several threads may run batches on the same pool at once; their batches are served in the order they arrive.
+
+#ifndef MULTITHREADED_SORTING_POOL_H
+#define MULTITHREADED_SORTING_POOL_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+typedef struct ThreadPool ThreadPool;
+
+// Starts a pool with the given number of worker threads (0 is allowed: the callers of pool_run then do all the work).
+// Returns NULL, after printing the reason to stderr, if the pool could not be allocated.
+ThreadPool* pool_create(unsigned int workers);
+
+// Starts a pool for machines with several NUMA nodes, whose memory is allocated on the node of the core that first
+// writes it. Each of the given number of workers is pinned to its own core, with the workers spread evenly over the
+// nodes in order. Task i of every batch then always runs on worker i % workers, while the caller of pool_run only
+// waits, so tasks that work on the same part of an array in every phase of a sort find its memory on their own node.
+// The pool does not grow: batches of more tasks run several tasks per worker. Where the CPUs can not be found out,
+// the workers are not pinned but keep their fixed share of every batch. Returns like pool_create.
+ThreadPool* pool_create_pinned(unsigned int workers);
+
+// Stops the workers and frees the pool. No batch may be running.
+void pool_destroy(ThreadPool* pool);
+
+// Runs routine(args + i * argSize) for every i in [0, count) and waits for all of them.
+// Before queueing the batch, the pool starts more workers if it has fewer than count - 1 (except pinned pools), so
+// a batch of count tasks can run in parallel. If a worker can not be started, the tasks still run, just on fewer threads.
+// With a NULL pool, the tasks run one after the other on the calling thread.
+void pool_run(ThreadPool* pool, void* (*routine)(void*), void* args, size_t argSize, size_t count);
+
+// The pool shared by all sorts of the process, created on first use with no workers; pool_run grows it on demand.
+// Returns NULL if it could not be created, which pool_run accepts.
+ThreadPool* shared_pool(void);
+
+
+//// WORK STEALING
+/// For recursive work whose cost is not known up front, such as sorting runs that are partly presorted or comparing
+/// records with a comparator whose cost varies, a fixed split leaves threads idle while others are still busy.
+/// A steal group gives each of its members (typically the tasks of one pool_run batch) a deque of forked tasks.
+/// A member pushes the subtasks it forks onto its own deque and pops them back when it joins them, newest first.
+/// A member that runs out of work steals the oldest task of another member, which in a divide-and-conquer
+/// recursion is the biggest one left, and runs it as if it had forked it itself.
+
+typedef struct StealGroup StealGroup;
+
+typedef struct {
+    // Runs the task on behalf of the given member, which may fork and join tasks of its own
+    void (*routine)(StealGroup* group, unsigned int member, void* arg);
+    void* arg;
+    // Set once routine has returned. steal_fork clears it.
+    atomic_int done;
+} StealTask;
+
+// Bytes of memory a group of the given number of members takes. The caller provides the memory, so it can come
+// from an arena (see arena.h); it must be aligned like malloc's.
+size_t steal_group_size(unsigned int members);
+
+// Sets up a group of the given number of members in memory of at least steal_group_size(members) bytes
+StealGroup* steal_group_init(void* memory, unsigned int members);
+
+// Tears the group down; its memory can then be freed or reused. No member may still be running. NULL is ignored.
+void steal_group_destroy(StealGroup* group);
+
+// Runs routine(group, member, arg) as the root task of member, then keeps stealing tasks from the other members
+// until every member that has started has finished its root task, so all the work of the group is done.
+void steal_run(StealGroup* group, unsigned int member, void (*routine)(StealGroup*, unsigned int, void*), void* arg);
+
+// Makes task available to the other members. The task must stay alive until steal_join returns.
+void steal_fork(StealGroup* group, unsigned int member, StealTask* task);
+
+// Waits for a task forked by the same member, which joins its tasks in the reverse order it forked them.
+// A task nobody stole yet is run right here; otherwise the member steals other work until its thief is done.
+void steal_join(StealGroup* group, unsigned int member, StealTask* task);
+
+#endif //MULTITHREADED_SORTING_POOL_H
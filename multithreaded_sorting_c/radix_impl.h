@@ -0,0 +1,297 @@
+//// PARALLEL LSD RADIX SORT TEMPLATE
+/// Included by sort_impl.h for integer element types, with its macros still defined, plus:
+///     SORT_RADIX_KEY     the unsigned integer type of the same width as the key (SORT_KEY) of SORT_TYPE
+///     SORT_RADIX_SIGNED  1 if the key is signed, else 0
+///
+/// The keys are sorted one byte (digit) at a time, starting from the least significant one. Each pass is a
+/// stable counting sort on one digit, so after the last pass the array is ordered by all digits.
+/// One pass runs in two parallel phases, on the same partitioning as the merge sort:
+///     1. Every thread counts how many keys of its slice of the source fall into each of the 256 buckets.
+///     2. A prefix sum over the buckets, and within a bucket over the threads, gives every thread the position
+///        in the destination where each of its buckets starts. The threads then scatter their keys there.
+/// Signed keys have their sign bit flipped before the digits are taken, so negative keys sort before positive ones.
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1u << RADIX_BITS)
+#define RADIX_PASSES (sizeof(SORT_RADIX_KEY) * 8 / RADIX_BITS)
+// Scatter buffers hold one cache line of keys per bucket (see radix_scatter_thread)
+#define RADIX_LINE_BYTES 64
+#define RADIX_LINE_KEYS (RADIX_LINE_BYTES / sizeof(SORT_TYPE))
+// Arrays of at least this many bytes are scattered with non-temporal stores (see radix_flush_line)
+#define RADIX_STREAM_BYTES ((size_t)8 << 20)
+
+
+//// STRUCTS
+// For each radix thread, in both phases of a pass
+typedef struct {
+    // The slice [begin, end) of source that this thread counts and scatters
+    const SORT_TYPE* source;
+    size_t begin;
+    size_t end;
+    SORT_TYPE* destination;
+    // The digit of the pass, as a bit shift
+    unsigned int shift;
+    // Whether the scatter writes full lines with non-temporal stores
+    int stream;
+    // RADIX_PASSES rows of RADIX_BUCKETS counters, one row per digit. The counting phase fills in the row of
+    // the pass, and the prefix sum turns it into the bucket positions in destination for the scatter phase.
+    size_t* counts;
+} SORT_FN(RadixThreadParameters);
+
+
+//// KEYS
+// The key with its sign bit flipped for signed types, so the unsigned order of keys matches the signed order of values
+static inline SORT_RADIX_KEY SORT_FN(radix_key)(SORT_TYPE value) {
+    return (SORT_RADIX_KEY)SORT_KEY(value) ^ (SORT_RADIX_SIGNED ? (SORT_RADIX_KEY)1 << (sizeof(SORT_RADIX_KEY) * 8 - 1) : 0);
+}
+
+static inline unsigned int SORT_FN(radix_digit)(SORT_TYPE value, unsigned int shift) {
+    return (unsigned int)(SORT_FN(radix_key)(value) >> shift) & (RADIX_BUCKETS - 1);
+}
+
+
+//// THREADS
+
+// Counts the digits of every pass at once. Used before the first pass, on the input, to find out which passes
+// can be skipped because every key has the same digit.
+static void* SORT_FN(radix_count_all_thread)(void* arg) {
+    SORT_FN(RadixThreadParameters)* params = (SORT_FN(RadixThreadParameters)*) arg;
+    const SORT_TYPE* source = params->source;
+    size_t* counts = params->counts;
+    memset(counts, 0, sizeof(size_t) * RADIX_PASSES * RADIX_BUCKETS);
+    for (size_t i = params->begin; i < params->end; i++) {
+        SORT_RADIX_KEY key = SORT_FN(radix_key)(source[i]);
+        for (unsigned int pass = 0; pass < RADIX_PASSES; pass++) {
+            counts[pass * RADIX_BUCKETS + ((key >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1))]++;
+        }
+    }
+    return NULL;
+}
+
+// Counts the digit of one pass
+static void* SORT_FN(radix_count_thread)(void* arg) {
+    SORT_FN(RadixThreadParameters)* params = (SORT_FN(RadixThreadParameters)*) arg;
+    const SORT_TYPE* source = params->source;
+    unsigned int shift = params->shift;
+    size_t* counts = params->counts + (shift / RADIX_BITS) * RADIX_BUCKETS;
+    memset(counts, 0, sizeof(size_t) * RADIX_BUCKETS);
+    for (size_t i = params->begin; i < params->end; i++) {
+        counts[SORT_FN(radix_digit)(source[i], shift)]++;
+    }
+    return NULL;
+}
+
+// Copies one full, aligned line of keys from a scatter buffer to the destination. Non-temporal stores write the line
+// straight to memory, without first reading it into the cache only to overwrite it, and without evicting the
+// source being scattered. They only pay off for arrays that do not fit in the cache anyway (see radix_sort).
+static inline void SORT_FN(radix_flush_line)(SORT_TYPE* line, const SORT_TYPE* buffer, int stream) {
+#ifdef __SSE2__
+    if (stream) {
+        const __m128i* from = (const __m128i*)buffer;
+        __m128i* to = (__m128i*)line;
+        for (unsigned int i = 0; i < RADIX_LINE_BYTES / sizeof(__m128i); i++) {
+            _mm_stream_si128(to + i, _mm_load_si128(from + i));
+        }
+        return;
+    }
+#else
+    (void)stream;
+#endif
+    memcpy(line, buffer, RADIX_LINE_BYTES);
+}
+
+// Moves the keys of the slice to their bucket positions in destination.
+// Writing each key straight to its bucket would touch 256 different places in memory all the time, which costs
+// a cache miss per key and more TLB entries than the CPU has. Instead keys are collected in a small buffer per
+// bucket (write combining), and a whole cache line is copied to the destination when a buffer fills up.
+// The buffers are lined up with the cache lines of the destination: a bucket that starts in the middle of a line
+// fills its buffer from that point on, and only the keys from there are copied at its first flush. Every later
+// flush then writes exactly one aligned line.
+static void* SORT_FN(radix_scatter_thread)(void* arg) {
+    SORT_FN(RadixThreadParameters)* params = (SORT_FN(RadixThreadParameters)*) arg;
+    // Local copies, so the compiler does not reload them after every store into the destination
+    const SORT_TYPE* source = params->source;
+    SORT_TYPE* destination = params->destination;
+    unsigned int shift = params->shift;
+    int stream = params->stream;
+    const size_t* starts = params->counts + (shift / RADIX_BITS) * RADIX_BUCKETS;
+
+    _Alignas(RADIX_LINE_BYTES) SORT_TYPE buffers[RADIX_BUCKETS][RADIX_LINE_KEYS];
+    // Per bucket: the destination position of the line the buffer maps to, the number of keys in the buffer
+    // (counting the unused slots before the bucket's start), and the first slot that belongs to the bucket
+    size_t lines[RADIX_BUCKETS];
+    unsigned int fill[RADIX_BUCKETS];
+    unsigned int first[RADIX_BUCKETS];
+    for (unsigned int bucket = 0; bucket < RADIX_BUCKETS; bucket++) {
+        first[bucket] = (unsigned int)(((uintptr_t)(destination + starts[bucket]) % RADIX_LINE_BYTES) / sizeof(SORT_TYPE));
+        fill[bucket] = first[bucket];
+        lines[bucket] = starts[bucket] - first[bucket];
+    }
+
+    for (size_t i = params->begin; i < params->end; i++) {
+        SORT_TYPE value = source[i];
+        unsigned int bucket = SORT_FN(radix_digit)(value, shift);
+        buffers[bucket][fill[bucket]++] = value;
+        if (fill[bucket] == RADIX_LINE_KEYS) {
+            if (first[bucket] == 0) {
+                SORT_FN(radix_flush_line)(destination + lines[bucket], buffers[bucket], stream);
+            } else {
+                memcpy(destination + lines[bucket] + first[bucket], buffers[bucket] + first[bucket],
+                       (RADIX_LINE_KEYS - first[bucket]) * sizeof(SORT_TYPE));
+                first[bucket] = 0;
+            }
+            lines[bucket] += RADIX_LINE_KEYS;
+            fill[bucket] = 0;
+        }
+    }
+    // Flush the partly filled buffers
+    for (unsigned int bucket = 0; bucket < RADIX_BUCKETS; bucket++) {
+        memcpy(destination + lines[bucket] + first[bucket], buffers[bucket] + first[bucket],
+               (fill[bucket] - first[bucket]) * sizeof(SORT_TYPE));
+    }
+#ifdef __SSE2__
+    // Non-temporal stores are weakly ordered; make them visible before the thread is joined
+    if (stream) {
+        _mm_sfence();
+    }
+#endif
+    return NULL;
+}
+
+
+// Runs routine once per parameter set on the worker pool (see pool.h) and waits for all of them, recording them in
+// the trace as the given phase and level (see trace.h)
+static void SORT_FN(radix_run)(const SortResources* resources, const char* phase, unsigned int level,
+                               void* (*routine)(void*), SORT_FN(RadixThreadParameters)* params, unsigned int threads) {
+    trace_run(resources->trace, phase, level, resources->pool, routine, params, sizeof(*params), threads);
+}
+
+
+//// ENTRY POINTS
+static int SORT_FN(radix_sort_with)(const SORT_TYPE* input, SORT_TYPE* output, size_t count, unsigned int threads,
+                                    const SortResources* resources);
+
+#ifndef SORT_PRIVATE
+/// See sort.h for the contract.
+int SORT_FN(radix_sort)(const SORT_TYPE* input, SORT_TYPE* output, size_t count, unsigned int threads) {
+    SortResources resources = {shared_pool(), NULL, NULL};
+    return SORT_FN(radix_sort_with)(input, output, count, threads, &resources);
+}
+#endif
+
+// The radix sort on the pool and scratch memory of resources (see SortResources in sort.h)
+static int SORT_FN(radix_sort_with)(const SORT_TYPE* input, SORT_TYPE* output, size_t count, unsigned int threads,
+                                    const SortResources* resources) {
+    if (count == 0) {
+        return 0;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > count) {
+        threads = (unsigned int)count;
+    }
+
+    //// ALLOCATION
+    /// Like the merge sort, the passes ping-pong between output and one scratch buffer, and the input is only read.
+    /// Everything comes from the caller's arena if there is one (see arena.h).
+    Arena* arena = resources->arena;
+    SORT_FN(RadixThreadParameters)* params = arena_alloc(arena, sizeof(*params) * threads);
+    size_t* counts = arena_alloc(arena, sizeof(size_t) * RADIX_PASSES * RADIX_BUCKETS * threads);
+    SORT_TYPE* scratch = arena_alloc(arena, sizeof(SORT_TYPE) * count);
+    if (params == NULL || counts == NULL || scratch == NULL) {
+        fprintf(stderr, "Failed to allocate memory for sorting.\n");
+        arena_free(arena, params);
+        arena_free(arena, counts);
+        arena_free(arena, scratch);
+        return -1;
+    }
+    SortTrace* trace = resources->trace;
+    for (unsigned int t = 0; t < threads; t++) {
+        params[t].source = input;
+        params[t].begin = t * count / threads;
+        params[t].end = (t + 1) * count / threads;
+        params[t].counts = counts + (size_t)t * RADIX_PASSES * RADIX_BUCKETS;
+        params[t].stream = count * sizeof(SORT_TYPE) >= RADIX_STREAM_BYTES;
+    }
+
+    //// PLAN THE PASSES
+    /// A pass whose digit is the same for every key would not move anything, so it is skipped. Knowing the number
+    /// of remaining passes up front picks the buffer of the first pass so that the last one writes into output.
+    SORT_FN(radix_run)(resources, "radix count", 0, SORT_FN(radix_count_all_thread), params, threads);
+    unsigned int passes[RADIX_PASSES];
+    unsigned int passCount = 0;
+    for (unsigned int pass = 0; pass < RADIX_PASSES; pass++) {
+        int skip = 0;
+        for (unsigned int bucket = 0; bucket < RADIX_BUCKETS && !skip; bucket++) {
+            size_t total = 0;
+            for (unsigned int t = 0; t < threads; t++) {
+                total += params[t].counts[pass * RADIX_BUCKETS + bucket];
+            }
+            skip = total == count;
+        }
+        if (!skip) {
+            passes[passCount++] = pass;
+        }
+    }
+    if (passCount == 0 && output != input) {
+        // All keys are equal
+        TraceSpan copy = trace_span_begin(trace);
+        memcpy(output, input, sizeof(SORT_TYPE) * count);
+        trace_span_end(trace, "copy", 0, &copy);
+    }
+
+    //// PASSES
+    /// Sorting in place with an odd number of passes, the first pass would scatter into the keys it is reading,
+    /// so they are moved to the scratch buffer first and the passes start from there.
+    const SORT_TYPE* source = input;
+    if (output == input && passCount % 2 == 1) {
+        TraceSpan copy = trace_span_begin(trace);
+        memcpy(scratch, input, sizeof(SORT_TYPE) * count);
+        trace_span_end(trace, "copy", 0, &copy);
+        source = scratch;
+    }
+    for (unsigned int p = 0; p < passCount; p++) {
+        unsigned int pass = passes[p];
+        SORT_TYPE* destination = ((passCount - 1 - p) % 2 == 0) ? output : scratch;
+        for (unsigned int t = 0; t < threads; t++) {
+            params[t].source = source;
+            params[t].destination = destination;
+            params[t].shift = pass * RADIX_BITS;
+        }
+
+        // The first pass reuses the counts of the planning step, which were taken over the same slices of the input
+        if (p > 0) {
+            SORT_FN(radix_run)(resources, "radix count", p + 1, SORT_FN(radix_count_thread), params, threads);
+        }
+
+        // Exclusive prefix sum in bucket-major, thread-minor order: bucket b of thread t starts after all smaller
+        // buckets, and after bucket b of every earlier thread, which keeps each pass stable
+        size_t position = 0;
+        for (unsigned int bucket = 0; bucket < RADIX_BUCKETS; bucket++) {
+            for (unsigned int t = 0; t < threads; t++) {
+                size_t* cell = &params[t].counts[pass * RADIX_BUCKETS + bucket];
+                size_t bucketCount = *cell;
+                *cell = position;
+                position += bucketCount;
+            }
+        }
+
+        SORT_FN(radix_run)(resources, "radix scatter", p + 1, SORT_FN(radix_scatter_thread), params, threads);
+        source = destination;
+    }
+
+    //// CLEAN UP MEMORY
+    arena_free(arena, params);
+    arena_free(arena, counts);
+    arena_free(arena, scratch);
+    return 0;
+}
+
+
+#undef RADIX_BITS
+#undef RADIX_BUCKETS
+#undef RADIX_PASSES
+#undef RADIX_LINE_BYTES
+#undef RADIX_LINE_KEYS
+#undef RADIX_STREAM_BYTES
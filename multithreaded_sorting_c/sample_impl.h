@@ -0,0 +1,278 @@
+//// PARALLEL SAMPLE SORT TEMPLATE
+/// Included by sort_impl.h for every element type, after its structs and prototypes, with its macros still defined.
+///
+/// The merge sort sorts one partition per thread and then merges the sorted partitions in ceil(log2(threads))
+/// passes over the whole array. The sample sort splits the elements by value up front instead, so the pieces it
+/// sorts never have to be merged:
+///     1. A sorted random sample of the input gives the splitters that cut the key range into buckets of about
+///        the same size.
+///     2. Every thread classifies the elements of its slice of the input with a splitter tree, notes down the
+///        bucket of each element, and counts how many land in every bucket.
+///     3. A prefix sum over the counts gives every thread the position of each of its buckets in the scratch
+///        buffer, and the threads scatter their elements there.
+///     4. The buckets are sorted from the scratch buffer into output, each on its own. Every thread takes the buckets
+///        that start in its partition of the array; a thread that runs out steals halves of the others' buckets.
+/// The elements cross memory twice (the classification reads them, the scatter moves them) before the buckets are
+/// sorted, however many threads there are.
+///
+/// The scatter keeps the input order of the elements of every thread, and the threads' pieces of a bucket in thread
+/// order, and equal keys always fall into the same bucket, so the sample sort is as stable as the merge sort.
+
+// At most this many buckets, so a bucket number fits in a byte
+#define SAMPLE_MAX_BUCKETS 256
+// Buckets per thread: more buckets than threads keep one unlucky bucket from holding up a whole thread
+#define SAMPLE_BUCKETS_PER_THREAD 4
+// Samples drawn per bucket. More samples give buckets of more even sizes.
+#define SAMPLE_OVERSAMPLING 16
+// Fewer elements than this per bucket are not worth the classification pass; the merge sort is used instead
+#define SAMPLE_MIN_BUCKET_SIZE 1024
+
+
+//// STRUCTS
+// For each sample sort thread, in all phases
+typedef struct {
+    // The slice [begin, end) of the input that this thread classifies and scatters
+    const SORT_TYPE* source;
+    size_t begin;
+    size_t end;
+    // The splitter tree (see sample_classify) and its depth, which is log2 of the number of buckets
+    const SORT_TYPE* tree;
+    unsigned int levels;
+    // The bucket of every element of the input, filled in by the classification
+    unsigned char* oracle;
+    // One counter per bucket: the classification counts this thread's elements in every bucket, and the prefix sum
+    // turns the counts into the positions in scratch where the scatter puts them
+    size_t* counts;
+    SORT_TYPE* scratch;
+    SORT_TYPE* output;
+    // Sorting phase: the buckets [firstBucket, endBucket) this thread sorts, which start at bucketStarts[b] in both
+    // scratch and output
+    const size_t* bucketStarts;
+    unsigned int firstBucket;
+    unsigned int endBucket;
+    StealGroup* group;
+    unsigned int member;
+} SORT_FN(SampleThreadParameters);
+
+
+//// CLASSIFICATION
+/// The splitters are stored as an implicit binary search tree: the root at tree[1], and the children of tree[j] at
+/// tree[2j] and tree[2j + 1]. Finding an element's bucket walks down the tree one comparison per level, and the
+/// comparison only picks the next index instead of branching, so random keys cause no branch mispredictions.
+
+static inline unsigned int SORT_FN(sample_classify)(const SORT_TYPE* tree, unsigned int levels, SORT_TYPE value) {
+    unsigned int j = 1;
+    for (unsigned int level = 0; level < levels; level++) {
+        j = 2 * j + (SORT_LESS(tree[j], value) ? 1u : 0u);
+    }
+    // Bucket b holds the elements bigger than splitter b - 1 and not bigger than splitter b
+    return j - (1u << levels);
+}
+
+// Lays out the buckets - 1 sorted splitters as the tree: node j on level l (2^l <= j < 2^(l + 1)) is the middle
+// splitter of its subtree
+static void SORT_FN(sample_build_tree)(const SORT_TYPE* splitters, unsigned int levels, SORT_TYPE* tree) {
+    unsigned int buckets = 1u << levels;
+    for (unsigned int level = 0; level < levels; level++) {
+        for (unsigned int position = 0; position < (1u << level); position++) {
+            tree[(1u << level) + position] = splitters[(2 * position + 1) * (buckets >> (level + 1)) - 1];
+        }
+    }
+}
+
+
+//// THREADS
+
+static void* SORT_FN(sample_classify_thread)(void* arg) {
+    SORT_FN(SampleThreadParameters)* params = (SORT_FN(SampleThreadParameters)*) arg;
+    // Local copies, so the compiler does not reload them after every store into the oracle
+    const SORT_TYPE* source = params->source;
+    const SORT_TYPE* tree = params->tree;
+    unsigned int levels = params->levels;
+    unsigned char* oracle = params->oracle;
+    size_t* counts = params->counts;
+    memset(counts, 0, sizeof(size_t) << levels);
+    for (size_t i = params->begin; i < params->end; i++) {
+        unsigned int bucket = SORT_FN(sample_classify)(tree, levels, source[i]);
+        oracle[i] = (unsigned char)bucket;
+        counts[bucket]++;
+    }
+    return NULL;
+}
+
+// Moves the elements of the slice to the positions of their buckets in scratch, in input order
+static void* SORT_FN(sample_scatter_thread)(void* arg) {
+    SORT_FN(SampleThreadParameters)* params = (SORT_FN(SampleThreadParameters)*) arg;
+    const SORT_TYPE* source = params->source;
+    const unsigned char* oracle = params->oracle;
+    SORT_TYPE* scratch = params->scratch;
+    size_t* positions = params->counts;
+    for (size_t i = params->begin; i < params->end; i++) {
+        scratch[positions[oracle[i]]++] = source[i];
+    }
+    return NULL;
+}
+
+// Steal group task that sorts the buckets of a SampleThreadParameters from scratch into output. Each bucket is sorted
+// like a partition of the merge sort, with its own range of scratch as the other buffer.
+static void SORT_FN(sample_bucket_task)(StealGroup* group, unsigned int member, void* arg) {
+    SORT_FN(SampleThreadParameters)* params = (SORT_FN(SampleThreadParameters)*) arg;
+    for (unsigned int b = params->firstBucket; b < params->endBucket; b++) {
+        size_t begin = params->bucketStarts[b];
+        size_t size = params->bucketStarts[b + 1] - begin;
+        SORT_FN(SortingThreadParameters) bucket = {
+            params->scratch + begin, size, params->output + begin, params->scratch + begin, group, member,
+        };
+        SORT_FN(sort_partition_task)(group, member, &bucket);
+    }
+}
+
+static void* SORT_FN(sample_sort_thread)(void* arg) {
+    SORT_FN(SampleThreadParameters)* params = (SORT_FN(SampleThreadParameters)*) arg;
+    if (params->group != NULL) {
+        steal_run(params->group, params->member, SORT_FN(sample_bucket_task), params);
+    } else {
+        SORT_FN(sample_bucket_task)(NULL, 0, params);
+    }
+    return NULL;
+}
+
+
+//// ENTRY POINT
+
+// The number of buckets to sample sort count elements with on the given number of threads: a power of two, at least
+// two, with at least SAMPLE_MIN_BUCKET_SIZE elements per bucket. 0 if the array is too small for even two buckets.
+static unsigned int SORT_FN(sample_buckets)(size_t count, unsigned int threads) {
+    unsigned int buckets = 2;
+    while (buckets < SAMPLE_MAX_BUCKETS && buckets < threads * SAMPLE_BUCKETS_PER_THREAD) {
+        buckets *= 2;
+    }
+    while (buckets > 2 && count / buckets < SAMPLE_MIN_BUCKET_SIZE) {
+        buckets /= 2;
+    }
+    return count / buckets < SAMPLE_MIN_BUCKET_SIZE ? 0 : buckets;
+}
+
+// The sample sort on the pool and scratch memory of resources, into the given number of buckets (see sample_buckets).
+// The caller has already clamped threads to [1, count].
+static int SORT_FN(sample_sort_with)(const SORT_TYPE* input, SORT_TYPE* output, size_t count, unsigned int threads,
+                                     unsigned int buckets, const SortResources* resources) {
+    unsigned int levels = 0;
+    while ((1u << levels) < buckets) {
+        levels++;
+    }
+    size_t sampleCount = (size_t)buckets * SAMPLE_OVERSAMPLING;
+
+    //// ALLOCATION
+    /// Like the other sorts, everything comes from the caller's arena if there is one (see arena.h). On top of the
+    /// scratch buffer, the sample sort needs a byte per element for the bucket numbers.
+    Arena* arena = resources->arena;
+    SORT_FN(SampleThreadParameters)* params = arena_alloc(arena, sizeof(*params) * threads);
+    size_t* counts = arena_alloc(arena, sizeof(size_t) * buckets * threads);
+    size_t* bucketStarts = arena_alloc(arena, sizeof(size_t) * (buckets + 1));
+    SORT_TYPE* samples = arena_alloc(arena, sizeof(SORT_TYPE) * 2 * sampleCount);
+    SORT_TYPE* scratch = arena_alloc(arena, sizeof(SORT_TYPE) * count);
+    unsigned char* oracle = arena_alloc(arena, count);
+    void* groupMemory = threads > 1 ? arena_alloc(arena, steal_group_size(threads)) : NULL;
+    if (params == NULL || counts == NULL || bucketStarts == NULL || samples == NULL || scratch == NULL ||
+        oracle == NULL || (threads > 1 && groupMemory == NULL)) {
+        fprintf(stderr, "Failed to allocate memory for sorting.\n");
+        arena_free(arena, params);
+        arena_free(arena, counts);
+        arena_free(arena, bucketStarts);
+        arena_free(arena, samples);
+        arena_free(arena, scratch);
+        arena_free(arena, oracle);
+        arena_free(arena, groupMemory);
+        return -1;
+    }
+    ThreadPool* pool = resources->pool;
+    SortTrace* trace = resources->trace;
+
+    //// SPLITTERS
+    /// The samples are drawn at pseudo-random positions (the same ones for every sort of the same size), so
+    /// periodic patterns in the input do not skew them. Every SAMPLE_OVERSAMPLING-th sorted sample is a splitter.
+    TraceSpan sampling = trace_span_begin(trace);
+    uint64_t state = count;
+    for (size_t s = 0; s < sampleCount; s++) {
+        // splitmix64
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        samples[s] = input[(z ^ (z >> 31)) % count];
+    }
+    // The second half of the samples buffer is the work space of their sort, and then holds the splitters, from which
+    // the tree is built over the sorted samples
+    SORT_FN(merge_sort_into)(samples, samples, samples + sampleCount, sampleCount);
+    SORT_TYPE* splitters = samples + sampleCount;
+    for (unsigned int b = 0; b + 1 < buckets; b++) {
+        splitters[b] = samples[(b + 1) * SAMPLE_OVERSAMPLING];
+    }
+    SORT_TYPE* tree = samples;
+    SORT_FN(sample_build_tree)(splitters, levels, tree);
+    trace_span_end(trace, "sample", 0, &sampling);
+
+    //// CLASSIFY AND COUNT
+    StealGroup* group = threads > 1 ? steal_group_init(groupMemory, threads) : NULL;
+    for (unsigned int t = 0; t < threads; t++) {
+        params[t].source = input;
+        // Classifying writes one oracle byte per element, whose lines hold whole lines of the elements too
+        params[t].begin = slice_begin(t, count, threads, sizeof(*oracle));
+        params[t].end = slice_begin(t + 1, count, threads, sizeof(*oracle));
+        params[t].tree = tree;
+        params[t].levels = levels;
+        params[t].oracle = oracle;
+        params[t].counts = counts + (size_t)t * buckets;
+        params[t].scratch = scratch;
+        params[t].output = output;
+        params[t].bucketStarts = bucketStarts;
+        params[t].group = group;
+        params[t].member = t;
+    }
+    trace_run(trace, "classify", 0, pool, SORT_FN(sample_classify_thread), params, sizeof(*params), threads);
+
+    //// SCATTER
+    /// Exclusive prefix sum in bucket-major, thread-minor order, as in the radix sort: bucket b of thread t starts
+    /// after all smaller buckets, and after bucket b of every earlier thread
+    size_t position = 0;
+    for (unsigned int b = 0; b < buckets; b++) {
+        bucketStarts[b] = position;
+        for (unsigned int t = 0; t < threads; t++) {
+            size_t bucketCount = params[t].counts[b];
+            params[t].counts[b] = position;
+            position += bucketCount;
+        }
+    }
+    bucketStarts[buckets] = count;
+    trace_run(trace, "scatter", 0, pool, SORT_FN(sample_scatter_thread), params, sizeof(*params), threads);
+
+    //// SORT THE BUCKETS
+    /// Thread t takes the buckets that start in [begin, end) of its classify slice, so it works on the
+    /// same part of the array it classified, and on the same part of output the merge sort would give it.
+    unsigned int b = 0;
+    for (unsigned int t = 0; t < threads; t++) {
+        params[t].firstBucket = b;
+        while (b < buckets && (t + 1 == threads || bucketStarts[b] < params[t].end)) {
+            b++;
+        }
+        params[t].endBucket = b;
+    }
+    trace_run(trace, "bucket sort", 0, pool, SORT_FN(sample_sort_thread), params, sizeof(*params), threads);
+    steal_group_destroy(group);
+
+    //// CLEAN UP MEMORY
+    arena_free(arena, params);
+    arena_free(arena, counts);
+    arena_free(arena, bucketStarts);
+    arena_free(arena, samples);
+    arena_free(arena, scratch);
+    arena_free(arena, oracle);
+    arena_free(arena, groupMemory);
+    return 0;
+}
+
+
+#undef SAMPLE_MAX_BUCKETS
+#undef SAMPLE_BUCKETS_PER_THREAD
+#undef SAMPLE_OVERSAMPLING
+#undef SAMPLE_MIN_BUCKET_SIZE
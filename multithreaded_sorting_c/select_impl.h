@@ -0,0 +1,422 @@
+//// PARTIAL SORT AND SELECTION TEMPLATE
+/// Included by sort_impl.h for every public element type, after its structs and prototypes, with its macros still
+/// defined. Both entry points run on the same partitions and pool as the sort (see sort.h for their contracts):
+///
+/// partial_sort writes the k smallest elements, sorted, without sorting the rest. Every thread keeps the k smallest
+/// elements of its slice of the input in a max-heap, which costs a single comparison with the root for all the
+/// elements that do not make it, and sorts its heap when the slice is done. The threads' runs are then merged,
+/// keeping the first k elements only. For k much smaller than the count, that is close to one read of the input.
+/// Bigger k are sorted in full, which is cheaper once most elements would go through the heaps.
+///
+/// nth_element finds the element at a given rank with a parallel quickselect that narrows the elements down instead
+/// of partitioning them in place: every round picks two pivots around the rank from a sorted sample, the threads
+/// count the elements below, between and above them in parallel, and the threads then copy the part that holds the
+/// rank to a new buffer, side by side in thread order. A round keeps about a 16th of the elements, so a few rounds
+/// leave few enough to sort on the calling thread.
+///
+/// Both keep the order of equal keys: the heaps break ties by input position, and the rounds of the selection copy
+/// the elements they keep in input order, so they give the same elements the stable sort has at those positions.
+
+// partial_sort uses the heaps for k up to a 16th of the count, and sorts in full above that
+#define SELECT_TOP_K_MAX_FRACTION 16
+// Samples a selection round picks its pivots from
+#define SELECT_SAMPLES 128
+// The pivots are this many samples below and above the rank, so about 2 * 8 / 128 of the elements lie between them
+#define SELECT_SPREAD 8
+// Once no more elements than this are left, the selection sorts them on the calling thread
+#define SELECT_SERIAL_SIZE 4096
+
+
+//// STRUCTS
+// An element of a top-k heap, with its position in the thread's slice to break ties between equal keys
+typedef struct {
+    SORT_TYPE element;
+    size_t index;
+} SORT_FN(RankedElement);
+
+// For each top-k thread
+typedef struct {
+    // The slice [begin, end) of the input that this thread scans
+    const SORT_TYPE* source;
+    size_t begin;
+    size_t end;
+    // Room for the min(k, end - begin) smallest elements of the slice, and where they end up in sorted order
+    SORT_FN(RankedElement)* heap;
+    size_t heapSize;
+    SORT_TYPE* run;
+} SORT_FN(TopKThreadParameters);
+
+// For each selection thread, in both phases of a round
+typedef struct {
+    // The slice [begin, end) of the elements left after the previous round (or of the input in the first)
+    const SORT_TYPE* source;
+    size_t begin;
+    size_t end;
+    // The pivots of the round: elements below low are counted in below, elements above high in above
+    SORT_TYPE low;
+    SORT_TYPE high;
+    size_t below;
+    size_t above;
+    // Copy phase: which part to keep (0 below, 1 between, 2 above), and where this thread's share of it goes
+    int keep;
+    SORT_TYPE* destination;
+    size_t kept;
+} SORT_FN(SelectThreadParameters);
+
+
+//// TOP K HEAPS
+/// A max-heap of the smallest elements seen so far: heap[0] is the element that would be dropped first. Between
+/// equal keys, the later one in the input comes out first, so a new element with the same key as the root never
+/// replaces it: the first elements of a key are kept, as in the stable sort.
+
+// Whether a comes after b in the stable sorted order
+static inline int SORT_FN(ranked_after)(const SORT_FN(RankedElement)* a, const SORT_FN(RankedElement)* b) {
+    return SORT_LESS(b->element, a->element) || (!SORT_LESS(a->element, b->element) && a->index > b->index);
+}
+
+// Moves heap[index] down until no child comes after it
+static void SORT_FN(ranked_sift_down)(SORT_FN(RankedElement)* heap, size_t size, size_t index) {
+    for (;;) {
+        size_t largest = index;
+        size_t left = 2 * index + 1;
+        size_t right = left + 1;
+        if (left < size && SORT_FN(ranked_after)(&heap[left], &heap[largest])) {
+            largest = left;
+        }
+        if (right < size && SORT_FN(ranked_after)(&heap[right], &heap[largest])) {
+            largest = right;
+        }
+        if (largest == index) {
+            return;
+        }
+        SORT_FN(RankedElement) swap = heap[index];
+        heap[index] = heap[largest];
+        heap[largest] = swap;
+        index = largest;
+    }
+}
+
+static void* SORT_FN(top_k_thread)(void* arg) {
+    SORT_FN(TopKThreadParameters)* params = (SORT_FN(TopKThreadParameters)*) arg;
+    const SORT_TYPE* slice = params->source + params->begin;
+    size_t size = params->end - params->begin;
+    SORT_FN(RankedElement)* heap = params->heap;
+    size_t heapSize = params->heapSize;
+
+    // The first heapSize elements fill the heap; every later one only gets in if it is smaller than the root
+    for (size_t i = 0; i < heapSize; i++) {
+        heap[i].element = slice[i];
+        heap[i].index = i;
+    }
+    for (size_t i = heapSize / 2; i-- > 0;) {
+        SORT_FN(ranked_sift_down)(heap, heapSize, i);
+    }
+    for (size_t i = heapSize; i < size; i++) {
+        if (SORT_LESS(slice[i], heap[0].element)) {
+            heap[0].element = slice[i];
+            heap[0].index = i;
+            SORT_FN(ranked_sift_down)(heap, heapSize, 0);
+        }
+    }
+
+    // Heap sort: the root goes to the end of the shrinking heap, which leaves it in ascending order
+    for (size_t end = heapSize; end > 1; end--) {
+        SORT_FN(RankedElement) last = heap[0];
+        heap[0] = heap[end - 1];
+        heap[end - 1] = last;
+        SORT_FN(ranked_sift_down)(heap, end - 1, 0);
+    }
+    for (size_t i = 0; i < heapSize; i++) {
+        params->run[i] = heap[i].element;
+    }
+    return NULL;
+}
+
+
+//// SELECTION ROUNDS
+
+static void* SORT_FN(select_count_thread)(void* arg) {
+    SORT_FN(SelectThreadParameters)* params = (SORT_FN(SelectThreadParameters)*) arg;
+    size_t below = 0;
+    size_t above = 0;
+    for (size_t i = params->begin; i < params->end; i++) {
+        below += SORT_LESS(params->source[i], params->low);
+        above += SORT_LESS(params->high, params->source[i]);
+    }
+    params->below = below;
+    params->above = above;
+    return NULL;
+}
+
+// Which part of a round element is in: 0 below low, 1 between the pivots, 2 above high. low is never above high, so
+// at most one of the comparisons holds, and the part is computed without a branch.
+static inline int SORT_FN(select_part)(const SORT_FN(SelectThreadParameters)* params, const SORT_TYPE* element) {
+    return 1 - SORT_LESS(*element, params->low) + SORT_LESS(params->high, *element);
+}
+
+// Every element is written to the next free position, which only advances past the elements that are kept, so the
+// copy does not mispredict a branch on every other element of random input. It stops once this thread's share is
+// written: from then on the next free position belongs to the next thread.
+static void* SORT_FN(select_copy_thread)(void* arg) {
+    SORT_FN(SelectThreadParameters)* params = (SORT_FN(SelectThreadParameters)*) arg;
+    SORT_TYPE* destination = params->destination;
+    size_t written = 0;
+    for (size_t i = params->begin; i < params->end && written < params->kept; i++) {
+        destination[written] = params->source[i];
+        written += SORT_FN(select_part)(params, &params->source[i]) == params->keep;
+    }
+    return NULL;
+}
+
+
+//// ENTRY POINTS
+
+static int SORT_FN(partial_sort_with)(const SORT_TYPE* input, SORT_TYPE* output, size_t count, size_t k,
+                                      unsigned int threads, const SortResources* resources) {
+    if (k > count) {
+        k = count;
+    }
+    if (k == 0) {
+        return 0;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > count) {
+        threads = (unsigned int)count;
+    }
+    Arena* arena = resources->arena;
+    SortTrace* trace = resources->trace;
+
+    //// BIG K
+    /// Sorted in full into a scratch buffer, of which the first k elements are kept
+    if (k > count / SELECT_TOP_K_MAX_FRACTION) {
+        SORT_TYPE* sorted = arena_alloc(arena, sizeof(SORT_TYPE) * count);
+        if (sorted == NULL) {
+            fprintf(stderr, "Failed to allocate memory for sorting.\n");
+            return -1;
+        }
+        int status = SORT_FN(parallel_sort_with)(input, sorted, count, threads, resources);
+        if (status == 0) {
+            memcpy(output, sorted, sizeof(SORT_TYPE) * k);
+        }
+        arena_free(arena, sorted);
+        return status;
+    }
+
+    //// ALLOCATION
+    /// A heap and a run per thread, and two buffers of 2k elements that the merge of the runs ping-pongs between
+    SORT_FN(TopKThreadParameters)* params = arena_alloc(arena, sizeof(*params) * threads);
+    SORT_FN(RankedElement)* heaps = arena_alloc(arena, sizeof(*heaps) * k * threads);
+    SORT_TYPE* runs = arena_alloc(arena, sizeof(SORT_TYPE) * k * threads);
+    SORT_TYPE* merged = arena_alloc(arena, sizeof(SORT_TYPE) * 4 * k);
+    if (params == NULL || heaps == NULL || runs == NULL || merged == NULL) {
+        fprintf(stderr, "Failed to allocate memory for sorting.\n");
+        arena_free(arena, params);
+        arena_free(arena, heaps);
+        arena_free(arena, runs);
+        arena_free(arena, merged);
+        return -1;
+    }
+    for (unsigned int t = 0; t < threads; t++) {
+        params[t].source = input;
+        params[t].begin = t * count / threads;
+        params[t].end = (t + 1) * count / threads;
+        params[t].heap = heaps + (size_t)t * k;
+        params[t].heapSize = params[t].end - params[t].begin < k ? params[t].end - params[t].begin : k;
+        params[t].run = runs + (size_t)t * k;
+    }
+    trace_run(trace, "top k", 0, resources->pool, SORT_FN(top_k_thread), params, sizeof(*params), threads);
+
+    //// MERGE THE RUNS
+    /// Run by run, in thread order so equal keys stay in input order, with everything past the first k dropped
+    TraceSpan merging = trace_span_begin(trace);
+    SORT_TYPE* kept = merged;
+    SORT_TYPE* next = merged + 2 * k;
+    size_t keptSize = 0;
+    for (unsigned int t = 0; t < threads; t++) {
+        SORT_FN(merge)(kept, keptSize, params[t].run, params[t].heapSize, next);
+        keptSize = keptSize + params[t].heapSize < k ? keptSize + params[t].heapSize : k;
+        SORT_TYPE* swap = kept;
+        kept = next;
+        next = swap;
+    }
+    memcpy(output, kept, sizeof(SORT_TYPE) * k);
+    trace_span_end(trace, "top k merge", 0, &merging);
+
+    //// CLEAN UP MEMORY
+    arena_free(arena, params);
+    arena_free(arena, heaps);
+    arena_free(arena, runs);
+    arena_free(arena, merged);
+    return 0;
+}
+
+static int SORT_FN(nth_element_with)(const SORT_TYPE* input, size_t count, size_t rank, SORT_TYPE* element,
+                                     unsigned int threads, const SortResources* resources) {
+    if (rank >= count) {
+        fprintf(stderr, "Rank %zu is out of range for %zu elements.\n", rank, count);
+        return -1;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    Arena* arena = resources->arena;
+    SortTrace* trace = resources->trace;
+    SORT_FN(SelectThreadParameters)* params = arena_alloc(arena, sizeof(*params) * threads);
+    if (params == NULL) {
+        fprintf(stderr, "Failed to allocate memory for selecting.\n");
+        return -1;
+    }
+
+    //// ROUNDS
+    /// The elements that are left live in one of two buffers, which are allocated by the first two rounds that keep
+    /// elements, at the size those rounds keep: every later round keeps fewer, into the buffer it is not reading.
+    const SORT_TYPE* live = input;
+    size_t liveCount = count;
+    SORT_TYPE* buffers[2] = {NULL, NULL};
+    unsigned int spread = SELECT_SPREAD;
+    int status = 0;
+    int found = 0;
+    for (unsigned int round = 1; status == 0 && !found && liveCount > SELECT_SERIAL_SIZE; round++) {
+        //// PIVOTS
+        /// Drawn at pseudo-random positions, as in the sample sort. The sample at the rank's relative position is
+        /// about where the element is, and the samples "spread" below and above it bracket it.
+        SORT_TYPE samples[2 * SELECT_SAMPLES];
+        uint64_t state = liveCount;
+        for (size_t s = 0; s < SELECT_SAMPLES; s++) {
+            // splitmix64
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            samples[s] = live[(z ^ (z >> 31)) % liveCount];
+        }
+        SORT_FN(merge_sort_into)(samples, samples, samples + SELECT_SAMPLES, SELECT_SAMPLES);
+        size_t middle = rank * SELECT_SAMPLES / liveCount;
+        SORT_TYPE low = samples[middle >= spread ? middle - spread : 0];
+        SORT_TYPE high = samples[middle + spread < SELECT_SAMPLES ? middle + spread : SELECT_SAMPLES - 1];
+
+        //// COUNT
+        unsigned int roundThreads = liveCount / SELECT_SERIAL_SIZE < threads ? (unsigned int)(liveCount / SELECT_SERIAL_SIZE) : threads;
+        for (unsigned int t = 0; t < roundThreads; t++) {
+            params[t].source = live;
+            params[t].begin = t * liveCount / roundThreads;
+            params[t].end = (t + 1) * liveCount / roundThreads;
+            params[t].low = low;
+            params[t].high = high;
+        }
+        trace_run(trace, "select count", round, resources->pool, SORT_FN(select_count_thread), params,
+                  sizeof(*params), roundThreads);
+        size_t below = 0;
+        size_t above = 0;
+        for (unsigned int t = 0; t < roundThreads; t++) {
+            below += params[t].below;
+            above += params[t].above;
+        }
+        size_t between = liveCount - below - above;
+
+        //// WHICH PART HOLDS THE RANK
+        int keep = rank < below ? 0 : rank < below + between ? 1 : 2;
+        size_t kept = keep == 0 ? below : keep == 1 ? between : above;
+        if (keep == 1 && !SORT_LESS(low, high)) {
+            // The pivots have the same key, and so has every element between them: the element is the one at the
+            // rank's position among them, in input order, which one of the slices holds
+            size_t position = rank - below;
+            unsigned int t = 0;
+            while (position >= params[t].end - params[t].begin - params[t].below - params[t].above) {
+                position -= params[t].end - params[t].begin - params[t].below - params[t].above;
+                t++;
+            }
+            for (size_t i = params[t].begin; !found; i++) {
+                if (SORT_FN(select_part)(&params[t], &live[i]) == 1 && position-- == 0) {
+                    *element = live[i];
+                    found = 1;
+                }
+            }
+            break;
+        }
+        if (kept == liveCount) {
+            // Nothing to drop with these pivots, as with only a few distinct keys: the next round uses a single pivot,
+            // which always drops the elements below and above it, or finds the element among the equal ones
+            spread = 0;
+            continue;
+        }
+        spread = SELECT_SPREAD;
+
+        //// COPY THE PART TO KEEP
+        SORT_TYPE** buffer = live == buffers[0] ? &buffers[1] : &buffers[0];
+        if (*buffer == NULL) {
+            *buffer = arena_alloc(arena, sizeof(SORT_TYPE) * kept);
+            if (*buffer == NULL) {
+                fprintf(stderr, "Failed to allocate memory for selecting.\n");
+                status = -1;
+                break;
+            }
+        }
+        size_t position = 0;
+        for (unsigned int t = 0; t < roundThreads; t++) {
+            size_t inSlice = keep == 0 ? params[t].below : keep == 2 ? params[t].above
+                             : params[t].end - params[t].begin - params[t].below - params[t].above;
+            params[t].keep = keep;
+            params[t].destination = *buffer + position;
+            params[t].kept = inSlice;
+            position += inSlice;
+        }
+        trace_run(trace, "select copy", round, resources->pool, SORT_FN(select_copy_thread), params,
+                  sizeof(*params), roundThreads);
+        rank -= keep == 0 ? 0 : keep == 1 ? below : below + between;
+        live = *buffer;
+        liveCount = kept;
+    }
+
+    //// SORT WHAT IS LEFT
+    /// A stable sort of the few elements left, so equal keys are in input order like in the stable sort
+    if (status == 0 && !found) {
+        TraceSpan sorting = trace_span_begin(trace);
+        SORT_TYPE* left = arena_alloc(arena, sizeof(SORT_TYPE) * 2 * liveCount);
+        if (left == NULL) {
+            fprintf(stderr, "Failed to allocate memory for selecting.\n");
+            status = -1;
+        } else {
+            memcpy(left, live, sizeof(SORT_TYPE) * liveCount);
+            SORT_FN(merge_sort_into)(left, left + liveCount, left, liveCount);
+            *element = left[liveCount + rank];
+            arena_free(arena, left);
+        }
+        trace_span_end(trace, "select sort", 0, &sorting);
+    }
+
+    //// CLEAN UP MEMORY
+    arena_free(arena, params);
+    arena_free(arena, buffers[0]);
+    arena_free(arena, buffers[1]);
+    return status;
+}
+
+/// See sort.h for the contract.
+int SORT_FN(partial_sort)(const SORT_TYPE* input, SORT_TYPE* output, size_t count, size_t k, unsigned int threads) {
+    SortResources resources = {shared_pool(), NULL, NULL};
+    return SORT_FN(partial_sort_with)(input, output, count, k, threads, &resources);
+}
+
+int SORT_FN(nth_element)(const SORT_TYPE* input, size_t count, size_t rank, SORT_TYPE* element, unsigned int threads) {
+    SortResources resources = {shared_pool(), NULL, NULL};
+    return SORT_FN(nth_element_with)(input, count, rank, element, threads, &resources);
+}
+
+// For the element type descriptor
+static int SORT_FN(partial_sort_with_untyped)(const void* input, void* output, size_t count, size_t k,
+                                              unsigned int threads, const SortResources* resources) {
+    return SORT_FN(partial_sort_with)(input, output, count, k, threads, resources);
+}
+
+static int SORT_FN(nth_element_with_untyped)(const void* input, size_t count, size_t rank, void* element,
+                                             unsigned int threads, const SortResources* resources) {
+    return SORT_FN(nth_element_with)(input, count, rank, element, threads, resources);
+}
+
+
+#undef SELECT_TOP_K_MAX_FRACTION
+#undef SELECT_SAMPLES
+#undef SELECT_SPREAD
+#undef SELECT_SERIAL_SIZE
@@ -0,0 +1,406 @@
+//// VECTORIZED KERNELS FOR INT32 KEYS
+/// See simd.h. Every kernel is made of the same two building blocks:
+///     - A sorting network layer: each lane is compared with a partner lane and keeps either the smaller or the
+///       larger of the two. Bitonic sort needs log2(n) * (log2(n) + 1) / 2 layers to sort one vector of n lanes.
+///     - A bitonic merge of two sorted vectors: one of them is reversed, so together they form a bitonic sequence,
+///       and one min/max step followed by log2(n) layers leaves the smaller half in one vector, the larger half
+///       in the other, both sorted.
+/// The x86 kernels are compiled with target attributes, so the rest of the program still runs on CPUs without them.
+
+#include "simd.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define SIMD_NEON 1
+#endif
+
+
+//// SORTING NETWORKS
+/// The layers of a bitonic sorting network for one vector, generated once by build_network.
+
+#define SIMD_MAX_LANES 16
+#define SIMD_MAX_LAYERS 10
+
+typedef struct {
+    // Lane i is compared with lane partner[i]
+    int32_t partner[SIMD_MAX_LANES];
+    // -1 where the lane keeps the larger of the two elements, 0 where it keeps the smaller one
+    int32_t takeMax[SIMD_MAX_LANES];
+    // The same as takeMax, one bit per lane
+    uint32_t takeMaxBits;
+} NetworkLayer;
+
+static NetworkLayer network8[6];
+static NetworkLayer network16[10];
+
+// Fills layers with the bitonic sorting network for a vector of "lanes" lanes (a power of two).
+// The last log2(lanes) layers sort a bitonic vector, which is all the merge of two sorted vectors needs.
+static void build_network(NetworkLayer* layers, unsigned int lanes) {
+    unsigned int layer = 0;
+    for (unsigned int block = 2; block <= lanes; block *= 2) {
+        for (unsigned int distance = block / 2; distance >= 1; distance /= 2) {
+            layers[layer].takeMaxBits = 0;
+            for (unsigned int i = 0; i < lanes; i++) {
+                unsigned int partner = i ^ distance;
+                // Blocks alternate between ascending and descending order, so each pair of blocks is bitonic
+                int ascending = (i & block) == 0;
+                int takeMax = (i < partner) != ascending;
+                layers[layer].partner[i] = (int32_t)partner;
+                layers[layer].takeMax[i] = takeMax ? -1 : 0;
+                layers[layer].takeMaxBits |= (uint32_t)takeMax << i;
+            }
+            layer++;
+        }
+    }
+}
+
+
+//// SCALAR TAILS
+/// The vector loops stop when a run has less than one vector of elements left. The larger half still held in a
+/// register may interleave with both tails, so the three of them are merged with scalar code.
+
+static void scalar_merge(const int32_t* left, size_t leftSize, const int32_t* right, size_t rightSize, int32_t* output) {
+    size_t i = 0, j = 0, k = 0;
+    while (i < leftSize && j < rightSize) {
+        output[k++] = right[j] < left[i] ? right[j++] : left[i++];
+    }
+    memcpy(output + k, left + i, (leftSize - i) * sizeof(int32_t));
+    k += leftSize - i;
+    memcpy(output + k, right + j, (rightSize - j) * sizeof(int32_t));
+}
+
+static void scalar_merge3(const int32_t* a, size_t aSize, const int32_t* b, size_t bSize,
+                          const int32_t* c, size_t cSize, int32_t* output) {
+    while (aSize > 0 && bSize > 0 && cSize > 0) {
+        if (*a <= *b && *a <= *c) {
+            *output++ = *a++;
+            aSize--;
+        } else if (*b <= *c) {
+            *output++ = *b++;
+            bSize--;
+        } else {
+            *output++ = *c++;
+            cSize--;
+        }
+    }
+    if (aSize == 0) {
+        scalar_merge(b, bSize, c, cSize, output);
+    } else if (bSize == 0) {
+        scalar_merge(a, aSize, c, cSize, output);
+    } else {
+        scalar_merge(a, aSize, b, bSize, output);
+    }
+}
+
+
+//// MERGE LOOP
+/// Shared by all kernels, for a vector type V of LANES lanes and a MERGE_VECTORS(low, high) step that leaves the
+/// smaller half of both vectors in low and the larger half in high.
+/// The first vector of each run is merged, and the smaller half stored. From then on, the next vector is loaded
+/// from the run whose next element is smaller and merged with the larger half left over from the step before.
+/// Every element still in a run is at least as big as the stored ones: it is either behind the vector just loaded
+/// in its own run, or bigger than the head of that vector and, with it, than everything loaded before.
+#define SIMD_MERGE_LOOP(V, LANES, LOAD, STORE, MERGE_VECTORS)                                   \
+    do {                                                                                        \
+        V low = LOAD(left);                                                                     \
+        V high = LOAD(right);                                                                   \
+        size_t i = (LANES), j = (LANES);                                                        \
+        MERGE_VECTORS(low, high);                                                               \
+        STORE(output, low);                                                                     \
+        output += (LANES);                                                                      \
+        while (i + (LANES) <= leftSize && j + (LANES) <= rightSize) {                           \
+            if (left[i] <= right[j]) {                                                          \
+                low = LOAD(left + i);                                                           \
+                i += (LANES);                                                                   \
+            } else {                                                                            \
+                low = LOAD(right + j);                                                          \
+                j += (LANES);                                                                   \
+            }                                                                                   \
+            MERGE_VECTORS(low, high);                                                           \
+            STORE(output, low);                                                                 \
+            output += (LANES);                                                                  \
+        }                                                                                       \
+        int32_t rest[(LANES)];                                                                  \
+        STORE(rest, high);                                                                      \
+        scalar_merge3(rest, (LANES), left + i, leftSize - i, right + j, rightSize - j, output); \
+    } while (0)
+
+
+#ifdef SIMD_X86
+//// AVX2 KERNELS (8 LANES)
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+typedef struct {
+    __m256i partner;
+    __m256i takeMax;
+} Avx2Layer;
+
+static inline AVX2_TARGET void avx2_load_layers(Avx2Layer* layers, const NetworkLayer* network, unsigned int count) {
+    for (unsigned int l = 0; l < count; l++) {
+        layers[l].partner = _mm256_loadu_si256((const __m256i*)network[l].partner);
+        layers[l].takeMax = _mm256_loadu_si256((const __m256i*)network[l].takeMax);
+    }
+}
+
+static inline AVX2_TARGET __m256i avx2_layer(__m256i v, const Avx2Layer* layer) {
+    __m256i other = _mm256_permutevar8x32_epi32(v, layer->partner);
+    return _mm256_blendv_epi8(_mm256_min_epi32(v, other), _mm256_max_epi32(v, other), layer->takeMax);
+}
+
+// Merges two sorted vectors; clean holds the last three layers of network8
+static inline AVX2_TARGET void avx2_merge_vectors(__m256i* low, __m256i* high, const Avx2Layer* clean) {
+    __m256i reversed = _mm256_permutevar8x32_epi32(*high, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    __m256i a = _mm256_min_epi32(*low, reversed);
+    __m256i b = _mm256_max_epi32(*low, reversed);
+    for (unsigned int l = 0; l < 3; l++) {
+        a = avx2_layer(a, &clean[l]);
+        b = avx2_layer(b, &clean[l]);
+    }
+    *low = a;
+    *high = b;
+}
+
+#define AVX2_LOAD(p) _mm256_loadu_si256((const __m256i*)(p))
+#define AVX2_STORE(p, v) _mm256_storeu_si256((__m256i*)(p), (v))
+#define AVX2_MERGE_VECTORS(low, high) avx2_merge_vectors(&(low), &(high), clean)
+
+static AVX2_TARGET void avx2_merge(const int32_t* left, size_t leftSize, const int32_t* right, size_t rightSize, int32_t* output) {
+    Avx2Layer clean[3];
+    avx2_load_layers(clean, network8 + 3, 3);
+    SIMD_MERGE_LOOP(__m256i, 8, AVX2_LOAD, AVX2_STORE, AVX2_MERGE_VECTORS);
+}
+
+// Sorts up to 16 elements in two registers. Missing elements are padded with INT32_MAX, which sorts to the end.
+static AVX2_TARGET void avx2_sort_leaf(const int32_t* input, int32_t* output, size_t size) {
+    Avx2Layer layers[6];
+    avx2_load_layers(layers, network8, 6);
+
+    __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i count = _mm256_set1_epi32((int32_t)size);
+    __m256i mask0 = _mm256_cmpgt_epi32(count, lane);
+    __m256i mask1 = _mm256_cmpgt_epi32(count, _mm256_add_epi32(lane, _mm256_set1_epi32(8)));
+    __m256i padding = _mm256_set1_epi32(INT32_MAX);
+    __m256i v0 = _mm256_blendv_epi8(padding, _mm256_maskload_epi32(input, mask0), mask0);
+    __m256i v1 = _mm256_blendv_epi8(padding, _mm256_maskload_epi32(input + 8, mask1), mask1);
+
+    for (unsigned int l = 0; l < 6; l++) {
+        v0 = avx2_layer(v0, &layers[l]);
+        v1 = avx2_layer(v1, &layers[l]);
+    }
+    avx2_merge_vectors(&v0, &v1, layers + 3);
+
+    _mm256_maskstore_epi32(output, mask0, v0);
+    _mm256_maskstore_epi32(output + 8, mask1, v1);
+}
+
+
+//// AVX-512 KERNELS (16 LANES)
+
+#define AVX512_TARGET __attribute__((target("avx512f")))
+
+typedef struct {
+    __m512i partner;
+    __mmask16 takeMax;
+} Avx512Layer;
+
+static inline AVX512_TARGET void avx512_load_layers(Avx512Layer* layers, const NetworkLayer* network, unsigned int count) {
+    for (unsigned int l = 0; l < count; l++) {
+        layers[l].partner = _mm512_loadu_si512(network[l].partner);
+        layers[l].takeMax = (__mmask16)network[l].takeMaxBits;
+    }
+}
+
+static inline AVX512_TARGET __m512i avx512_layer(__m512i v, const Avx512Layer* layer) {
+    __m512i other = _mm512_permutexvar_epi32(layer->partner, v);
+    return _mm512_mask_blend_epi32(layer->takeMax, _mm512_min_epi32(v, other), _mm512_max_epi32(v, other));
+}
+
+// Merges two sorted vectors; clean holds the last four layers of network16
+static inline AVX512_TARGET void avx512_merge_vectors(__m512i* low, __m512i* high, const Avx512Layer* clean) {
+    __m512i reverse = _mm512_setr_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    __m512i reversed = _mm512_permutexvar_epi32(reverse, *high);
+    __m512i a = _mm512_min_epi32(*low, reversed);
+    __m512i b = _mm512_max_epi32(*low, reversed);
+    for (unsigned int l = 0; l < 4; l++) {
+        a = avx512_layer(a, &clean[l]);
+        b = avx512_layer(b, &clean[l]);
+    }
+    *low = a;
+    *high = b;
+}
+
+#define AVX512_LOAD(p) _mm512_loadu_si512(p)
+#define AVX512_STORE(p, v) _mm512_storeu_si512((p), (v))
+#define AVX512_MERGE_VECTORS(low, high) avx512_merge_vectors(&(low), &(high), clean)
+
+static AVX512_TARGET void avx512_merge(const int32_t* left, size_t leftSize, const int32_t* right, size_t rightSize, int32_t* output) {
+    Avx512Layer clean[4];
+    avx512_load_layers(clean, network16 + 6, 4);
+    SIMD_MERGE_LOOP(__m512i, 16, AVX512_LOAD, AVX512_STORE, AVX512_MERGE_VECTORS);
+}
+
+// Sorts up to 32 elements in two registers, padded with INT32_MAX like avx2_sort_leaf
+static AVX512_TARGET void avx512_sort_leaf(const int32_t* input, int32_t* output, size_t size) {
+    Avx512Layer layers[10];
+    avx512_load_layers(layers, network16, 10);
+
+    __mmask16 mask0 = size >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << size) - 1);
+    __mmask16 mask1 = size >= 32 ? (__mmask16)0xFFFF : size <= 16 ? (__mmask16)0 : (__mmask16)((1u << (size - 16)) - 1);
+    __m512i padding = _mm512_set1_epi32(INT32_MAX);
+    __m512i v0 = _mm512_mask_loadu_epi32(padding, mask0, input);
+    __m512i v1 = _mm512_mask_loadu_epi32(padding, mask1, input + 16);
+
+    for (unsigned int l = 0; l < 10; l++) {
+        v0 = avx512_layer(v0, &layers[l]);
+        v1 = avx512_layer(v1, &layers[l]);
+    }
+    avx512_merge_vectors(&v0, &v1, layers + 6);
+
+    _mm512_mask_storeu_epi32(output, mask0, v0);
+    _mm512_mask_storeu_epi32(output + 16, mask1, v1);
+}
+#endif
+
+
+#ifdef SIMD_NEON
+//// NEON KERNELS (4 LANES)
+/// Written with the compiler's generic vector extensions, which lower to NEON min/max and permutes on AArch64.
+/// The network is small enough to spell out, since the shuffles need constant lane numbers.
+
+typedef int32_t V4 __attribute__((vector_size(16)));
+
+static inline V4 v4_min(V4 a, V4 b) {
+    V4 less = a < b;
+    return (a & less) | (b & ~less);
+}
+
+static inline V4 v4_max(V4 a, V4 b) {
+    V4 less = a < b;
+    return (b & less) | (a & ~less);
+}
+
+// One network layer: lanes whose bit is set in takeMax keep the larger element
+#define V4_LAYER(v, p0, p1, p2, p3, m0, m1, m2, m3)                           \
+    do {                                                                      \
+        V4 other = __builtin_shufflevector((v), (v), p0, p1, p2, p3);         \
+        V4 takeMax = {-(m0), -(m1), -(m2), -(m3)};                            \
+        (v) = (v4_max((v), other) & takeMax) | (v4_min((v), other) & ~takeMax); \
+    } while (0)
+
+static inline V4 v4_load(const int32_t* p) {
+    V4 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void v4_store(int32_t* p, V4 v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+// Merges two sorted vectors
+static inline void v4_merge_vectors(V4* low, V4* high) {
+    V4 reversed = __builtin_shufflevector(*high, *high, 3, 2, 1, 0);
+    V4 a = v4_min(*low, reversed);
+    V4 b = v4_max(*low, reversed);
+    V4_LAYER(a, 2, 3, 0, 1, 0, 0, 1, 1);
+    V4_LAYER(a, 1, 0, 3, 2, 0, 1, 0, 1);
+    V4_LAYER(b, 2, 3, 0, 1, 0, 0, 1, 1);
+    V4_LAYER(b, 1, 0, 3, 2, 0, 1, 0, 1);
+    *low = a;
+    *high = b;
+}
+
+#define V4_MERGE_VECTORS(low, high) v4_merge_vectors(&(low), &(high))
+
+static void neon_merge(const int32_t* left, size_t leftSize, const int32_t* right, size_t rightSize, int32_t* output) {
+    SIMD_MERGE_LOOP(V4, 4, v4_load, v4_store, V4_MERGE_VECTORS);
+}
+
+// Sorts up to 8 elements in two registers, padded with INT32_MAX
+static void neon_sort_leaf(const int32_t* input, int32_t* output, size_t size) {
+    int32_t buffer[8] = {INT32_MAX, INT32_MAX, INT32_MAX, INT32_MAX, INT32_MAX, INT32_MAX, INT32_MAX, INT32_MAX};
+    memcpy(buffer, input, size * sizeof(int32_t));
+    V4 v[2] = {v4_load(buffer), v4_load(buffer + 4)};
+    for (unsigned int r = 0; r < 2; r++) {
+        V4_LAYER(v[r], 1, 0, 3, 2, 0, 1, 1, 0);
+        V4_LAYER(v[r], 2, 3, 0, 1, 0, 0, 1, 1);
+        V4_LAYER(v[r], 1, 0, 3, 2, 0, 1, 0, 1);
+    }
+    v4_merge_vectors(&v[0], &v[1]);
+    v4_store(buffer, v[0]);
+    v4_store(buffer + 4, v[1]);
+    memcpy(output, buffer, size * sizeof(int32_t));
+}
+#endif
+
+
+//// DISPATCH
+
+static const SimdKernels scalarKernels = {"scalar", 1, NULL, NULL, 0};
+#ifdef SIMD_X86
+static const SimdKernels avx2Kernels = {"avx2", 8, avx2_merge, avx2_sort_leaf, 16};
+static const SimdKernels avx512Kernels = {"avx512", 16, avx512_merge, avx512_sort_leaf, 32};
+#endif
+#ifdef SIMD_NEON
+static const SimdKernels neonKernels = {"neon", 4, neon_merge, neon_sort_leaf, 8};
+#endif
+
+static const SimdKernels* selected = &scalarKernels;
+static pthread_once_t selectOnce = PTHREAD_ONCE_INIT;
+
+// The best kernels this CPU can run
+static const SimdKernels* best_kernels(void) {
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return &avx512Kernels;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return &avx2Kernels;
+    }
+#endif
+#ifdef SIMD_NEON
+    return &neonKernels;
+#endif
+    return &scalarKernels;
+}
+
+static void initialize(void) {
+    build_network(network8, 8);
+    build_network(network16, 16);
+    selected = best_kernels();
+}
+
+const SimdKernels* simd_kernels(void) {
+    pthread_once(&selectOnce, initialize);
+    return selected;
+}
+
+int select_simd_kernels(const char* name) {
+    pthread_once(&selectOnce, initialize);
+    const SimdKernels* best = best_kernels();
+    const SimdKernels* wanted = NULL;
+    if (strcmp(name, "auto") == 0 || strcmp(name, best->name) == 0) {
+        wanted = best;
+    } else if (strcmp(name, "scalar") == 0) {
+        wanted = &scalarKernels;
+#ifdef SIMD_X86
+    } else if (strcmp(name, "avx2") == 0 && best == &avx512Kernels) {
+        // AVX-512 CPUs run the AVX2 kernels too
+        wanted = &avx2Kernels;
+#endif
+    }
+    if (wanted == NULL) {
+        return -1;
+    }
+    selected = wanted;
+    return 0;
+}
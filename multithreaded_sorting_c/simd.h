@@ -0,0 +1,34 @@
+//// VECTORIZED KERNELS FOR INT32 KEYS
+/// Branch-free replacements for the scalar merge and the insertion-sorted leaves of sort_impl.h, used by the
+/// int32 instantiation of the engine. Both are built from bitonic networks of min/max instructions, so their
+/// speed does not depend on how well the branch predictor guesses the order of the keys.
+///
+/// The kernels are chosen once at run time from what the CPU supports: AVX-512 (16 lanes), AVX2 (8 lanes)
+/// or NEON (4 lanes). Without any of them, or with "scalar" selected, the engine keeps its scalar code.
+
+#ifndef MULTITHREADED_SORTING_SIMD_H
+#define MULTITHREADED_SORTING_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    // "avx512", "avx2", "neon" or "scalar"
+    const char* name;
+    // Number of int32 lanes in one vector register. merge needs at least this many elements in both runs.
+    size_t lanes;
+    // Merges two sorted runs into output, which must not overlap them. NULL for the scalar kernels.
+    void (*merge)(const int32_t* left, size_t leftSize, const int32_t* right, size_t rightSize, int32_t* output);
+    // Sorts size (at most leafSize) elements of input into output entirely in registers. NULL for the scalar kernels.
+    void (*sort_leaf)(const int32_t* input, int32_t* output, size_t size);
+    size_t leafSize;
+} SimdKernels;
+
+// The kernels in use. The first call picks the best kernels the CPU supports, unless select_simd_kernels chose others.
+const SimdKernels* simd_kernels(void);
+
+// Selects kernels by name, or "auto" for the best the CPU supports. Returns 0, or -1 if this CPU or build
+// can not run them. Not thread-safe: call it before sorting starts.
+int select_simd_kernels(const char* name);
+
+#endif //MULTITHREADED_SORTING_SIMD_H
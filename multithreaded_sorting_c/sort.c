@@ -0,0 +1,511 @@
+//// PARALLEL MERGE SORT
+/// Instantiates the sorting engine in sort_impl.h once per supported element type.
+
+#include "sort.h"
+#include "arena.h"
+#include "pool.h"
+#include "trace.h"
+#include "simd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Used by merge_sort_into in sort_impl.h; see set_insertion_sort_threshold
+static size_t insertionSortThreshold = 24;
+
+void set_insertion_sort_threshold(size_t elements) {
+    insertionSortThreshold = elements > 0 ? elements : 1;
+}
+
+size_t get_insertion_sort_threshold(void) {
+    return insertionSortThreshold;
+}
+
+// Used by parallel_sort in sort_impl.h; see set_sort_algorithm
+static SortAlgorithm sortAlgorithm = SORT_ALGORITHM_AUTO;
+
+void set_sort_algorithm(SortAlgorithm algorithm) {
+    sortAlgorithm = algorithm;
+}
+
+SortAlgorithm get_sort_algorithm(void) {
+    return sortAlgorithm;
+}
+
+// Cache line size that the slices of parallel phases are lined up with
+#define SORT_CACHE_LINE 64
+
+// Where slice "part" of an array of count elements of elementSize bytes starts, when it is cut into "parts" slices for
+// as many threads; part == parts gives count. The bounds are rounded down to whole cache lines of arrays that start on
+// one, as arena and huge_alloc memory does (see arena.h), so two threads that write neighbouring slices never write
+// to the same line. Arrays with less than a line per slice are cut exactly, into slices that differ by at most one.
+static size_t slice_begin(size_t part, size_t count, size_t parts, size_t elementSize) {
+    size_t bound = part * count / parts;
+    size_t line = SORT_CACHE_LINE % elementSize == 0 ? SORT_CACHE_LINE / elementSize : 1;
+    if (part == parts || count / parts < line) {
+        return bound;
+    }
+    return bound / line * line;
+}
+
+// Used by narrow_sort_with in narrow_impl.h; see set_key_narrowing
+static int keyNarrowing = 1;
+
+void set_key_narrowing(int enabled) {
+    keyNarrowing = enabled;
+}
+
+int get_key_narrowing(void) {
+    return keyNarrowing;
+}
+
+// Used by narrow_sort_with in narrow_impl.h: below this many keys, the extra passes over the keys cost more than
+// the narrower sort saves
+#define NARROW_KEYS_MIN_COUNT 65536
+
+// Used by merge_sort_forked in sort_impl.h: partitions bigger than this are sorted as two halves, one of which
+// other sorting threads can steal. Smaller ones are not worth the bookkeeping of a task.
+#define SORT_FORK_MIN_SIZE 8192
+
+// Used by sort_natural_runs in sort_impl.h: partitions whose ascending or descending runs are at least this long on
+// average are sorted by merging those runs. Random input has runs of about 2 elements, and gives up after a short scan.
+#define NATURAL_RUN_MIN_AVERAGE 32
+
+// Used by merge in sort_impl.h: once a run gives this many elements in a row (a whole block), the merge gallops
+#define MERGE_GALLOP_AFTER 7
+
+// The engines that argsort_impl.h sorts (key, index) pairs with, for every element type
+static int parallel_sort_with_u64(const uint64_t* input, uint64_t* output, size_t count, unsigned int threads,
+                                  const SortResources* resources);
+static int parallel_sort_with_kv_u64(const KeyValueU64* input, KeyValueU64* output, size_t count, unsigned int threads,
+                                     const SortResources* resources);
+
+// Sorts the keys of the wider integer types that narrow_impl.h narrows to 16 bits. The 32-bit ones are sorted as i32.
+#define SORT_TYPE uint16_t
+#define SORT_SUFFIX u16
+#define SORT_RADIX_KEY uint16_t
+#define SORT_RADIX_SIGNED 0
+#define SORT_PRIVATE
+#include "sort_impl.h"
+
+#define SORT_TYPE int32_t
+#define SORT_SUFFIX i32
+#define SORT_RADIX_KEY uint32_t
+#define SORT_RADIX_SIGNED 1
+#define SORT_VECTOR_KERNELS simd_kernels()
+#define SORT_NARROW
+#include "sort_impl.h"
+
+#define SORT_TYPE int64_t
+#define SORT_SUFFIX i64
+#define SORT_RADIX_KEY uint64_t
+#define SORT_RADIX_SIGNED 1
+#define SORT_NARROW
+#include "sort_impl.h"
+
+#define SORT_TYPE uint32_t
+#define SORT_SUFFIX u32
+#define SORT_RADIX_KEY uint32_t
+#define SORT_RADIX_SIGNED 0
+#define SORT_NARROW
+#include "sort_impl.h"
+
+#define SORT_TYPE uint64_t
+#define SORT_SUFFIX u64
+#define SORT_RADIX_KEY uint64_t
+#define SORT_RADIX_SIGNED 0
+#define SORT_NARROW
+#include "sort_impl.h"
+
+// NaN compares false with everything, which would break the merge invariants. Every NaN is treated as equal
+// to the others and bigger than any number, so NaNs end up at the end of the output.
+#define SORT_FLOAT_LESS(a, b) ((a) < (b) || ((b) != (b) && (a) == (a)))
+
+// The order keys of floating point numbers (see argsort_impl.h), which order them like SORT_FLOAT_LESS: -0 is +0, every
+// NaN is the same value above infinity, and the bits of the others are flipped so that unsigned order is numeric order
+static inline uint32_t float_order_key(float value) {
+    uint32_t bits;
+    value = value == 0.0f ? 0.0f : value;
+    memcpy(&bits, &value, sizeof(bits));
+    return value != value ? UINT32_MAX : bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+
+static inline uint64_t double_order_key(double value) {
+    uint64_t bits;
+    value = value == 0.0 ? 0.0 : value;
+    memcpy(&bits, &value, sizeof(bits));
+    return value != value ? UINT64_MAX : bits & 0x8000000000000000u ? ~bits : bits | 0x8000000000000000u;
+}
+
+#define SORT_TYPE float
+#define SORT_SUFFIX f32
+#define SORT_LESS SORT_FLOAT_LESS
+#define SORT_ORDER_KEY(a) float_order_key(a)
+#define SORT_ORDER_KEY_TYPE uint32_t
+#include "sort_impl.h"
+
+#define SORT_TYPE double
+#define SORT_SUFFIX f64
+#define SORT_LESS SORT_FLOAT_LESS
+#define SORT_ORDER_KEY(a) double_order_key(a)
+#define SORT_ORDER_KEY_TYPE uint64_t
+#include "sort_impl.h"
+
+// Key-value pairs compare and radix sort their key only; the value just travels along with it
+#define SORT_TYPE KeyValueI64
+#define SORT_SUFFIX kv_i64
+#define SORT_KEY(a) ((a).key)
+#define SORT_RADIX_KEY uint64_t
+#define SORT_RADIX_SIGNED 1
+#include "sort_impl.h"
+
+#define SORT_TYPE KeyValueU64
+#define SORT_SUFFIX kv_u64
+#define SORT_KEY(a) ((a).key)
+#define SORT_RADIX_KEY uint64_t
+#define SORT_RADIX_SIGNED 0
+#include "sort_impl.h"
+
+const SortType* find_sort_type(const char* name) {
+    static const SortType* const types[] = {
+        &sort_type_i32, &sort_type_i64, &sort_type_u32, &sort_type_u64, &sort_type_f32, &sort_type_f64,
+        &sort_type_kv_i64, &sort_type_kv_u64,
+    };
+    for (size_t i = 0; i < sizeof(types) / sizeof(*types); i++) {
+        if (strcmp(types[i]->name, name) == 0) {
+            return types[i];
+        }
+    }
+    return NULL;
+}
+
+
+//// GENERIC ELEMENTS
+/// parallel_sort_generic sorts one entry per element with the engine, and then copies the elements to output
+/// in the order of the sorted entries. Every entry points to the comparator, so the engine needs no global state
+/// and sorts with different comparators can run at the same time.
+
+typedef struct {
+    int (*compare)(const void* a, const void* b, void* context);
+    void* context;
+} GenericOrder;
+
+typedef struct {
+    const void* element;
+    const GenericOrder* order;
+} GenericEntry;
+
+#define SORT_TYPE GenericEntry
+#define SORT_SUFFIX entry
+#define SORT_LESS(a, b) ((a).order->compare((a).element, (b).element, (a).order->context) < 0)
+#define SORT_PRIVATE
+#include "sort_impl.h"
+
+int parallel_sort_generic(const void* input, void* output, size_t count, size_t elementSize,
+                          int (*compare)(const void* a, const void* b, void* context), void* context,
+                          unsigned int threads) {
+    if (count == 0) {
+        return 0;
+    }
+    GenericOrder order = {compare, context};
+    GenericEntry* entries = malloc(sizeof(GenericEntry) * count);
+    GenericEntry* sorted = malloc(sizeof(GenericEntry) * count);
+    if (entries == NULL || sorted == NULL) {
+        fprintf(stderr, "Failed to allocate memory for sorting.\n");
+        free(entries);
+        free(sorted);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        entries[i].element = (const char*)input + i * elementSize;
+        entries[i].order = &order;
+    }
+    SortResources resources = {shared_pool(), NULL, NULL};
+    int status = parallel_sort_with_entry(entries, sorted, count, threads, &resources);
+    if (status == 0) {
+        for (size_t i = 0; i < count; i++) {
+            memcpy((char*)output + i * elementSize, sorted[i].element, elementSize);
+        }
+    }
+
+    free(entries);
+    free(sorted);
+    return status;
+}
+
+
+//// ROWS OF COLUMNS
+/// sort_rows sorts one entry per row with the engine: the first 8 bytes of the row's normalized key, the row's index
+/// and the columns. The normalized key is what the columns of the row would be as bytes that compare like the row:
+/// every number as its big-endian order key, and every string as its own bytes, all of them inverted for descending
+/// columns. Whenever two prefixes differ, they order their rows without touching the columns, so a merge of string
+/// rows mostly reads its two runs in sequence instead of chasing a pointer to the strings at every comparison. Only
+/// rows with equal prefixes compare their columns, and not even those when the prefix holds the whole key.
+
+typedef struct {
+    const SortColumn* columns;
+    size_t columnCount;
+    // Whether the prefix holds the whole normalized key, so that rows with equal prefixes are equal
+    int exact;
+} RowOrder;
+
+typedef struct {
+    uint64_t prefix;
+    uint64_t row;
+    const RowOrder* order;
+} RowEntry;
+
+// For each thread of the pack and unpack phases
+typedef struct {
+    const RowOrder* order;
+    // The slice [begin, end) of the rows that this thread works on
+    size_t begin;
+    size_t end;
+    RowEntry* entries;
+    // uint32_t or uint64_t indices, by indexSize
+    void* indices;
+    size_t indexSize;
+} RowThreadParameters;
+
+// Bits of the normalized key of a numeric column
+static unsigned int column_key_bits(SortColumnType type) {
+    return type == SORT_COLUMN_I32 || type == SORT_COLUMN_U32 || type == SORT_COLUMN_F32 ? 32 : 64;
+}
+
+// The normalized key of a numeric column in the given row, in its low column_key_bits bits
+static uint64_t column_key(const SortColumn* column, uint64_t row) {
+    const char* value = (const char*)column->values + row * column->stride;
+    uint64_t key;
+    switch (column->type) {
+        case SORT_COLUMN_I32: {
+            int32_t v;
+            memcpy(&v, value, sizeof(v));
+            key = (uint32_t)v ^ 0x80000000u;
+            break;
+        }
+        case SORT_COLUMN_U32: {
+            uint32_t v;
+            memcpy(&v, value, sizeof(v));
+            key = v;
+            break;
+        }
+        case SORT_COLUMN_F32: {
+            float v;
+            memcpy(&v, value, sizeof(v));
+            key = float_order_key(v);
+            break;
+        }
+        case SORT_COLUMN_I64: {
+            int64_t v;
+            memcpy(&v, value, sizeof(v));
+            key = (uint64_t)v ^ 0x8000000000000000u;
+            break;
+        }
+        case SORT_COLUMN_F64: {
+            double v;
+            memcpy(&v, value, sizeof(v));
+            key = double_order_key(v);
+            break;
+        }
+        default: {
+            uint64_t v;
+            memcpy(&v, value, sizeof(v));
+            key = v;
+            break;
+        }
+    }
+    if (column->descending) {
+        key = ~key & (column_key_bits(column->type) == 32 ? UINT32_MAX : UINT64_MAX);
+    }
+    return key;
+}
+
+// The bytes of a string column in the given row
+static const unsigned char* column_string(const SortColumn* column, uint64_t row, size_t* length) {
+    const unsigned char* values = column->values;
+    if (column->offsets != NULL) {
+        *length = (size_t)(column->offsets[row + 1] - column->offsets[row]);
+        return values + column->offsets[row];
+    }
+    const unsigned char* string = values + row * column->stride;
+    const unsigned char* end = memchr(string, 0, column->width);
+    *length = end != NULL ? (size_t)(end - string) : column->width;
+    return string;
+}
+
+// The first 8 bytes of the normalized key of a row, as a big-endian number. A string ends the prefix, because the
+// columns after it start at a different byte in every row; the bytes that a short string leaves are zero (inverted
+// for descending columns), which orders it before the longer strings that it is a prefix of.
+static uint64_t row_prefix(const RowOrder* order, uint64_t row) {
+    uint64_t prefix = 0;
+    unsigned int remaining = 64;
+    for (size_t c = 0; c < order->columnCount && remaining > 0; c++) {
+        const SortColumn* column = &order->columns[c];
+        if (column->type == SORT_COLUMN_STRING) {
+            size_t length;
+            const unsigned char* string = column_string(column, row, &length);
+            uint64_t bytes = 0;
+            for (unsigned int b = 0; b < remaining / 8; b++) {
+                bytes = bytes << 8 | (b < length ? string[b] : 0);
+            }
+            if (column->descending) {
+                bytes = ~bytes & (remaining == 64 ? UINT64_MAX : ((uint64_t)1 << remaining) - 1);
+            }
+            return prefix | bytes;
+        }
+        unsigned int bits = column_key_bits(column->type);
+        uint64_t key = column_key(column, row);
+        if (bits <= remaining) {
+            remaining -= bits;
+            prefix |= key << remaining;
+        } else {
+            prefix |= key >> (bits - remaining);
+            remaining = 0;
+        }
+    }
+    return prefix;
+}
+
+// Compares two rows by all of their columns, like strcmp
+static int row_compare(const RowOrder* order, uint64_t a, uint64_t b) {
+    for (size_t c = 0; c < order->columnCount; c++) {
+        const SortColumn* column = &order->columns[c];
+        if (column->type == SORT_COLUMN_STRING) {
+            size_t lengthA;
+            size_t lengthB;
+            const unsigned char* stringA = column_string(column, a, &lengthA);
+            const unsigned char* stringB = column_string(column, b, &lengthB);
+            int result = memcmp(stringA, stringB, lengthA < lengthB ? lengthA : lengthB);
+            if (result == 0) {
+                result = (lengthA > lengthB) - (lengthA < lengthB);
+            }
+            if (result != 0) {
+                return column->descending ? -result : result;
+            }
+        } else {
+            uint64_t keyA = column_key(column, a);
+            uint64_t keyB = column_key(column, b);
+            if (keyA != keyB) {
+                return keyA < keyB ? -1 : 1;
+            }
+        }
+    }
+    return 0;
+}
+
+#define SORT_TYPE RowEntry
+#define SORT_SUFFIX row
+#define SORT_LESS(a, b) ((a).prefix < (b).prefix || ((a).prefix == (b).prefix && !(a).order->exact && \
+                         row_compare((a).order, (a).row, (b).row) < 0))
+#define SORT_PRIVATE
+#include "sort_impl.h"
+
+static void* row_pack_thread(void* arg) {
+    RowThreadParameters* params = (RowThreadParameters*) arg;
+    const RowOrder* order = params->order;
+    RowEntry* entries = params->entries;
+    for (size_t i = params->begin; i < params->end; i++) {
+        entries[i].prefix = row_prefix(order, i);
+        entries[i].row = i;
+        entries[i].order = order;
+    }
+    return NULL;
+}
+
+static void* row_unpack_thread(void* arg) {
+    RowThreadParameters* params = (RowThreadParameters*) arg;
+    const RowEntry* entries = params->entries;
+    if (params->indexSize == sizeof(uint32_t)) {
+        uint32_t* indices = params->indices;
+        for (size_t i = params->begin; i < params->end; i++) {
+            indices[i] = (uint32_t)entries[i].row;
+        }
+    } else {
+        uint64_t* indices = params->indices;
+        for (size_t i = params->begin; i < params->end; i++) {
+            indices[i] = entries[i].row;
+        }
+    }
+    return NULL;
+}
+
+int sort_rows_with(const SortColumn* columns, size_t columnCount, size_t count, void* indices, size_t indexSize,
+                   unsigned int threads, const SortResources* resources) {
+    if (indexSize != sizeof(uint32_t) && indexSize != sizeof(uint64_t)) {
+        fprintf(stderr, "Indices are 4 or 8 bytes wide, not %zu.\n", indexSize);
+        return -1;
+    }
+    unsigned int keyBits = 0;
+    int exact = 1;
+    for (size_t c = 0; c < columnCount; c++) {
+        if ((unsigned int)columns[c].type > SORT_COLUMN_STRING) {
+            fprintf(stderr, "Column %zu has no valid type.\n", c);
+            return -1;
+        }
+        if (columns[c].type == SORT_COLUMN_STRING) {
+            exact = 0;
+        } else {
+            keyBits += column_key_bits(columns[c].type);
+        }
+    }
+    exact = exact && keyBits <= 64;
+    if (count == 0) {
+        return 0;
+    }
+    if (indexSize == sizeof(uint32_t) && count - 1 > UINT32_MAX) {
+        fprintf(stderr, "%zu rows need 64-bit indices.\n", count);
+        return -1;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > count) {
+        threads = (unsigned int)count;
+    }
+
+    //// ALLOCATION
+    /// The entries are sorted in place, so the entry buffer is the only one besides the scratch memory of the sort
+    Arena* arena = resources->arena;
+    RowOrder order = {columns, columnCount, exact};
+    RowThreadParameters* params = arena_alloc(arena, sizeof(*params) * threads);
+    RowEntry* entries = arena_alloc(arena, sizeof(RowEntry) * count);
+    if (params == NULL || entries == NULL) {
+        fprintf(stderr, "Failed to allocate memory for sorting.\n");
+        arena_free(arena, params);
+        arena_free(arena, entries);
+        return -1;
+    }
+    for (unsigned int t = 0; t < threads; t++) {
+        params[t].order = &order;
+        params[t].begin = slice_begin(t, count, threads, sizeof(uint32_t));
+        params[t].end = slice_begin(t + 1, count, threads, sizeof(uint32_t));
+        params[t].entries = entries;
+        params[t].indices = indices;
+        params[t].indexSize = indexSize;
+    }
+
+    //// PACK, SORT AND UNPACK
+    SortTrace* trace = resources->trace;
+    ThreadPool* pool = resources->pool;
+    trace_run(trace, "pack", 0, pool, row_pack_thread, params, sizeof(*params), threads);
+    int status = parallel_sort_with_row(entries, entries, count, threads, resources);
+    if (status == 0) {
+        trace_run(trace, "unpack", 0, pool, row_unpack_thread, params, sizeof(*params), threads);
+    }
+
+    arena_free(arena, params);
+    arena_free(arena, entries);
+    return status;
+}
+
+int sort_rows(const SortColumn* columns, size_t columnCount, size_t count, void* indices, size_t indexSize,
+              unsigned int threads) {
+    SortResources resources = {shared_pool(), NULL, NULL};
+    return sort_rows_with(columns, columnCount, count, indices, indexSize, threads, &resources);
+}
@@ -0,0 +1,280 @@
+//// PARALLEL MERGE SORT
+/// The sorting engine behind main.c. Each function sorts one element type; they all share the
+/// implementation in sort_impl.h.
+///
+/// How a sort runs:
+///     1. The input is split into one partition per thread, and each partition is merge sorted on its own thread.
+///     2. The sorted partitions are merged pairwise in a merge tree. Every level of the tree is split across
+///        all threads, with each thread merging one slice of the level's output.
+/// Integer keys are radix sorted instead by default once there are many of them, and any element type can be sample
+/// sorted, which needs no merge tree (see set_sort_algorithm).
+///
+/// Common scalar keys have their own typed functions, compiled from the same template, so comparisons are inlined.
+/// Floating point keys sort NaNs after every other value. Records that carry a key are best sorted as key-value
+/// pairs, with the record's index as the value; anything else can be sorted with parallel_sort_generic and a comparator.
+///
+/// Every sort is stable: elements with equal keys keep the order they have in the input, whichever algorithm runs.
+
+#ifndef MULTITHREADED_SORTING_SORT_H
+#define MULTITHREADED_SORTING_SORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sorts count elements of input into output in ascending order, using up to "threads" threads.
+// input is only read, so it may point into a read-only memory mapping; output must have room for count elements
+// and must either not overlap input or be input itself, which sorts in place. Returns 0 on success, or -1 (after
+// printing the reason to stderr) if memory could not be allocated.
+int parallel_sort_i32(const int32_t* input, int32_t* output, size_t count, unsigned int threads);
+int parallel_sort_i64(const int64_t* input, int64_t* output, size_t count, unsigned int threads);
+int parallel_sort_u32(const uint32_t* input, uint32_t* output, size_t count, unsigned int threads);
+int parallel_sort_u64(const uint64_t* input, uint64_t* output, size_t count, unsigned int threads);
+int parallel_sort_f32(const float* input, float* output, size_t count, unsigned int threads);
+int parallel_sort_f64(const double* input, double* output, size_t count, unsigned int threads);
+
+// Key-value pairs are ordered by key alone, and since the sort is stable, pairs with equal keys keep their input order.
+// To sort big records without moving them on every merge, sort one pair per record with the record's index as the
+// value, and then gather the records in the order of the sorted values: 16 bytes move per merge instead of the record.
+typedef struct {
+    int64_t key;
+    uint64_t value;
+} KeyValueI64;
+
+typedef struct {
+    uint64_t key;
+    uint64_t value;
+} KeyValueU64;
+
+int parallel_sort_kv_i64(const KeyValueI64* input, KeyValueI64* output, size_t count, unsigned int threads);
+int parallel_sort_kv_u64(const KeyValueU64* input, KeyValueU64* output, size_t count, unsigned int threads);
+
+// Sorts count elements of elementSize bytes, in the order given by compare, which works like qsort's comparator
+// and also receives context. The contract is the same as for the typed functions above, except that output must
+// not overlap input at all.
+// The engine sorts pointers to the elements and copies the elements to output once, in sorted order, so large
+// records are not moved around while sorting. Every comparison is an indirect call, so prefer a typed function
+// whenever the key is a plain scalar.
+int parallel_sort_generic(const void* input, void* output, size_t count, size_t elementSize,
+                          int (*compare)(const void* a, const void* b, void* context), void* context,
+                          unsigned int threads);
+
+// Integer keys, and key-value pairs with integer keys, can also be sorted with a parallel LSD radix sort, which does
+// O(count) work instead of O(count log count): one pass per key byte, with each pass counting and then scattering
+// in parallel. It uses the same threads and the same amount of scratch memory as the merge sort.
+int radix_sort_i32(const int32_t* input, int32_t* output, size_t count, unsigned int threads);
+int radix_sort_i64(const int64_t* input, int64_t* output, size_t count, unsigned int threads);
+int radix_sort_u32(const uint32_t* input, uint32_t* output, size_t count, unsigned int threads);
+int radix_sort_u64(const uint64_t* input, uint64_t* output, size_t count, unsigned int threads);
+int radix_sort_kv_i64(const KeyValueI64* input, KeyValueI64* output, size_t count, unsigned int threads);
+int radix_sort_kv_u64(const KeyValueU64* input, KeyValueU64* output, size_t count, unsigned int threads);
+
+// The k smallest elements of input, sorted, written to the first k elements of output, where k is clamped to count.
+// Gives the same elements as the first k of a full sort, ties included, but for small k costs little more than one read
+// of the input: every thread keeps the smallest elements of its slice in a heap, and the heaps are merged. output must
+// have room for k elements, and may be input itself. Returns like parallel_sort.
+int partial_sort_i32(const int32_t* input, int32_t* output, size_t count, size_t k, unsigned int threads);
+int partial_sort_i64(const int64_t* input, int64_t* output, size_t count, size_t k, unsigned int threads);
+int partial_sort_u32(const uint32_t* input, uint32_t* output, size_t count, size_t k, unsigned int threads);
+int partial_sort_u64(const uint64_t* input, uint64_t* output, size_t count, size_t k, unsigned int threads);
+int partial_sort_f32(const float* input, float* output, size_t count, size_t k, unsigned int threads);
+int partial_sort_f64(const double* input, double* output, size_t count, size_t k, unsigned int threads);
+int partial_sort_kv_i64(const KeyValueI64* input, KeyValueI64* output, size_t count, size_t k, unsigned int threads);
+int partial_sort_kv_u64(const KeyValueU64* input, KeyValueU64* output, size_t count, size_t k, unsigned int threads);
+
+// Stores the element that a full sort would put at position rank (0 for the smallest, count / 2 for the median) in
+// *element, without sorting: a parallel quickselect narrows the input down to the elements around the rank.
+// input is only read. Returns 0, or -1 (after printing the reason to stderr) if rank is not below count or memory
+// could not be allocated.
+int nth_element_i32(const int32_t* input, size_t count, size_t rank, int32_t* element, unsigned int threads);
+int nth_element_i64(const int64_t* input, size_t count, size_t rank, int64_t* element, unsigned int threads);
+int nth_element_u32(const uint32_t* input, size_t count, size_t rank, uint32_t* element, unsigned int threads);
+int nth_element_u64(const uint64_t* input, size_t count, size_t rank, uint64_t* element, unsigned int threads);
+int nth_element_f32(const float* input, size_t count, size_t rank, float* element, unsigned int threads);
+int nth_element_f64(const double* input, size_t count, size_t rank, double* element, unsigned int threads);
+int nth_element_kv_i64(const KeyValueI64* input, size_t count, size_t rank, KeyValueI64* element, unsigned int threads);
+int nth_element_kv_u64(const KeyValueU64* input, size_t count, size_t rank, KeyValueU64* element, unsigned int threads);
+
+// Writes the permutation that sorts input to indices, instead of the sorted elements: indices[i] is the position in
+// input of the element that the (stable) parallel_sort puts at position i, so elements with equal keys are in
+// ascending order of their position. Reordering other columns by the same indices puts them in the order of input
+// without sorting them. indexSize is the width of the indices, 4 for uint32_t (for at most 2^32 elements) or 8 for
+// uint64_t, and indices must have room for count of them. input is only read. Internally every element becomes one
+// (key, index) pair, packed into a single uint64_t for 32-bit keys, and the pairs are sorted by the engine of their
+// type, which needs 8 or 16 bytes of memory per element besides its scratch memory.
+// Returns 0, or -1 (after printing the reason to stderr) if memory could not be allocated or indexSize does not fit.
+int argsort_i32(const int32_t* input, void* indices, size_t count, size_t indexSize, unsigned int threads);
+int argsort_i64(const int64_t* input, void* indices, size_t count, size_t indexSize, unsigned int threads);
+int argsort_u32(const uint32_t* input, void* indices, size_t count, size_t indexSize, unsigned int threads);
+int argsort_u64(const uint64_t* input, void* indices, size_t count, size_t indexSize, unsigned int threads);
+int argsort_f32(const float* input, void* indices, size_t count, size_t indexSize, unsigned int threads);
+int argsort_f64(const double* input, void* indices, size_t count, size_t indexSize, unsigned int threads);
+int argsort_kv_i64(const KeyValueI64* input, void* indices, size_t count, size_t indexSize, unsigned int threads);
+int argsort_kv_u64(const KeyValueU64* input, void* indices, size_t count, size_t indexSize, unsigned int threads);
+
+// Which algorithm the parallel_sort functions with integer keys use. AUTO (the default) radix sorts inputs of at least
+// RADIX_SORT_MIN_COUNT elements, where its fixed cost of 256 counters per thread and pass has paid off, and merge
+// sorts smaller ones. Floating point types always use the merge sort, unless SAMPLE is chosen.
+// SAMPLE applies to every element type, generic ones included: a parallel sample sort splits the array into buckets
+// by value, around splitters taken from a random sample, and sorts every bucket on its own, so there is no merge tree
+// and the array crosses memory about twice instead of once per merge level. It needs one byte of memory per element
+// on top of the scratch buffer. Arrays too small to give every bucket a thousand elements are merge sorted.
+// Not thread-safe: set it before sorting starts.
+typedef enum {
+    SORT_ALGORITHM_AUTO,
+    SORT_ALGORITHM_MERGE,
+    SORT_ALGORITHM_RADIX,
+    SORT_ALGORITHM_SAMPLE
+} SortAlgorithm;
+
+#define RADIX_SORT_MIN_COUNT 65536
+
+void set_sort_algorithm(SortAlgorithm algorithm);
+SortAlgorithm get_sort_algorithm(void);
+
+// Whether the parallel_sort functions of the integer types (not the key-value pairs) sort keys that span a small range
+// as narrower integers (default on). A parallel pass finds the smallest and the largest key first, and when their
+// difference fits 16 bits (for the radix sort), or 32 bits for 64-bit types, the offsets of the keys from the smallest
+// one are sorted instead, and widened again while they are copied into output. Each merge level or radix pass then moves a half or a
+// quarter of the bytes, at the cost of one more read of the input, which is wasted when the range is too wide.
+// Only arrays of at least 65536 keys are checked. Not thread-safe: set it before sorting starts.
+void set_key_narrowing(int enabled);
+int get_key_narrowing(void);
+
+// Partitions of at most this many elements are insertion sorted instead of being split further (default 24).
+// Below a few dozen elements the recursion and merge overhead costs more than insertion sort's quadratic work.
+// The best value depends on the CPU; the benchmark harness can sweep it with -c. Values below 1 are treated as 1.
+// Not thread-safe: set it before sorting starts.
+void set_insertion_sort_threshold(size_t elements);
+size_t get_insertion_sort_threshold(void);
+
+
+//// K-WAY MERGE
+/// Merges many sorted runs that are streamed through small buffers, as the external sort does (see extsort.h).
+
+// The most runs a single kway_merge call can take
+#define KWAY_MAX_CURSORS 256
+
+// The part of a sorted run that is currently in memory
+typedef struct {
+    // The next element of the run to merge
+    const void* next;
+    // Number of elements left at next
+    size_t remaining;
+} MergeCursor;
+
+// Merges the buffered elements of cursorCount (at most KWAY_MAX_CURSORS) runs into output, taking elements with equal
+// keys in cursor order. Every cursor must have at least one element on entry. Merging stops right after a cursor
+// runs out of elements, so the caller can refill or drop it, or when capacity elements have been written.
+// Returns the number of elements written to output.
+size_t kway_merge_i32(MergeCursor* cursors, size_t cursorCount, int32_t* output, size_t capacity);
+size_t kway_merge_i64(MergeCursor* cursors, size_t cursorCount, int64_t* output, size_t capacity);
+size_t kway_merge_u32(MergeCursor* cursors, size_t cursorCount, uint32_t* output, size_t capacity);
+size_t kway_merge_u64(MergeCursor* cursors, size_t cursorCount, uint64_t* output, size_t capacity);
+size_t kway_merge_f32(MergeCursor* cursors, size_t cursorCount, float* output, size_t capacity);
+size_t kway_merge_f64(MergeCursor* cursors, size_t cursorCount, double* output, size_t capacity);
+size_t kway_merge_kv_i64(MergeCursor* cursors, size_t cursorCount, KeyValueI64* output, size_t capacity);
+size_t kway_merge_kv_u64(MergeCursor* cursors, size_t cursorCount, KeyValueU64* output, size_t capacity);
+
+
+//// SORT RESOURCES
+/// What a sort runs on. The functions above run their tasks on the pool shared by the whole process (see pool.h)
+/// and allocate their scratch memory and thread parameters on every call. A caller that sorts over and over, such as
+/// a context of the library interface (see mtsort.h), keeps its own and hands them in through a SortType descriptor.
+typedef struct {
+    // The pool to run the sorting tasks on. NULL runs them all on the calling thread.
+    struct ThreadPool* pool;
+    // Where the sort takes all of its memory from (see arena.h), or NULL to use malloc. The sort does not reset it.
+    struct Arena* arena;
+    // Where the sort records the time of its phases and tasks (see trace.h), or NULL to record nothing
+    struct SortTrace* trace;
+} SortResources;
+
+
+//// ELEMENT TYPE DESCRIPTORS
+/// The entry points above for one element type, behind untyped pointers, for code such as the external sort
+/// that moves elements around as bytes and only needs the engine to compare them.
+typedef struct {
+    // Short name of the element type, as used by the -f options: "i32", "u64", "f64", "kv_u64", ...
+    const char* name;
+    // Size of one element in bytes
+    size_t elementSize;
+    int (*parallel_sort)(const void* input, void* output, size_t count, unsigned int threads);
+    // The same sort, on the given resources instead of the shared pool and freshly allocated scratch memory
+    int (*parallel_sort_with)(const void* input, void* output, size_t count, unsigned int threads,
+                              const SortResources* resources);
+    // partial_sort and nth_element (see above) on the given resources
+    int (*partial_sort_with)(const void* input, void* output, size_t count, size_t k, unsigned int threads,
+                             const SortResources* resources);
+    int (*nth_element_with)(const void* input, size_t count, size_t rank, void* element, unsigned int threads,
+                            const SortResources* resources);
+    // Merges the sorted runs left and right into output, which must not overlap them, taking left's elements first
+    // on ties. The merge is split across up to threads tasks on the pool of resources, or runs on the calling thread
+    // if there is no memory for the tasks' parameters, so it cannot fail.
+    void (*merge_runs_with)(const void* left, size_t leftCount, const void* right, size_t rightCount, void* output,
+                            unsigned int threads, const SortResources* resources);
+    size_t (*kway_merge)(MergeCursor* cursors, size_t cursorCount, void* output, size_t capacity);
+    // argsort (see above) on the given resources
+    int (*argsort_with)(const void* input, void* indices, size_t count, size_t indexSize, unsigned int threads,
+                        const SortResources* resources);
+    // The number of elements of sorted, which is in ascending order, that key does not order before: where key would go
+    // after its equals. Splits sorted input into the ranges between splitters, as the distributed sort does.
+    size_t (*upper_bound)(const void* sorted, size_t count, const void* key);
+} SortType;
+
+extern const SortType sort_type_i32;
+extern const SortType sort_type_i64;
+extern const SortType sort_type_u32;
+extern const SortType sort_type_u64;
+extern const SortType sort_type_f32;
+extern const SortType sort_type_f64;
+extern const SortType sort_type_kv_i64;
+extern const SortType sort_type_kv_u64;
+
+// The descriptor with the given name, or NULL if there is none
+const SortType* find_sort_type(const char* name);
+
+
+//// ROWS OF COLUMNS
+/// Sorts rows by several typed columns, such as (country, name, age) with strings among them, which no single scalar
+/// key can express. Each row is sorted as one entry that caches the first 8 bytes of the row's key, normalized so that
+/// comparing them as a number compares the rows, next to the row's index. Rows are only compared column by column when
+/// their prefixes are equal, so most comparisons never leave the entries that the merges stream through.
+
+typedef enum {
+    SORT_COLUMN_I32,
+    SORT_COLUMN_I64,
+    SORT_COLUMN_U32,
+    SORT_COLUMN_U64,
+    SORT_COLUMN_F32,
+    SORT_COLUMN_F64,
+    // Compared byte by byte as unsigned char, and a string before the longer ones that start with it
+    SORT_COLUMN_STRING
+} SortColumnType;
+
+typedef struct {
+    SortColumnType type;
+    // The value of row i is at values + i * stride bytes, so a column is either an array of its own (stride is the
+    // size of a value) or a field of an array of records (values points into the first record, stride is its size)
+    const void* values;
+    size_t stride;
+    // Strings only. If offsets is NULL, the string of row i is the width bytes at values + i * stride, up to the first
+    // NUL if there is one. Otherwise it has count + 1 entries, and the string of row i is the bytes from offsets[i] up
+    // to offsets[i + 1] of values, as in an Arrow string column; stride and width are then unused.
+    size_t width;
+    const uint64_t* offsets;
+    // Sorts this column from the biggest value down. Floating point columns sort NaNs first then.
+    int descending;
+} SortColumn;
+
+// Writes the permutation that sorts count rows by their columns, in order, to indices, like argsort_i32: indices[i] is
+// the row that goes to position i, with rows of equal columns in ascending order. The columns are only read. Needs 24
+// bytes of memory per row besides the scratch memory of the sort, and takes any algorithm but the radix sort, which
+// falls back to the merge sort. Returns 0, or -1 (after printing the reason to stderr) if memory could not be
+// allocated, a column has no valid type, or indexSize does not fit.
+int sort_rows(const SortColumn* columns, size_t columnCount, size_t count, void* indices, size_t indexSize,
+              unsigned int threads);
+// The same sort on the given resources
+int sort_rows_with(const SortColumn* columns, size_t columnCount, size_t count, void* indices, size_t indexSize,
+                   unsigned int threads, const SortResources* resources);
+
+#endif //MULTITHREADED_SORTING_SORT_H
@@ -0,0 +1,884 @@
+//// SORTING ENGINE TEMPLATE
+/// This file has no include guard on purpose: sort.c includes it once per element type.
+/// C has no templates, so the element type and the name suffix are passed in as macros:
+///     SORT_TYPE    the element type, e.g. int32_t
+///     SORT_SUFFIX  appended to every function and struct name, e.g. i32 gives parallel_sort_i32
+/// and optionally
+///     SORT_KEY(a)          the key of element a, for elements that carry a payload next to their key, such as
+///                          key-value pairs (default: the element itself). Only the key is compared and radix sorted.
+///     SORT_LESS(a, b)      whether element a sorts before element b (default: SORT_KEY(a) < SORT_KEY(b)). Keys with
+///                          special values, such as the NaNs of floating point types, or records with a comparator, define it.
+///     SORT_VECTOR_KERNELS  an expression giving the SimdKernels (see simd.h) to merge and sort leaves with,
+///                          for element types that have vectorized kernels
+///     SORT_RADIX_KEY       for integer types, enables the radix sort in radix_impl.h (see there for details)
+///     SORT_ORDER_KEY(a)    for types without SORT_RADIX_KEY, an unsigned integer that orders the elements like
+///                          SORT_LESS, for the argsort in argsort_impl.h, with its type in SORT_ORDER_KEY_TYPE
+///     SORT_NARROW          for integer types that are their own key, sorts keys that span a small range as
+///                          narrower integers (see narrow_impl.h)
+///     SORT_PRIVATE         leaves out the entry points on the shared pool, the k-way merge and the type descriptor,
+///                          for element types that only serve as a building block inside sort.c, which sorts them
+///                          with parallel_sort_with
+/// The macros are undefined again at the end of this file, ready for the next instantiation.
+///
+/// Note: No Mutex is used
+/// To incorporate the mutex into your program, you would typically do so in areas where threads access or modify shared resources concurrently.
+/// This engine does not need a Mutex for 2 reasons:
+///     1. There's no  concurrent modification of shared resources by threads that would necessitate a Mutex for synchronization.
+///     2. The sorting and merging operations are structured to work on distinct data segments or are sequenced in a way (sorting first, followed by merging) that inherently avoids concurrent access issues.
+
+#if !defined(SORT_TYPE) || !defined(SORT_SUFFIX)
+#error "Define SORT_TYPE and SORT_SUFFIX before including sort_impl.h"
+#endif
+
+#define SORT_CONCAT_(name, suffix) name##_##suffix
+#define SORT_CONCAT(name, suffix) SORT_CONCAT_(name, suffix)
+#define SORT_FN(name) SORT_CONCAT(name, SORT_SUFFIX)
+#define SORT_STRING_(suffix) #suffix
+#define SORT_STRING(suffix) SORT_STRING_(suffix)
+
+#ifndef SORT_KEY
+#define SORT_KEY(a) (a)
+#endif
+
+#ifndef SORT_LESS
+#define SORT_LESS(a, b) (SORT_KEY(a) < SORT_KEY(b))
+#endif
+
+#ifdef SORT_RADIX_KEY
+#include "radix_impl.h"
+#endif
+
+
+//// STRUCTS
+/// These structs encapsulate and organize the necessary data for sorting and merging operations in a way that's easy to manage and pass between threads.
+
+// For each sorting thread (one per partition of the array)
+typedef struct {
+    // a pointer to the beginning of the subarray that the thread will sort.
+    // In C, arrays are often managed through pointers.
+    // The sorting thread only reads it, so it can point straight into a read-only memory-mapped file.
+    const SORT_TYPE* subArray;
+    // This tells the thread how many elements are in the subarray it needs to sort.
+    size_t size;
+    // Where the sorted subarray is written, the same size as subArray.
+    SORT_TYPE* output;
+    // A private work buffer, the same size as subArray, that merge_sort_into ping-pongs with output.
+    // Each thread gets its own slices so the sorting threads never write to the same memory.
+    SORT_TYPE* work;
+    // The work-stealing group shared by the sorting threads (see pool.h), and the member this thread is in it.
+    // NULL with a single thread, which has nobody to share work with.
+    StealGroup* group;
+    unsigned int member;
+} SORT_FN(SortingThreadParameters);
+
+// For one pair of neighbouring runs that a merge level combines into a single run
+typedef struct {
+    // Uses the same SortingThreadParameters structure to say, "Here's the first sorted part you need to merge."
+    SORT_FN(SortingThreadParameters) left;
+    // The right run always starts where the left run ends, so both runs form one contiguous block.
+    // It may be empty (size 0) when a merge level has an odd number of runs; the left run is then just copied.
+    SORT_FN(SortingThreadParameters) right;
+    // Where the merged run is written. It holds left.size + right.size elements.
+    SORT_TYPE* output;
+} SORT_FN(MergePair);
+
+// For each merging thread
+// Every thread of a merge level produces one equally sized slice of the level's output, which may
+// cover the end of one pair and the beginning of the next, so all threads stay busy on every level.
+typedef struct {
+    // All pairs of the current merge level, in the order they appear in memory
+    SORT_FN(MergePair)* pairs;
+    size_t pairCount;
+    // The destination buffer of the level. Offsets below are measured from its beginning.
+    SORT_TYPE* destination;
+    // The slice [begin, end) of the level's output that this thread writes
+    size_t begin;
+    size_t end;
+} SORT_FN(MergingThreadParameters);
+
+
+//// FUNCTION PROTOTYPES
+static void* SORT_FN(sorting_thread)(void* arg);
+static void SORT_FN(sort_partition_task)(StealGroup* group, unsigned int member, void* arg);
+static int SORT_FN(sort_natural_runs)(const SORT_TYPE* arr, SORT_TYPE* output, SORT_TYPE* work, size_t size);
+static void* SORT_FN(merging_thread)(void* arg);
+static void SORT_FN(merge_sort_task)(StealGroup* group, unsigned int member, void* arg);
+static void SORT_FN(merge_sort_forked)(StealGroup* group, unsigned int member, const SORT_TYPE* arr, SORT_TYPE* output,
+                                       SORT_TYPE* work, size_t size);
+static void SORT_FN(merge_sort_into)(const SORT_TYPE* arr, SORT_TYPE* output, SORT_TYPE* work, size_t size);
+static void SORT_FN(insertion_sort)(SORT_TYPE* arr, size_t size);
+static void SORT_FN(merge)(const SORT_TYPE* left, size_t leftSize, const SORT_TYPE* right, size_t rightSize, SORT_TYPE* output);
+static size_t SORT_FN(co_rank)(size_t k, const SORT_TYPE* left, size_t leftSize, const SORT_TYPE* right, size_t rightSize);
+static int SORT_FN(parallel_sort_with)(const SORT_TYPE* input, SORT_TYPE* output, size_t count, unsigned int threads,
+                                       const SortResources* resources);
+static int SORT_FN(wide_sort_with)(const SORT_TYPE* input, SORT_TYPE* output, size_t count, unsigned int threads,
+                                   const SortResources* resources);
+#ifndef SORT_PRIVATE
+static int SORT_FN(parallel_sort_untyped)(const void* input, void* output, size_t count, unsigned int threads);
+static int SORT_FN(parallel_sort_with_untyped)(const void* input, void* output, size_t count, unsigned int threads,
+                                               const SortResources* resources);
+static size_t SORT_FN(kway_merge_untyped)(MergeCursor* cursors, size_t cursorCount, void* output, size_t capacity);
+#endif
+
+#include "sample_impl.h"
+#ifdef SORT_NARROW
+#include "narrow_impl.h"
+#endif
+#ifndef SORT_PRIVATE
+#include "select_impl.h"
+#include "argsort_impl.h"
+#endif
+
+
+//// ENTRY POINTS
+/// See sort.h for the contract. Private types only have the entry points on given resources.
+#ifndef SORT_PRIVATE
+int SORT_FN(parallel_sort)(const SORT_TYPE* input, SORT_TYPE* output, size_t count, unsigned int threads) {
+    SortResources resources = {shared_pool(), NULL, NULL};
+    return SORT_FN(parallel_sort_with)(input, output, count, threads, &resources);
+}
+#endif
+
+// Where the sort actually happens, on the pool and scratch memory of resources (see SortResources in sort.h)
+static int SORT_FN(parallel_sort_with)(const SORT_TYPE* input, SORT_TYPE* output, size_t count, unsigned int threads,
+                                       const SortResources* resources) {
+#ifdef SORT_NARROW
+    // Keys that span a small range are sorted as narrower integers
+    int status = SORT_FN(narrow_sort_with)(input, output, count, threads, resources);
+    if (status != NARROW_TOO_WIDE) {
+        return status;
+    }
+#endif
+    return SORT_FN(wide_sort_with)(input, output, count, threads, resources);
+}
+
+// The sort at the full width of the keys
+static int SORT_FN(wide_sort_with)(const SORT_TYPE* input, SORT_TYPE* output, size_t count, unsigned int threads,
+                                   const SortResources* resources) {
+    //// CHOOSE THE NUMBER OF THREADS
+    /// The thread count is clamped so every thread gets at least one element.
+    if (count == 0) {
+        return 0;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > count) {
+        threads = (unsigned int)count;
+    }
+
+#ifdef SORT_RADIX_KEY
+    //// CHOOSE THE ALGORITHM
+    /// Integer keys can be radix sorted instead (see set_sort_algorithm)
+    if (sortAlgorithm == SORT_ALGORITHM_RADIX || (sortAlgorithm == SORT_ALGORITHM_AUTO && count >= RADIX_SORT_MIN_COUNT)) {
+        return SORT_FN(radix_sort_with)(input, output, count, threads, resources);
+    }
+#endif
+    // Or be split into buckets by a sample sort, for arrays big enough to fill its buckets
+    unsigned int buckets = sortAlgorithm == SORT_ALGORITHM_SAMPLE ? SORT_FN(sample_buckets)(count, threads) : 0;
+    if (buckets > 0) {
+        return SORT_FN(sample_sort_with)(input, output, count, threads, buckets, resources);
+    }
+
+
+    //// ALLOCATION OF SORTING THEAD PARAMETERS
+    /// 1. Create a pointer to new allocated memory to hold one set of thread parameters per partition
+    /// 2. Set each thread parameter (pointer to subArray, size, output and work slices)
+
+    //  This allocates memory that is large enough to store one SortingThreadParameters structure per thread, from the
+    //  caller's arena if there is one (see arena.h), else from the heap. All other allocations below work the same way.
+    //  The runs array is reused by the merge phase to track the sorted runs that are left to merge.
+    SortTrace* trace = resources->trace;
+    TraceSpan setup = trace_span_begin(trace);
+    Arena* arena = resources->arena;
+    SORT_FN(SortingThreadParameters)* runs = arena_alloc(arena, sizeof(*runs) * threads);
+
+
+    //// ALLOCATION OF SCRATCH MEMORY
+    /// Sorting and merging ping-pong between output and a second buffer of the same size.
+    /// One block is allocated for the whole job, and each sorting thread receives the slice that lines up with its own
+    /// partition. The input is never written, so it does not need to be copied before sorting. When output is the input
+    /// itself, every partition still reads its elements before anything overwrites them.
+    SORT_TYPE* scratch = arena_alloc(arena, sizeof(SORT_TYPE) * count);
+    // Lets a thread that is done with its partition take over parts of the partitions that are still being sorted
+    void* groupMemory = threads > 1 ? arena_alloc(arena, steal_group_size(threads)) : NULL;
+    if (runs == NULL || scratch == NULL || (threads > 1 && groupMemory == NULL)) {
+        fprintf(stderr, "Failed to allocate memory for sorting.\n");
+        arena_free(arena, runs);
+        arena_free(arena, scratch);
+        arena_free(arena, groupMemory);
+        return -1;
+    }
+    StealGroup* group = threads > 1 ? steal_group_init(groupMemory, threads) : NULL;
+
+
+    //// MERGE TREE SHAPE
+    /// The sorted runs are merged pairwise, level by level, until a single run is left:
+    /// "threads" runs need ceil(log2(threads)) levels (none with a single thread).
+    /// Each level reads from one buffer and writes into the other, alternating between scratch and output.
+    /// Counting back from the last level, which must write into output, tells the sorting threads which
+    /// buffer to sort into, so the final run lands in output without any copy.
+    unsigned int levels = 0;
+    while ((1u << levels) < threads) {
+        levels++;
+    }
+    SORT_TYPE* sorted = (levels % 2 == 0) ? output : scratch;
+    SORT_TYPE* other = (levels % 2 == 0) ? scratch : output;
+
+    // Split the array into "threads" partitions whose sizes differ by at most a cache line (see slice_begin).
+    // Partition i covers input[slice_begin(i) .. slice_begin(i + 1)).
+    for (unsigned int i = 0; i < threads; i++) {
+        size_t begin = slice_begin(i, count, threads, sizeof(SORT_TYPE));
+        size_t end = slice_begin(i + 1, count, threads, sizeof(SORT_TYPE));
+        runs[i].subArray = input + begin;
+        runs[i].size = end - begin;
+        runs[i].output = sorted + begin;
+        runs[i].work = other + begin;
+        runs[i].group = group;
+        runs[i].member = i;
+    }
+
+
+    //// RUNNING THE SORTING TASKS
+    /// Every partition is one task for the worker pool (see pool.h), which runs sorting_thread with the partition's
+    /// parameters on one of its long-lived threads. The pool keeps its threads between phases and between sorts,
+    /// so no thread is created or joined here; pool_run returns once every partition is sorted.
+    /// Equally sized partitions are not equally costly when parts of the input are presorted or comparisons vary in
+    /// cost, so a thread that finishes early steals halves of the other partitions' recursions (see merge_sort_forked).
+    trace_span_end(trace, "partition", 0, &setup);
+    ThreadPool* pool = resources->pool;
+    trace_run(trace, "sort", 0, pool, SORT_FN(sorting_thread), runs, sizeof(*runs), threads);
+    steal_group_destroy(group);
+    arena_free(arena, groupMemory);
+
+    // From now on each run lives in its output slice
+    for (unsigned int i = 0; i < threads; i++) {
+        runs[i].subArray = runs[i].output;
+    }
+
+    //// ALREADY IN ORDER?
+    /// When every partition ends with an element no bigger than the first element of the next one, as with presorted
+    /// input, the sorted partitions already make up the sorted array, and the merge tree has nothing left to do.
+    int inOrder = 1;
+    for (unsigned int i = 1; i < threads && inOrder; i++) {
+        inOrder = !SORT_LESS(runs[i].subArray[0], runs[i - 1].subArray[runs[i - 1].size - 1]);
+    }
+    if (inOrder) {
+        if (sorted != output) {
+            TraceSpan copy = trace_span_begin(trace);
+            memcpy(output, sorted, sizeof(SORT_TYPE) * count);
+            trace_span_end(trace, "copy", 0, &copy);
+        }
+        levels = 0;
+    }
+
+
+    //// MERGE TREE
+    /// Every level is split across all threads (see merging_thread), so the merge phase scales
+    /// with the thread count instead of running the last level on a single core.
+    SORT_FN(MergePair)* pairList = arena_alloc(arena, sizeof(*pairList) * ((threads + 1) / 2));
+    SORT_FN(MergingThreadParameters)* paramsMerge = arena_alloc(arena, sizeof(*paramsMerge) * threads);
+    int status = 0;
+    if (pairList == NULL || paramsMerge == NULL) {
+        fprintf(stderr, "Failed to allocate memory for merging.\n");
+        status = -1;
+    }
+
+    const SORT_TYPE* source = sorted;
+    size_t runCount = threads;
+    for (unsigned int level = 1; status == 0 && level <= levels; level++) {
+        // The last level (and every second level before it) writes into output, the others into scratch
+        SORT_TYPE* destination = ((levels - level) % 2 == 0) ? output : scratch;
+        size_t pairs = (runCount + 1) / 2;
+
+        //// PAIRING THE RUNS
+        /// The left and right fields are copied from two neighbouring runs. Copying the structures (not the pointers)
+        /// lets the runs array be overwritten with the merged runs while this level is being set up.
+        for (size_t p = 0; p < pairs; p++) {
+            pairList[p].left = runs[2 * p];
+            if (2 * p + 1 < runCount) {
+                pairList[p].right = runs[2 * p + 1];
+            } else {
+                // Odd run out: merge it with an empty run, which moves it into the destination buffer
+                pairList[p].right.subArray = runs[2 * p].subArray + runs[2 * p].size;
+                pairList[p].right.size = 0;
+            }
+            // The merged run lands at the same offset in the destination buffer as it had in the source buffer
+            pairList[p].output = destination + (pairList[p].left.subArray - source);
+
+            runs[p].subArray = pairList[p].output;
+            runs[p].size = pairList[p].left.size + pairList[p].right.size;
+        }
+
+        //// ALLOCATION OF MERGING THEAD PARAMETERS
+        /// The output of the level (all count elements) is cut into "threads" slices on cache line bounds, the same
+        /// way the array was partitioned for the sorting threads.
+        for (unsigned int w = 0; w < threads; w++) {
+            paramsMerge[w].pairs = pairList;
+            paramsMerge[w].pairCount = pairs;
+            paramsMerge[w].destination = destination;
+            paramsMerge[w].begin = slice_begin(w, count, threads, sizeof(SORT_TYPE));
+            paramsMerge[w].end = slice_begin(w + 1, count, threads, sizeof(SORT_TYPE));
+        }
+
+        //// RUN THE MERGING TASKS
+        /// One task per output slice, each with the merging thread parameters that describe the level and its slice
+        trace_run(trace, "merge", level, pool, SORT_FN(merging_thread), paramsMerge, sizeof(*paramsMerge), threads);
+
+        source = destination;
+        runCount = pairs;
+    }
+
+
+    //// CLEAN UP MEMORY
+    /// Free the previously allocated memory after the merge threads are complete.
+    arena_free(arena, runs);
+    arena_free(arena, pairList);
+    arena_free(arena, paramsMerge);
+    arena_free(arena, scratch);
+
+    return status;
+}
+
+
+//// THREADS
+/// Includes a sorting thread for each partition of the input, and a merging thread that produces
+/// one slice of a merge level's output in the buffer chosen by the merge tree
+
+static void* SORT_FN(sorting_thread)(void* arg) {
+    // The arg argument is cast from void* to SortingThreadParameters*.
+    // This allows you to access the sorting parameters (subArray and size) passed to the thread.
+    // The arg pointer is expected to point to a SortingThreadParameters struct containing the subset of the array this thread will sort.
+    SORT_FN(SortingThreadParameters)* params = (SORT_FN(SortingThreadParameters)*) arg;
+
+    // Sorts the subarray defined by params into this thread's output slice, using its work slice as the other buffer.
+    // With other threads around, it then helps them with their partitions until all of them are sorted.
+    if (params->group != NULL) {
+        steal_run(params->group, params->member, SORT_FN(sort_partition_task), params);
+    } else {
+        SORT_FN(sort_partition_task)(NULL, 0, params);
+    }
+
+    // Returning NULL  is a common practice for thread routines
+    // that perform work but don't need to directly communicate a result back
+    return NULL;
+}
+
+
+static void* SORT_FN(merging_thread)(void* arg) {
+    //// PARAMETER EXTRACTION
+    /// Casts the void* argument back to a MergingThreadParameters*.
+    /// This allows the function to access the pairs of the level and the output slice this thread is responsible for
+    SORT_FN(MergingThreadParameters)* params = (SORT_FN(MergingThreadParameters)*) arg;
+
+    //// MERGING THE SLICE
+    /// The slice [begin, end) may touch several pairs. For each of them, co_rank finds which elements of the
+    /// left and right run produce the part of the slice that falls inside that pair. Those elements are merged
+    /// straight into the destination buffer. Slices of different threads never overlap, and nothing reads the
+    /// destination buffer until the level is complete, so the threads need no synchronization.
+    for (size_t p = 0; p < params->pairCount; p++) {
+        SORT_FN(MergePair)* pair = &params->pairs[p];
+        size_t offset = (size_t)(pair->output - params->destination);
+        size_t size = pair->left.size + pair->right.size;
+
+        // Skip pairs that lie entirely before or after this thread's slice
+        if (offset + size <= params->begin || offset >= params->end) {
+            continue;
+        }
+
+        // The part of the slice that falls inside this pair, measured from the beginning of the pair's output
+        size_t first = (params->begin > offset ? params->begin : offset) - offset;
+        size_t last = (params->end < offset + size ? params->end : offset + size) - offset;
+
+        // Split points: output[first..last) is made of left[i0..i1) and right[first - i0..last - i1)
+        size_t i0 = SORT_FN(co_rank)(first, pair->left.subArray, pair->left.size, pair->right.subArray, pair->right.size);
+        size_t i1 = SORT_FN(co_rank)(last, pair->left.subArray, pair->left.size, pair->right.subArray, pair->right.size);
+
+        SORT_FN(merge)(pair->left.subArray + i0, i1 - i0,
+                       pair->right.subArray + (first - i0), (last - i1) - (first - i0),
+                       pair->output + first);
+    }
+
+    return NULL;
+}
+
+
+//// SORTING FUNCTIONS (MERGE SORT)
+
+// Sorts one partition: by merging its natural runs when it has few of them, else with the full merge sort
+static void SORT_FN(sort_partition_task)(StealGroup* group, unsigned int member, void* arg) {
+    SORT_FN(SortingThreadParameters)* params = (SORT_FN(SortingThreadParameters)*) arg;
+    if (!SORT_FN(sort_natural_runs)(params->subArray, params->output, params->work, params->size)) {
+        SORT_FN(merge_sort_forked)(group, member, params->subArray, params->output, params->work, params->size);
+    }
+}
+
+
+//// NATURAL RUNS
+/// Data that arrives mostly in order, such as appended time series keys, is made of long runs that are already
+/// ascending (or descending). Merging those runs takes log2(runs) passes instead of the log2(size) levels of the
+/// merge sort, and input that is in order already is one run that is only copied: O(size) work.
+
+// Number of elements at the start of arr that are in ascending order (each one not less than the one before)
+static size_t SORT_FN(ascending_length)(const SORT_TYPE* arr, size_t size) {
+    size_t n = size > 0 ? 1 : 0;
+    while (n < size && !SORT_LESS(arr[n], arr[n - 1])) {
+        n++;
+    }
+    return n;
+}
+
+// Length of the run at the start of arr: ascending, or strictly descending, as *descending tells.
+// Descending runs have to be strictly descending so reversing them never swaps equal elements.
+static size_t SORT_FN(run_length)(const SORT_TYPE* arr, size_t size, int* descending) {
+    *descending = size > 1 && SORT_LESS(arr[1], arr[0]);
+    if (!*descending) {
+        return SORT_FN(ascending_length)(arr, size);
+    }
+    size_t n = 2;
+    while (n < size && SORT_LESS(arr[n], arr[n - 1])) {
+        n++;
+    }
+    return n;
+}
+
+// Sorts arr like merge_sort_into if it consists of few enough runs, and returns 1; otherwise returns 0 right away
+static int SORT_FN(sort_natural_runs)(const SORT_TYPE* arr, SORT_TYPE* output, SORT_TYPE* work, size_t size) {
+    //// COUNT THE RUNS
+    /// Stops as soon as there are too many, so random input only pays for a scan of a small prefix
+    size_t maxRuns = size / NATURAL_RUN_MIN_AVERAGE;
+    size_t runCount = 0;
+    for (size_t i = 0; i < size; runCount++) {
+        if (runCount == maxRuns) {
+            return 0;
+        }
+        int descending;
+        i += SORT_FN(run_length)(arr + i, size - i, &descending);
+    }
+
+    //// COPY THE RUNS, TURNED ASCENDING
+    /// Every merge pass at least halves the number of runs, so the passes needed are known, and the copy goes into
+    /// the buffer that makes the last pass end in output. If output is arr itself, the copy is done in place.
+    unsigned int passes = 0;
+    while (((size_t)1 << passes) < runCount) {
+        passes++;
+    }
+    SORT_TYPE* current = (passes % 2 == 0) ? output : work;
+    for (size_t i = 0; i < size;) {
+        int descending;
+        size_t length = SORT_FN(run_length)(arr + i, size - i, &descending);
+        if (descending) {
+            for (size_t a = i, b = i + length - 1; a < b; a++, b--) {
+                SORT_TYPE swap = arr[a];
+                current[a] = arr[b];
+                current[b] = swap;
+            }
+            if (length % 2 == 1) {
+                current[i + length / 2] = arr[i + length / 2];
+            }
+        } else if (current != arr) {
+            memcpy(current + i, arr + i, sizeof(SORT_TYPE) * length);
+        }
+        i += length;
+    }
+
+    //// MERGE NEIGHBOURING RUNS UNTIL ONE IS LEFT
+    /// The runs are found again on every pass, so nothing has to remember where they are. Neighbours that happen to
+    /// be in order after a pass form a single run, which can only save passes.
+    SORT_TYPE* other = (current == output) ? work : output;
+    while (SORT_FN(ascending_length)(current, size) < size) {
+        for (size_t i = 0; i < size;) {
+            size_t middle = i + SORT_FN(ascending_length)(current + i, size - i);
+            size_t end = middle + SORT_FN(ascending_length)(current + middle, size - middle);
+            SORT_FN(merge)(current + i, middle - i, current + middle, end - middle, other + i);
+            i = end;
+        }
+        SORT_TYPE* swap = current;
+        current = other;
+        other = swap;
+    }
+    if (current != output) {
+        memcpy(output, current, sizeof(SORT_TYPE) * size);
+    }
+    return 1;
+}
+
+
+//// MERGE SORT
+
+/// Every level of the recursion merges from one buffer into the other, so a level moves each element
+/// exactly once instead of merging into a scratch buffer and copying the merged elements back.
+/// arr is only read, at the leaves of the recursion; output and work take turns holding the sorted halves.
+
+// Steal group task that sorts the subarray described by a SortingThreadParameters (group and member are ignored)
+static void SORT_FN(merge_sort_task)(StealGroup* group, unsigned int member, void* arg) {
+    SORT_FN(SortingThreadParameters)* params = (SORT_FN(SortingThreadParameters)*) arg;
+    SORT_FN(merge_sort_forked)(group, member, params->subArray, params->output, params->work, params->size);
+}
+
+// The top of the recursion for big partitions: the same halving as merge_sort_into, but the left half is forked as a
+// task, so an idle thread can sort it while this one sorts the right half. Below SORT_FORK_MIN_SIZE, or without a
+// group to share work with, it is merge_sort_into.
+static void SORT_FN(merge_sort_forked)(StealGroup* group, unsigned int member, const SORT_TYPE* arr, SORT_TYPE* output,
+                                       SORT_TYPE* work, size_t size) {
+    if (group == NULL || size <= SORT_FORK_MIN_SIZE) {
+        SORT_FN(merge_sort_into)(arr, output, work, size);
+        return;
+    }
+    size_t mid = size / 2;
+    SORT_FN(SortingThreadParameters) leftHalf = {arr, mid, work, output, group, member};
+    StealTask left = {SORT_FN(merge_sort_task), &leftHalf, 0};
+    steal_fork(group, member, &left);
+    SORT_FN(merge_sort_forked)(group, member, arr + mid, work + mid, output + mid, size - mid);
+    steal_join(group, member, &left);
+    SORT_FN(merge)(work, mid, work + mid, size - mid, output);
+}
+
+// Helper function that recursively breaks the array in half and writes the sorted elements into output
+static void SORT_FN(merge_sort_into)(const SORT_TYPE* arr, SORT_TYPE* output, SORT_TYPE* work, size_t size) {
+    // Base case
+    // Small partitions are moved to the output buffer and insertion sorted there. The cut-off keeps the
+    // recursion from going all the way down to single elements, where call and merge overhead dominate.
+    // With vector kernels, leaves of up to the kernel's leaf size are instead sorted with a sorting network in registers.
+    size_t leafSize = insertionSortThreshold;
+#ifdef SORT_VECTOR_KERNELS
+    const SimdKernels* kernels = SORT_VECTOR_KERNELS;
+    if (kernels->sort_leaf != NULL && kernels->leafSize < leafSize) {
+        leafSize = kernels->leafSize;
+    }
+#endif
+    if (size <= leafSize) {
+#ifdef SORT_VECTOR_KERNELS
+        if (kernels->sort_leaf != NULL) {
+            kernels->sort_leaf(arr, output, size);
+            return;
+        }
+#endif
+        if (output != arr) {
+            memcpy(output, arr, size * sizeof(SORT_TYPE));
+        }
+        SORT_FN(insertion_sort)(output, size);
+        return;
+    }
+    // Get midpoint
+    size_t mid = size / 2;
+    // Sort both halves into the work buffer, using the output buffer as their work space
+    SORT_FN(merge_sort_into)(arr, work, output, mid);
+    SORT_FN(merge_sort_into)(arr + mid, work + mid, output + mid, size - mid);
+    // Merge the sorted halves into output
+    SORT_FN(merge)(work, mid, work + mid, size - mid, output);
+}
+
+// Sorts a small array in place. Each element is moved left past every bigger element before it.
+// The first element is handled separately so the inner loop needs no bounds check when the new element
+// is smaller than everything before it: it is then placed at the front directly.
+static void SORT_FN(insertion_sort)(SORT_TYPE* arr, size_t size) {
+    for (size_t i = 1; i < size; i++) {
+        SORT_TYPE value = arr[i];
+        if (SORT_LESS(value, arr[0])) {
+            memmove(arr + 1, arr, i * sizeof(SORT_TYPE));
+            arr[0] = value;
+            continue;
+        }
+        size_t j = i;
+        while (SORT_LESS(value, arr[j - 1])) {
+            arr[j] = arr[j - 1];
+            j--;
+        }
+        arr[j] = value;
+    }
+}
+
+// Galloping search: the number of elements at the start of the sorted run that are less than key (strict), or not
+// greater than key (not strict). It probes positions 1, 3, 7, 15, ... before a binary search in the last gap, so
+// finding n elements costs O(log n) comparisons, however long the run is.
+static size_t SORT_FN(gallop)(const SORT_TYPE* run, size_t size, SORT_TYPE key, int strict) {
+#define SORT_GALLOP_TAKES(element) (strict ? SORT_LESS(element, key) : !SORT_LESS(key, element))
+    // run[0..low) are known to be taken
+    size_t low = 0;
+    size_t step = 1;
+    while (low + step <= size && SORT_GALLOP_TAKES(run[low + step - 1])) {
+        low += step;
+        step *= 2;
+    }
+    size_t high = low + step <= size ? low + step - 1 : size;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (SORT_GALLOP_TAKES(run[middle])) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+#undef SORT_GALLOP_TAKES
+}
+
+// Merges two sorted runs into output, which must have room for leftSize + rightSize elements
+static void SORT_FN(merge)(const SORT_TYPE* left, size_t leftSize, const SORT_TYPE* right, size_t rightSize, SORT_TYPE* output) {
+    // Runs that are in order already, as neighbouring pieces of presorted input are, only need to be copied
+    if (leftSize == 0 || rightSize == 0 || !SORT_LESS(right[0], left[leftSize - 1])) {
+        memcpy(output, left, sizeof(SORT_TYPE) * leftSize);
+        memcpy(output + leftSize, right, sizeof(SORT_TYPE) * rightSize);
+        return;
+    }
+
+#ifdef SORT_VECTOR_KERNELS
+    // The vector merge takes one data-dependent branch per vector of output instead of one per element, so it
+    // avoids most of the mispredictions the loop below suffers on random keys. It needs at least one full vector in each run.
+    const SimdKernels* kernels = SORT_VECTOR_KERNELS;
+    if (kernels->merge != NULL && leftSize >= kernels->lanes && rightSize >= kernels->lanes) {
+        kernels->merge(left, leftSize, right, rightSize, output);
+        return;
+    }
+#endif
+
+    // Initialize three indices.
+    // i starts at the beginning of the left sorted run.
+    // j starts at the beginning of the right sorted run.
+    // k is used to track the current position in the output array where the
+    // next smallest element from either run will be placed.
+    size_t i = 0, j = 0, k = 0;
+
+    // Continues as long as there are elements in both runs yet to be compared and merged.
+    // The elements are merged in blocks of MERGE_GALLOP_AFTER, so the loop that compares them stays as simple as it
+    // can be on random keys.
+    while (i < leftSize && j < rightSize) {
+        size_t blockLeft = i, blockRight = j;
+        for (size_t step = 0; step < MERGE_GALLOP_AFTER && i < leftSize && j < rightSize; step++) {
+            // Compares the current elements of both runs.
+            // If the element in the left run (left[i]) is smaller or equal,
+            // it is placed into the output array at k, and both i and k are incremented.
+            // If the element in the right run (right[j]) is smaller,
+            // it is placed into output at k, and both j and k are incremented.
+            // This ensures that the merged array is in ascending order, and taking the left element on ties keeps
+            // equal elements in their original order: the sort is stable.
+            if (!SORT_LESS(right[j], left[i])) {
+                output[k++] = left[i++];
+            } else {
+                output[k++] = right[j++];
+            }
+        }
+        if (i == leftSize || j == rightSize) {
+            break;
+        }
+
+        // Galloping: a run that won a whole block, as with nearly sorted input, probably goes on winning for a while.
+        // Find where its streak ends with a galloping search and copy the whole streak at once.
+        size_t n = 0;
+        if (i - blockLeft == MERGE_GALLOP_AFTER) {
+            n = SORT_FN(gallop)(left + i, leftSize - i, right[j], 0);
+            memcpy(output + k, left + i, sizeof(SORT_TYPE) * n);
+            i += n;
+        } else if (j - blockRight == MERGE_GALLOP_AFTER) {
+            n = SORT_FN(gallop)(right + j, rightSize - j, left[i], 1);
+            memcpy(output + k, right + j, sizeof(SORT_TYPE) * n);
+            j += n;
+        }
+        k += n;
+    }
+    // if any elements are left in the left or right run after the main loop exits,
+    // these loops adds the remaining elements from the runs to output.
+    while (i < leftSize) {
+        output[k++] = left[i++];
+    }
+    while (j < rightSize) {
+        output[k++] = right[j++];
+    }
+}
+
+// Co-ranking (merge path) split point search.
+// Returns how many of the first k elements of merge(left, right) come from left; the other k - i come from right.
+// The answer agrees with merge(), which takes the left element on ties, so slices that are merged
+// independently with these split points line up exactly with a single merge of both runs.
+static size_t SORT_FN(co_rank)(size_t k, const SORT_TYPE* left, size_t leftSize, const SORT_TYPE* right, size_t rightSize) {
+    // i can only range over values that leave between 0 and rightSize elements for the right run
+    size_t low = k > rightSize ? k - rightSize : 0;
+    size_t high = k < leftSize ? k : leftSize;
+
+    // Binary search for the smallest i for which the last element taken from right (right[k - i - 1])
+    // is smaller than the next element of left (left[i]); with fewer left elements, the split would be too early.
+    while (low < high) {
+        size_t i = low + (high - low) / 2;
+        size_t j = k - i;
+        if (j > 0 && i < leftSize && !SORT_LESS(right[j - 1], left[i])) {
+            low = i + 1;
+        } else {
+            high = i;
+        }
+    }
+    return low;
+}
+
+
+#ifndef SORT_PRIVATE
+//// TWO-RUN MERGE
+/// Merges two sorted runs with the merging threads of the merge tree: one pair, with the output cut into one slice
+/// per thread. Used through the element type descriptor, e.g. by the sorted streams of mtsort.h.
+
+static void SORT_FN(merge_runs_with)(const SORT_TYPE* left, size_t leftCount, const SORT_TYPE* right, size_t rightCount,
+                                    SORT_TYPE* output, unsigned int threads, const SortResources* resources) {
+    // Slices smaller than a forked sort are not worth a task
+    size_t count = leftCount + rightCount;
+    if (threads > count / SORT_FORK_MIN_SIZE) {
+        threads = (unsigned int)(count / SORT_FORK_MIN_SIZE);
+    }
+    Arena* arena = resources->arena;
+    SORT_FN(MergingThreadParameters)* paramsMerge = threads > 1 ? arena_alloc(arena, sizeof(*paramsMerge) * threads) : NULL;
+    if (paramsMerge == NULL) {
+        // A single thread, or no memory for the parameters of the tasks: the calling thread merges on its own
+        TraceSpan merging = trace_span_begin(resources->trace);
+        SORT_FN(merge)(left, leftCount, right, rightCount, output);
+        trace_span_end(resources->trace, "merge", 0, &merging);
+        return;
+    }
+    SORT_FN(MergePair) pair = {
+        {left, leftCount, NULL, NULL, NULL, 0}, {right, rightCount, NULL, NULL, NULL, 0}, output,
+    };
+    for (unsigned int w = 0; w < threads; w++) {
+        paramsMerge[w].pairs = &pair;
+        paramsMerge[w].pairCount = 1;
+        paramsMerge[w].destination = output;
+        paramsMerge[w].begin = slice_begin(w, count, threads, sizeof(SORT_TYPE));
+        paramsMerge[w].end = slice_begin(w + 1, count, threads, sizeof(SORT_TYPE));
+    }
+    trace_run(resources->trace, "merge", 0, resources->pool, SORT_FN(merging_thread), paramsMerge,
+              sizeof(*paramsMerge), threads);
+    arena_free(arena, paramsMerge);
+}
+
+
+//// K-WAY MERGE
+/// A binary min-heap holds the head element of every cursor, so each output element costs O(log k) comparisons.
+/// The heap is rebuilt on every call, which is cheap next to the buffer of elements merged per call.
+
+// One heap entry: the head element of a cursor and the index of that cursor
+typedef struct {
+    SORT_TYPE key;
+    size_t cursor;
+} SORT_FN(HeapEntry);
+
+// Heap order: smaller key first, and the earlier cursor first on ties so equal keys keep the order of their runs
+static inline int SORT_FN(heap_before)(const SORT_FN(HeapEntry)* a, const SORT_FN(HeapEntry)* b) {
+    return SORT_LESS(a->key, b->key) || (!SORT_LESS(b->key, a->key) && a->cursor < b->cursor);
+}
+
+// Moves heap[index] down until neither child belongs before it
+static void SORT_FN(heap_sift_down)(SORT_FN(HeapEntry)* heap, size_t size, size_t index) {
+    for (;;) {
+        size_t smallest = index;
+        size_t left = 2 * index + 1;
+        size_t right = left + 1;
+        if (left < size && SORT_FN(heap_before)(&heap[left], &heap[smallest])) {
+            smallest = left;
+        }
+        if (right < size && SORT_FN(heap_before)(&heap[right], &heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            return;
+        }
+        SORT_FN(HeapEntry) swap = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = swap;
+        index = smallest;
+    }
+}
+
+size_t SORT_FN(kway_merge)(MergeCursor* cursors, size_t cursorCount, SORT_TYPE* output, size_t capacity) {
+    SORT_FN(HeapEntry) heap[KWAY_MAX_CURSORS];
+    size_t size = cursorCount < KWAY_MAX_CURSORS ? cursorCount : KWAY_MAX_CURSORS;
+
+    // Build the heap from the head of every cursor
+    for (size_t c = 0; c < size; c++) {
+        heap[c].key = *(const SORT_TYPE*)cursors[c].next;
+        heap[c].cursor = c;
+    }
+    for (size_t i = size / 2; i-- > 0;) {
+        SORT_FN(heap_sift_down)(heap, size, i);
+    }
+
+    // Repeatedly move the smallest head to the output and replace it with the next element of its cursor
+    size_t written = 0;
+    while (written < capacity) {
+        MergeCursor* cursor = &cursors[heap[0].cursor];
+        output[written++] = heap[0].key;
+        cursor->next = (const SORT_TYPE*)cursor->next + 1;
+        cursor->remaining--;
+        if (cursor->remaining == 0) {
+            break;
+        }
+        heap[0].key = *(const SORT_TYPE*)cursor->next;
+        SORT_FN(heap_sift_down)(heap, size, 0);
+    }
+    return written;
+}
+
+
+//// ELEMENT TYPE DESCRIPTOR
+/// The untyped wrappers only cast their arguments, so the descriptor adds no work per element.
+
+static int SORT_FN(parallel_sort_untyped)(const void* input, void* output, size_t count, unsigned int threads) {
+    return SORT_FN(parallel_sort)(input, output, count, threads);
+}
+
+static int SORT_FN(parallel_sort_with_untyped)(const void* input, void* output, size_t count, unsigned int threads,
+                                               const SortResources* resources) {
+    return SORT_FN(parallel_sort_with)(input, output, count, threads, resources);
+}
+
+static void SORT_FN(merge_runs_with_untyped)(const void* left, size_t leftCount, const void* right, size_t rightCount,
+                                             void* output, unsigned int threads, const SortResources* resources) {
+    SORT_FN(merge_runs_with)(left, leftCount, right, rightCount, output, threads, resources);
+}
+
+static size_t SORT_FN(kway_merge_untyped)(MergeCursor* cursors, size_t cursorCount, void* output, size_t capacity) {
+    return SORT_FN(kway_merge)(cursors, cursorCount, output, capacity);
+}
+
+static size_t SORT_FN(upper_bound_untyped)(const void* sorted, size_t count, const void* key) {
+    const SORT_TYPE* elements = sorted;
+    const SORT_TYPE* value = key;
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (SORT_LESS(*value, elements[middle])) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+const SortType SORT_FN(sort_type) = {
+    SORT_STRING(SORT_SUFFIX),
+    sizeof(SORT_TYPE),
+    SORT_FN(parallel_sort_untyped),
+    SORT_FN(parallel_sort_with_untyped),
+    SORT_FN(partial_sort_with_untyped),
+    SORT_FN(nth_element_with_untyped),
+    SORT_FN(merge_runs_with_untyped),
+    SORT_FN(kway_merge_untyped),
+    SORT_FN(argsort_with_untyped),
+    SORT_FN(upper_bound_untyped),
+};
+#endif
+
+
+#undef SORT_FN
+#undef SORT_STRING
+#undef SORT_STRING_
+#undef SORT_CONCAT
+#undef SORT_CONCAT_
+#undef SORT_TYPE
+#undef SORT_SUFFIX
+#undef SORT_LESS
+#undef SORT_KEY
+#undef SORT_RADIX_KEY
+#undef SORT_RADIX_SIGNED
+#undef SORT_VECTOR_KERNELS
+#undef SORT_NARROW
+#undef SORT_PRIVATE
+#undef NARROW_TOO_WIDE
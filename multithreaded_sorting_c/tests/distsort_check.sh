@@ -0,0 +1,83 @@
+#!/bin/sh
+# Runs distributed sorts (-D) of two and three ranks on loopback ports, and checks that the shards of the ranks,
+# concatenated in rank order, are the in-memory sort of their inputs concatenated in rank order.
+# Usage: distsort_check.sh path/to/multithreaded_sorting_c
+set -u
+main=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failures=0
+# A port range of its own for every run of the script, so that runs at the same time do not meet
+port=$((20000 + $$ % 20000))
+
+fail() {
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+# check NAME TYPE INPUT...: sorts the inputs, one per rank, and compares the shards with the in-memory sort
+check() {
+    name=$1
+    type=$2
+    shift 2
+    ranks=$#
+    nodes=""
+    rank=0
+    for input in "$@"; do
+        nodes="$nodes${nodes:+,}127.0.0.1:$((port + rank))"
+        rank=$((rank + 1))
+    done
+    port=$((port + ranks))
+
+    rank=0
+    pids=""
+    for input in "$@"; do
+        "$main" -f "$type" -t 2 -D "$nodes" -R "$rank" -i "$input" -o "$dir/shard$rank" &
+        pids="$pids $!"
+        rank=$((rank + 1))
+    done
+    status=0
+    for pid in $pids; do
+        wait "$pid" || status=1
+    done
+    if [ "$status" -ne 0 ]; then
+        fail "$name: a rank failed"
+        return
+    fi
+
+    cat "$@" > "$dir/all"
+    "$main" -f "$type" -i "$dir/all" -o "$dir/expected"
+    : > "$dir/actual"
+    rank=0
+    while [ "$rank" -lt "$ranks" ]; do
+        cat "$dir/shard$rank" >> "$dir/actual"
+        rank=$((rank + 1))
+    done
+    if ! cmp -s "$dir/expected" "$dir/actual"; then
+        fail "$name: the shards are not the sorted input"
+    fi
+}
+
+head -c 800000 /dev/urandom > "$dir/a"
+head -c 1600000 /dev/urandom > "$dir/b"
+head -c 240000 /dev/urandom > "$dir/c"
+head -c 800000 /dev/zero > "$dir/zeros"
+: > "$dir/empty"
+
+check "three ranks" u64 "$dir/a" "$dir/b" "$dir/c"
+check "two ranks" i32 "$dir/b" "$dir/a"
+check "pairs" kv_u64 "$dir/a" "$dir/c" "$dir/b"
+check "floats" f64 "$dir/c" "$dir/a"
+check "an empty input" i64 "$dir/a" "$dir/empty" "$dir/b"
+check "all inputs empty" u32 "$dir/empty" "$dir/empty" "$dir/empty"
+# All keys are equal, so they all go to one rank, and the others receive empty ranges
+check "all-equal keys" i64 "$dir/zeros" "$dir/zeros" "$dir/zeros"
+check "one rank" u64 "$dir/a"
+
+# A rank that is not in the list fails at once
+if "$main" -f u64 -D "127.0.0.1:$port" -R 1 -i "$dir/a" -o "$dir/shard0" 2> /dev/null; then
+    fail "rank 1 of one node was accepted"
+fi
+
+[ "$failures" -eq 0 ] && echo "distsort: all checks passed"
+[ "$failures" -eq 0 ]
@@ -0,0 +1,195 @@
+#!/bin/sh
+# Checks the in-memory sort of the command line front end against sort(1), over random, all-equal and small-range
+# inputs, for every algorithm (-a), with the scalar and the vector kernels (-k) and with key narrowing on and off (-w).
+# Usage: engine_check.sh path/to/multithreaded_sorting_c
+#   - integer types are compared with sort -n of their values as text, pairs and records with a stable sort by key
+#   - floats, whose random bit patterns include NaNs, are compared with one fixed configuration instead
+#   - the k smallest (-K), one rank (-N), batches (-b), indices (-A) and records sorted by fields (-C) are checked
+#     against the same references
+set -u
+main=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failures=0
+# sort(1) and awk compare and print bytes, not characters
+LC_ALL=C
+export LC_ALL
+
+fail() {
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+# Every vector kernel set that this CPU supports, besides scalar
+kernels="auto"
+for kernel in avx512 avx2 neon; do
+    if "$main" -k "$kernel" > /dev/null 2>&1; then
+        kernels="$kernels $kernel"
+    fi
+done
+
+# od type of the values of every element type that sort -n can order
+od_type() {
+    case $1 in
+        i32) echo d4 ;;
+        i64) echo d8 ;;
+        u32) echo u4 ;;
+        u64) echo u8 ;;
+        kv_i64) echo d8 ;;
+        kv_u64) echo u8 ;;
+    esac
+}
+
+# element_size TYPE
+element_size() {
+    case $1 in
+        i32 | u32 | f32) echo 4 ;;
+        i64 | u64 | f64) echo 8 ;;
+        kv_i64 | kv_u64) echo 16 ;;
+    esac
+}
+
+# text TYPE FILE: one element per line, the key first, as sort(1) reads them
+text() {
+    size=$(element_size "$1")
+    od -An -v -t "$(od_type "$1")" -w"$size" "$2"
+}
+
+# reference TYPE INPUT OUTPUT: the elements of INPUT as text, stably sorted by their key
+reference() {
+    text "$1" "$2" | sort -s -n -k1,1 > "$3"
+}
+
+# run NAME TYPE INPUT EXPECTED OPTIONS...: sorts INPUT with OPTIONS, and compares the result, as text, with EXPECTED
+run() {
+    name=$1
+    type=$2
+    input=$3
+    expected=$4
+    shift 4
+    if ! "$main" -t 4 -f "$type" "$@" -i "$input" -o "$dir/actual"; then
+        fail "$name: $type with $* did not sort"
+    elif ! text "$type" "$dir/actual" | cmp -s "$expected" -; then
+        fail "$name: $type with $* differs from sort(1)"
+    fi
+}
+
+# check NAME TYPE INPUT: sorts INPUT with every algorithm, kernel set and narrowing setting. The scalar merge sort is
+# compared with sort(1), and every other sort with its output, byte for byte.
+check() {
+    reference "$2" "$3" "$dir/expected"
+    run "$1" "$2" "$3" "$dir/expected" -a merge -k scalar -w off
+    mv "$dir/actual" "$dir/sorted"
+    for algorithm in auto merge radix sample; do
+        for kernel in scalar $kernels; do
+            for narrowing in on off; do
+                if ! "$main" -t 4 -f "$2" -a "$algorithm" -k "$kernel" -w "$narrowing" -i "$3" -o "$dir/actual"; then
+                    fail "$1: $2 with -a $algorithm -k $kernel -w $narrowing did not sort"
+                elif ! cmp -s "$dir/sorted" "$dir/actual"; then
+                    fail "$1: $2 with -a $algorithm -k $kernel -w $narrowing differs from sort(1)"
+                fi
+            done
+        done
+    done
+}
+
+# check_float NAME TYPE INPUT: sorts INPUT with every algorithm and kernel set, and compares with the merge sort
+check_float() {
+    if ! "$main" -f "$2" -a merge -k scalar -i "$3" -o "$dir/expected"; then
+        fail "$1: $2 did not sort"
+        return
+    fi
+    for algorithm in auto radix sample; do
+        for kernel in scalar $kernels; do
+            if ! "$main" -t 4 -f "$2" -a "$algorithm" -k "$kernel" -i "$3" -o "$dir/actual"; then
+                fail "$1: $2 with -a $algorithm -k $kernel did not sort"
+            elif ! cmp -s "$dir/expected" "$dir/actual"; then
+                fail "$1: $2 with -a $algorithm -k $kernel differs from the merge sort"
+            fi
+        done
+    done
+}
+
+# check_selections NAME TYPE INPUT: the k smallest, ranks, batches and indices, against the stable sort of INPUT
+check_selections() {
+    name=$1
+    type=$2
+    input=$3
+    reference "$type" "$input" "$dir/expected"
+    count=$(wc -l < "$dir/expected")
+    for k in 1 100 $((count / 3)) "$count"; do
+        head -n "$k" "$dir/expected" > "$dir/smallest"
+        run "$name" "$type" "$input" "$dir/smallest" -K "$k"
+    done
+    for rank in 0 $((count / 2)) $((count - 1)); do
+        sed -n "$((rank + 1))p" "$dir/expected" > "$dir/element"
+        run "$name" "$type" "$input" "$dir/element" -N "$rank"
+    done
+    for batch in 1000 $((count / 3 + 1)); do
+        run "$name" "$type" "$input" "$dir/expected" -b "$batch"
+    done
+    # The permutation of the stable sort: the input positions of its elements, in sorted order
+    text "$type" "$input" | awk '{ print $1, NR - 1 }' | sort -s -n -k1,1 | awk '{ print $2 }' > "$dir/indices"
+    for width in 32 64; do
+        if ! "$main" -t 4 -f "$type" -A "$width" -i "$input" -o "$dir/actual"; then
+            fail "$name: $type with -A $width did not sort"
+        elif ! od -An -v -t u$((width / 8)) -w$((width / 8)) "$dir/actual" | awk '{ print $1 }' | cmp -s "$dir/indices" -; then
+            fail "$name: $type with -A $width differs from sort(1)"
+        fi
+    done
+}
+
+# check_records NAME INPUT SORTKEYS OPTIONS...: sorts 16-byte records, seen as four u32 fields, with OPTIONS, and
+# compares them with sort -s SORTKEYS
+check_records() {
+    name=$1
+    input=$2
+    keys=$3
+    shift 3
+    # The keys are separate words for sort
+    od -An -v -t u4 -w16 "$input" | sort -s $keys > "$dir/expected"
+    if ! "$main" -t 4 -f rec16 "$@" -i "$input" -o "$dir/actual"; then
+        fail "$name: records with $* did not sort"
+    elif ! od -An -v -t u4 -w16 "$dir/actual" | cmp -s "$dir/expected" -; then
+        fail "$name: records with $* differ from sort(1)"
+    fi
+}
+
+head -c 1048576 /dev/urandom > "$dir/random"
+head -c 1048576 /dev/zero > "$dir/equal"
+# Keys below 2^11 in their two low bytes (native little-endian) and zeros above, so that every type's keys can be
+# narrowed, with many equal ones. The sort is the same on big-endian CPUs, which just do not narrow them.
+head -c 131072 /dev/urandom | od -An -v -t u1 |
+    awk '{ for (i = 1; i <= NF; i++) printf "%c%c%c%c%c%c%c%c", $i, $i % 8, 0, 0, 0, 0, 0, 0 }' > "$dir/small"
+# Below the radix sort and narrowing thresholds, and a few elements, for the insertion sort
+head -c 40000 /dev/urandom > "$dir/short"
+head -c 48 /dev/urandom > "$dir/tiny"
+: > "$dir/empty"
+
+for type in i32 u32 i64 u64 kv_i64 kv_u64; do
+    for data in random equal small short tiny empty; do
+        check "$data" "$type" "$dir/$data"
+    done
+done
+for type in f32 f64; do
+    for data in random equal short; do
+        check_float "$data" "$type" "$dir/$data"
+    done
+done
+
+for type in i32 u64 kv_i64; do
+    for data in random small; do
+        check_selections "$data" "$type" "$dir/$data"
+    done
+done
+
+# Records: by their leading u64 key, and by fields, the u32 at offset 8, descending, then the one at offset 0
+for data in random small; do
+    check_records "$data" "$dir/$data" "-k2,2n -k1,1n"
+    check_records "$data" "$dir/$data" "-k2,2n -k1,1n" -C "u64@0"
+    check_records "$data" "$dir/$data" "-k3,3nr -k1,1n" -C "-u32@8,u32@0"
+    check_records "$data" "$dir/$data" "-k4,4n" -C "u32@12"
+done
+
+[ "$failures" -eq 0 ] && echo "engine: all checks passed"
+[ "$failures" -eq 0 ]
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Checks the external sort (-m) against the in-memory sort of the same input.
+# Usage: extsort_check.sh path/to/multithreaded_sorting_c
+#   - a 64K budget: chunks of about 21K and a fan-in of 2, so about a hundred runs and several merge passes
+#   - a budget bigger than the input: the shortcut that sorts the only chunk in place
+#   - an empty input, and one that is not a whole number of elements, which must fail
+set -u
+main=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failures=0
+
+fail() {
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+# check TYPE BUDGET INPUT: sorts INPUT externally and in memory, and compares the two
+check() {
+    if ! "$main" -f "$1" -i "$3" -o "$dir/expected" || ! "$main" -f "$1" -m "$2" -T "$dir" -i "$3" -o "$dir/actual"; then
+        fail "$1 with a budget of $2 did not sort $3"
+    elif ! cmp -s "$dir/expected" "$dir/actual"; then
+        fail "$1 with a budget of $2 sorted $3 differently from the in-memory sort"
+    fi
+}
+
+head -c 2097152 /dev/urandom > "$dir/random"
+check u64 64K "$dir/random"
+check i32 64K "$dir/random"
+check kv_u64 64K "$dir/random"
+check f64 1M "$dir/random"
+check i64 64M "$dir/random"
+
+# Few distinct keys, so runs meet equal keys at every merge
+head -c 2097152 /dev/zero > "$dir/equal"
+check i64 64K "$dir/equal"
+
+: > "$dir/empty"
+check u32 64K "$dir/empty"
+
+head -c 1003 /dev/urandom > "$dir/partial"
+if "$main" -f u64 -m 64K -T "$dir" -i "$dir/partial" -o "$dir/actual" 2> /dev/null; then
+    fail "an input of 1003 bytes was sorted as 8-byte elements"
+fi
+
+# Temporary run files are unlinked as soon as they are created
+if [ -n "$(ls "$dir" | grep -v -e random -e equal -e empty -e partial -e expected -e actual)" ]; then
+    fail "temporary files were left behind in $dir"
+fi
+
+[ "$failures" -eq 0 ] && echo "extsort: all checks passed"
+[ "$failures" -eq 0 ]
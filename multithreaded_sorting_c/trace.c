@@ -0,0 +1,275 @@
+//// SORT TRACING
+/// See trace.h. Only the thread that starts a sort adds records: trace_run reserves a record for the batch and one
+/// per task before it hands the tasks to the pool, and every task fills in its own record, so the tasks need no lock.
+
+// For syscall and the thread id
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Records the first growth of a trace makes room for
+#define TRACE_INITIAL_RECORDS 256
+
+// A phase (task == TRACE_NO_TASK) or a task of a phase
+#define TRACE_NO_TASK ((size_t)-1)
+
+typedef struct {
+    const char* phase;
+    unsigned int level;
+    size_t task;
+    long thread;
+    uint64_t start;
+    uint64_t wall;
+    uint64_t counters[TRACE_COUNTER_COUNT];
+    int counted;
+} TraceRecord;
+
+struct SortTrace {
+    int flags;
+    // Clock time the trace started at
+    uint64_t origin;
+    TraceRecord* records;
+    size_t count;
+    size_t capacity;
+};
+
+// What a task of a traced batch runs, in place of the batch's routine
+typedef struct {
+    SortTrace* trace;
+    void* (*routine)(void*);
+    void* arg;
+    TraceRecord* record;
+} TraceTask;
+
+
+//// CLOCK, THREADS AND COUNTERS
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ull + (uint64_t)time.tv_nsec;
+}
+
+static long thread_id(void) {
+#ifdef __linux__
+    return (long)syscall(SYS_gettid);
+#else
+    return 0;
+#endif
+}
+
+// The counter group of the calling thread: the file of its leader, -1 before the first attempt to open it, or -2 if
+// that failed. It is opened once per thread, since a sort runs on the same few pool threads over and over.
+static _Thread_local int counterGroup = -1;
+
+#ifdef __linux__
+static int open_counter(uint64_t config, int group) {
+    struct perf_event_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.size = sizeof(attributes);
+    attributes.config = config;
+    attributes.read_format = PERF_FORMAT_GROUP;
+    // Counting user space only keeps the counters available to unprivileged processes (perf_event_paranoid 2)
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    // The calling thread, on whatever CPU it runs
+    return (int)syscall(SYS_perf_event_open, &attributes, 0, -1, group, 0);
+}
+#endif
+
+// Reads the counters of the calling thread into counters. Returns 1, or 0 if they are not available.
+static int read_counters(const SortTrace* trace, uint64_t* counters) {
+#ifdef __linux__
+    if (trace == NULL || !(trace->flags & SORT_TRACE_COUNTERS) || counterGroup == -2) {
+        return 0;
+    }
+    if (counterGroup == -1) {
+        static const uint64_t events[TRACE_COUNTER_COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+        };
+        int leader = open_counter(events[0], -1);
+        for (int e = 1; leader >= 0 && e < TRACE_COUNTER_COUNT; e++) {
+            if (open_counter(events[e], leader) < 0) {
+                // Closing the leader leaves the members without a group, which stops them counting too
+                close(leader);
+                leader = -1;
+            }
+        }
+        counterGroup = leader >= 0 ? leader : -2;
+        if (leader < 0) {
+            return 0;
+        }
+    }
+    // With PERF_FORMAT_GROUP, a read gives the number of counters followed by their values
+    uint64_t values[1 + TRACE_COUNTER_COUNT];
+    if (read(counterGroup, values, sizeof(values)) != (ssize_t)sizeof(values)) {
+        return 0;
+    }
+    memcpy(counters, values + 1, sizeof(uint64_t) * TRACE_COUNTER_COUNT);
+    return 1;
+#else
+    (void)trace;
+    (void)counters;
+    return 0;
+#endif
+}
+
+
+//// TRACES
+
+SortTrace* sort_trace_create(int flags) {
+    SortTrace* trace = calloc(1, sizeof(*trace));
+    if (trace == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the sort trace.\n");
+        return NULL;
+    }
+    trace->flags = flags;
+    trace->origin = now_ns();
+    return trace;
+}
+
+
+void sort_trace_destroy(SortTrace* trace) {
+    if (trace == NULL) {
+        return;
+    }
+    free(trace->records);
+    free(trace);
+}
+
+
+void sort_trace_reset(SortTrace* trace) {
+    trace->count = 0;
+    trace->origin = now_ns();
+}
+
+
+int sort_trace_print(const SortTrace* trace, FILE* file) {
+    fprintf(file, "phase,level,task,thread,start_ns,wall_ns,cycles,llc_misses,branch_misses\n");
+    for (size_t r = 0; r < trace->count; r++) {
+        const TraceRecord* record = &trace->records[r];
+        fprintf(file, "%s,", record->phase);
+        if (record->level > 0) {
+            fprintf(file, "%u", record->level);
+        }
+        fprintf(file, ",");
+        if (record->task != TRACE_NO_TASK) {
+            fprintf(file, "%zu", record->task);
+        }
+        fprintf(file, ",%ld,%llu,%llu,", record->thread, (unsigned long long)record->start,
+                (unsigned long long)record->wall);
+        if (record->counted) {
+            fprintf(file, "%llu,%llu,%llu\n", (unsigned long long)record->counters[0],
+                    (unsigned long long)record->counters[1], (unsigned long long)record->counters[2]);
+        } else {
+            fprintf(file, ",,\n");
+        }
+    }
+    return ferror(file) ? -1 : 0;
+}
+
+// Makes room for count more records and returns the first, or NULL if the records could not be grown
+static TraceRecord* reserve(SortTrace* trace, size_t count) {
+    if (trace->count + count > trace->capacity) {
+        size_t capacity = trace->capacity > 0 ? trace->capacity : TRACE_INITIAL_RECORDS;
+        while (capacity < trace->count + count) {
+            capacity *= 2;
+        }
+        TraceRecord* grown = realloc(trace->records, sizeof(TraceRecord) * capacity);
+        if (grown == NULL) {
+            return NULL;
+        }
+        trace->records = grown;
+        trace->capacity = capacity;
+    }
+    TraceRecord* first = trace->records + trace->count;
+    trace->count += count;
+    return first;
+}
+
+
+//// RECORDING
+
+static void* trace_task(void* arg) {
+    TraceTask* task = (TraceTask*) arg;
+    TraceRecord* record = task->record;
+    uint64_t before[TRACE_COUNTER_COUNT];
+    int counting = read_counters(task->trace, before);
+    uint64_t start = now_ns();
+    task->routine(task->arg);
+    record->wall = now_ns() - start;
+    record->start = start - task->trace->origin;
+    record->thread = thread_id();
+    record->counted = counting && read_counters(task->trace, record->counters);
+    for (int c = 0; record->counted && c < TRACE_COUNTER_COUNT; c++) {
+        record->counters[c] -= before[c];
+    }
+    return NULL;
+}
+
+
+void trace_run(SortTrace* trace, const char* phase, unsigned int level, ThreadPool* pool, void* (*routine)(void*),
+               void* args, size_t argSize, size_t count) {
+    TraceTask* tasks = trace != NULL ? malloc(sizeof(TraceTask) * (count > 0 ? count : 1)) : NULL;
+    TraceRecord* records = tasks != NULL ? reserve(trace, count + 1) : NULL;
+    if (records == NULL) {
+        // Untraced, or out of memory for the records: the work still has to be done
+        free(tasks);
+        pool_run(pool, routine, args, argSize, count);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        tasks[i].trace = trace;
+        tasks[i].routine = routine;
+        tasks[i].arg = (char*)args + i * argSize;
+        tasks[i].record = &records[i + 1];
+        records[i + 1].phase = phase;
+        records[i + 1].level = level;
+        records[i + 1].task = i;
+    }
+    uint64_t start = now_ns();
+    pool_run(pool, trace_task, tasks, sizeof(*tasks), count);
+    records[0] = (TraceRecord){phase, level, TRACE_NO_TASK, thread_id(), start - trace->origin, now_ns() - start, {0}, 0};
+    free(tasks);
+}
+
+
+TraceSpan trace_span_begin(const SortTrace* trace) {
+    TraceSpan span = {0, {0}, 0};
+    if (trace != NULL) {
+        span.counting = read_counters(trace, span.counters);
+        span.start = now_ns();
+    }
+    return span;
+}
+
+
+void trace_span_end(SortTrace* trace, const char* phase, unsigned int level, const TraceSpan* span) {
+    if (trace == NULL) {
+        return;
+    }
+    uint64_t end = now_ns();
+    TraceRecord* record = reserve(trace, 1);
+    if (record == NULL) {
+        return;
+    }
+    *record = (TraceRecord){phase, level, TRACE_NO_TASK, thread_id(), span->start - trace->origin, end - span->start, {0}, 0};
+    record->counted = span->counting && read_counters(trace, record->counters);
+    for (int c = 0; record->counted && c < TRACE_COUNTER_COUNT; c++) {
+        record->counters[c] -= span->counters[c];
+    }
+}
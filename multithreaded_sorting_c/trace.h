@@ -0,0 +1,72 @@
+//// SORT TRACING
+/// Records where the time of a sort goes: the wall time of every phase (the setup of the partitions, the leaf sort,
+/// every merge level, radix passes, copies, the key range and narrowing passes), and of every task of a phase, on
+/// the thread that ran it, so imbalance between threads shows up as tasks of one phase that take very different
+/// times. Optionally, each task also reads the hardware counters of its thread (cycles, last level cache misses,
+/// branch misses) through perf_event, which tells a merge that is limited by memory bandwidth from one that is
+/// limited by mispredictions.
+///
+/// A trace is handed to the engine in the SortResources of a sort (see sort.h), e.g. by mtsort_set_trace, and costs
+/// nothing when there is none. It records one sort at a time; several sorts in a row add up in the same trace.
+/// sort_trace_print writes the records as CSV, one row per phase and one per task:
+///     phase, level, task, thread, start_ns, wall_ns, cycles, llc_misses, branch_misses
+/// level numbers the phases that repeat, such as merge levels and radix passes, from 1 (empty for the others).
+/// task is empty on the row of a whole phase, which is timed on the thread that started the sort. thread is the
+/// kernel thread id. start_ns counts from the creation (or last reset) of the trace. The counters of a phase that
+/// runs on the pool are on the rows of its tasks. The counter columns are empty when counters were not asked for, or
+/// the system does not allow reading them (see perf_event_paranoid).
+
+#ifndef MULTITHREADED_SORTING_TRACE_H
+#define MULTITHREADED_SORTING_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "pool.h"
+
+typedef struct SortTrace SortTrace;
+
+// Flags of sort_trace_create
+#define SORT_TRACE_COUNTERS 1
+
+// Creates an empty trace. With SORT_TRACE_COUNTERS, tasks also read the hardware counters of their thread; each
+// thread opens its counters on its first traced task and keeps them open until it exits.
+// Returns NULL, after printing the reason to stderr, if the trace could not be allocated.
+SortTrace* sort_trace_create(int flags);
+
+// Frees the trace. NULL is ignored.
+void sort_trace_destroy(SortTrace* trace);
+
+// Drops all records and restarts the clock
+void sort_trace_reset(SortTrace* trace);
+
+// Writes the records as CSV, with a header line, to file. Returns 0, or -1 if writing failed.
+int sort_trace_print(const SortTrace* trace, FILE* file);
+
+
+//// RECORDING
+/// Used by the engine, and by callers that want to time their own steps around a sort in the same trace.
+/// phase must be a string that outlives the trace, such as a literal. level is 0 for phases that do not repeat.
+/// All of these accept a NULL trace, and then only do the work.
+
+// Runs a batch of tasks like pool_run, and records the batch as a phase and each task on its own
+void trace_run(SortTrace* trace, const char* phase, unsigned int level, ThreadPool* pool, void* (*routine)(void*),
+               void* args, size_t argSize, size_t count);
+
+// Cycles, last level cache misses and branch misses
+#define TRACE_COUNTER_COUNT 3
+
+// A step of the calling thread that is being timed
+typedef struct {
+    uint64_t start;
+    uint64_t counters[TRACE_COUNTER_COUNT];
+    // Whether counters holds the counters at the start
+    int counting;
+} TraceSpan;
+
+// Starts timing a step of the calling thread, which trace_span_end records as a phase
+TraceSpan trace_span_begin(const SortTrace* trace);
+void trace_span_end(SortTrace* trace, const char* phase, unsigned int level, const TraceSpan* span);
+
+#endif //MULTITHREADED_SORTING_TRACE_H
@@ -0,0 +1,163 @@
+/// Overview
+/// Benchmark harness for the Rust parallel merge sort. It sweeps the same sizes, input distributions and
+/// thread counts as the C benchmark (multithreaded_sorting_c/bench.c), uses the same random number generator
+/// and seeds so both sort the same inputs, and prints the same CSV columns:
+///     implementation, type, distribution, size, threads, cutoff, repetitions, median_ns, ns_per_element, speedup
+/// The sort insertion sorts slices of up to INSERTION_SORT_THRESHOLD elements, which is reported as the cutoff.
+/// speedup is the single-threaded median divided by this row's median, for the same size and distribution.
+
+/// Usage: cargo bench --bench sort -- [-s min] [-n max] [-d dists] [-t threads] [-r reps]
+///     -s  smallest input size in elements (default: 1000)
+///     -n  largest input size in elements (default: 1000000000); sizes grow by a factor of 10
+///     -d  comma separated distributions (default: all of uniform,sorted,reverse,few-unique,zipf,organ-pipe)
+///     -t  comma separated thread counts (default: 1, 2, 4, ... up to the number of available cores)
+///     -r  timed repetitions per combination; the median is reported (default: 5)
+
+//// DEPENDENCIES AND LIBRARY IMPORTS
+use multithreaded_sorting_rust::{Sorter, INSERTION_SORT_THRESHOLD};
+use std::process;
+use std::thread;
+use std::time::Instant;
+
+//// INPUT DISTRIBUTIONS
+const DISTRIBUTIONS: [&str; 6] = ["uniform", "sorted", "reverse", "few-unique", "zipf", "organ-pipe"];
+// Distinct values of the few-unique distribution
+const FEW_UNIQUE_VALUES: u64 = 16;
+// Number of distinct ranks the Zipf distribution draws from, and its exponent
+const ZIPF_UNIVERSE: usize = 1_000_000;
+const ZIPF_EXPONENT: f64 = 1.0;
+
+// splitmix64, the same generator as the C benchmark
+fn splitmix64(state: &mut u64) -> u64 {
+    *state = state.wrapping_add(0x9E37_79B9_7F4A_7C15);
+    let mut z = *state;
+    z = (z ^ (z >> 30)).wrapping_mul(0xBF58_476D_1CE4_E5B9);
+    z = (z ^ (z >> 27)).wrapping_mul(0x94D0_49BB_1331_11EB);
+    z ^ (z >> 31)
+}
+
+// Generates count keys from the named distribution
+fn generate(distribution: &str, count: usize) -> Vec<i32> {
+    let mut state = 42u64;
+    match distribution {
+        "uniform" => (0..count).map(|_| splitmix64(&mut state) as i32).collect(),
+        "sorted" | "reverse" => {
+            let mut keys: Vec<i32> = (0..count).map(|_| splitmix64(&mut state) as i32).collect();
+            keys.sort_unstable();
+            if distribution == "reverse" {
+                keys.reverse();
+            }
+            keys
+        }
+        "few-unique" => (0..count).map(|_| (splitmix64(&mut state) % FEW_UNIQUE_VALUES) as i32).collect(),
+        "zipf" => {
+            // Inverse transform sampling over a tabulated cumulative distribution
+            let mut total = 0.0;
+            let cdf: Vec<f64> = (0..ZIPF_UNIVERSE)
+                .map(|r| {
+                    total += 1.0 / ((r + 1) as f64).powf(ZIPF_EXPONENT);
+                    total
+                })
+                .collect();
+            (0..count)
+                .map(|_| {
+                    let u = (splitmix64(&mut state) >> 11) as f64 / 9007199254740992.0 * total;
+                    cdf.partition_point(|&p| p < u).min(ZIPF_UNIVERSE - 1) as i32
+                })
+                .collect()
+        }
+        "organ-pipe" => (0..count).map(|i| if i < count / 2 { i } else { count - i } as i32).collect(),
+        _ => {
+            eprintln!("Unknown distribution: {}", distribution);
+            process::exit(1);
+        }
+    }
+}
+
+// Sorts input "repetitions" times and returns the median wall time in nanoseconds
+fn time_sort(input: &[i32], threads: usize, repetitions: usize) -> f64 {
+    let mut samples = Vec::with_capacity(repetitions);
+    // The buffers, and the Sorter's threads, are set up by a first sort before timing starts. The sort is in place,
+    // so every repetition first resets the array to the unsorted input, outside the timed region: like the C harness,
+    // only the sort itself is timed.
+    let mut sorter = Sorter::new(threads);
+    let mut sorted = input.to_vec();
+    sorter.sort(&mut sorted);
+    for _ in 0..repetitions {
+        sorted.copy_from_slice(input);
+        let start = Instant::now();
+        sorter.sort(&mut sorted);
+        samples.push(start.elapsed().as_nanos() as f64);
+    }
+    if sorted.windows(2).any(|pair| pair[1] < pair[0]) {
+        eprintln!("Output of {} elements with {} threads is not sorted.", input.len(), threads);
+        process::exit(1);
+    }
+    samples.sort_by(|a, b| a.partial_cmp(b).unwrap());
+    let n = samples.len();
+    if n % 2 == 1 { samples[n / 2] } else { (samples[n / 2 - 1] + samples[n / 2]) / 2.0 }
+}
+
+fn parse_list(text: &str) -> Vec<usize> {
+    text.split(',').filter_map(|item| item.parse().ok()).filter(|&n| n > 0).collect()
+}
+
+fn main() {
+    //// COMMAND LINE OPTIONS
+    let mut min_size = 1000usize;
+    let mut max_size = 1_000_000_000usize;
+    let mut distributions: Vec<String> = DISTRIBUTIONS.iter().map(|d| d.to_string()).collect();
+    let mut thread_counts = Vec::new();
+    let mut repetitions = 5usize;
+
+    let mut args = std::env::args().skip(1);
+    while let Some(arg) = args.next() {
+        // cargo bench passes --bench to harness = false targets
+        if arg == "--bench" {
+            continue;
+        }
+        let value = args.next().unwrap_or_default();
+        match arg.as_str() {
+            "-s" => min_size = value.parse().unwrap_or(min_size),
+            "-n" => max_size = value.parse().unwrap_or(max_size),
+            "-d" => distributions = value.split(',').map(|d| d.to_string()).collect(),
+            "-t" => thread_counts = parse_list(&value),
+            "-r" => repetitions = value.parse().unwrap_or(repetitions),
+            _ => {
+                eprintln!("Usage: cargo bench --bench sort -- [-s min] [-n max] [-d dists] [-t threads] [-r reps]");
+                process::exit(1);
+            }
+        }
+    }
+    min_size = min_size.max(1);
+    repetitions = repetitions.max(1);
+
+    // Default thread counts: powers of two up to the core count, plus the core count itself
+    if thread_counts.is_empty() {
+        let cores = thread::available_parallelism().map(|n| n.get()).unwrap_or(1);
+        let mut t = 1;
+        while t < cores {
+            thread_counts.push(t);
+            t *= 2;
+        }
+        thread_counts.push(cores);
+    }
+
+    println!("implementation,type,distribution,size,threads,cutoff,repetitions,median_ns,ns_per_element,speedup");
+    for distribution in DISTRIBUTIONS.iter().filter(|d| distributions.iter().any(|wanted| wanted == *d)) {
+        let mut size = min_size;
+        while size <= max_size {
+            let input = generate(distribution, size);
+            // The single-threaded median is the baseline for the speedup column
+            let baseline = time_sort(&input, 1, repetitions);
+            for &threads in &thread_counts {
+                let median = if threads == 1 { baseline } else { time_sort(&input, threads, repetitions) };
+                println!(
+                    "rust,i32,{},{},{},{},{},{:.0},{:.3},{:.3}",
+                    distribution, size, threads, INSERTION_SORT_THRESHOLD, repetitions, median, median / size as f64, baseline / median
+                );
+            }
+            size *= 10;
+        }
+    }
+}
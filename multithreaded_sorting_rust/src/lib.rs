@@ -0,0 +1,530 @@
+/// Overview
+/// The sorting functions behind the demo in main.rs, as a library so the benchmark harness
+/// (benches/sort.rs) and other programs can call them too. Programs that sort many arrays keep a Sorter,
+/// the counterpart of the C library's sorting context (multithreaded_sorting_c/mtsort.h).
+
+/// Memory
+/// Every sort works on slices: the data is sorted in place, next to one scratch buffer of the same length.
+/// Each level of the recursion merges from one of the two into the other, so a level moves each element
+/// once and nothing is allocated below the top. The parallel sort hands each thread disjoint halves of both
+/// buffers with split_at_mut, so the threads share no memory and need no locks.
+
+/// Threads
+/// The splits of the recursion and of the merges run on a Pool of long-lived worker threads, through Pool::join,
+/// like the work-stealing joins of the C engine (multithreaded_sorting_c/pool.h). A Sorter keeps its pool, so repeated
+/// sorts start no threads; the free functions start one for the call.
+
+//// DEPENDENCIES AND LIBRARY IMPORTS
+use std::any::Any;
+use std::collections::VecDeque;
+use std::panic::{self, AssertUnwindSafe};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread::{self, JoinHandle};
+
+// Slices of at most this many elements are insertion sorted instead of split further, like the C sort's default
+pub const INSERTION_SORT_THRESHOLD: usize = 24;
+
+// Merges of fewer elements than this are not split across threads: handing half to another thread would cost more
+const PARALLEL_MERGE_MIN_LEN: usize = 4096;
+
+// SORTING FUNCTIONS
+// Generic "T" is used with traits "Partial Order" and Copy.
+// This allows the sorting algorithm to work with integers (signed/unsigned) and floats
+
+// Sorts data in place. Allocates one scratch buffer; use merge_sort_with or a Sorter to bring your own.
+pub fn merge_sort<T: PartialOrd + Copy>(data: &mut [T]) {
+    let mut scratch = data.to_vec();
+    merge_sort_with(data, &mut scratch);
+}
+
+// Sorts data in place, using scratch (the same length as data, any contents) as the other buffer
+pub fn merge_sort_with<T: PartialOrd + Copy>(data: &mut [T], scratch: &mut [T]) {
+    assert_eq!(data.len(), scratch.len(), "scratch must be as long as data");
+    sort_in_place(data, scratch);
+}
+
+fn sort_in_place<T: PartialOrd + Copy>(data: &mut [T], scratch: &mut [T]) {
+    // Base case
+    if data.len() <= INSERTION_SORT_THRESHOLD {
+        insertion_sort(data);
+        return;
+    }
+
+    // Get the midpoint
+    let middle = data.len() / 2;
+
+    // Sort both halves into scratch, using the halves of data as their scratch space, then merge them back
+    let (left, right) = data.split_at_mut(middle);
+    let (left_scratch, right_scratch) = scratch.split_at_mut(middle);
+    sort_into(left, left_scratch);
+    sort_into(right, right_scratch);
+    merge(left_scratch, right_scratch, data);
+}
+
+// Writes data, sorted, into output (the same length). data is used as scratch space and left in no particular order.
+fn sort_into<T: PartialOrd + Copy>(data: &mut [T], output: &mut [T]) {
+    if data.len() <= INSERTION_SORT_THRESHOLD {
+        insertion_sort(data);
+        output.copy_from_slice(data);
+        return;
+    }
+    let middle = data.len() / 2;
+    let (left, right) = data.split_at_mut(middle);
+    let (left_output, right_output) = output.split_at_mut(middle);
+    sort_in_place(left, left_output);
+    sort_in_place(right, right_output);
+    merge(left, right, output);
+}
+
+// Sorts a short slice in place by moving each element left past every bigger element before it
+fn insertion_sort<T: PartialOrd + Copy>(data: &mut [T]) {
+    for i in 1..data.len() {
+        let value = data[i];
+        let mut j = i;
+        while j > 0 && value < data[j - 1] {
+            data[j] = data[j - 1];
+            j -= 1;
+        }
+        data[j] = value;
+    }
+}
+
+// Merges two sorted slices into output, which must hold exactly left.len() + right.len() elements.
+// Equal elements are taken from left first, so the merge is stable.
+pub fn merge<T: PartialOrd + Copy>(left: &[T], right: &[T], output: &mut [T]) {
+    // 3 pointers: i into the left slice, j into the right slice, k into output
+    let (mut i, mut j, mut k) = (0, 0, 0);
+    // Loop continues as long as there are elements in both slices that need to be compared and merged
+    while i < left.len() && j < right.len() {
+        if left[i] <= right[j] {
+            output[k] = left[i];
+            i += 1;
+        } else {
+            output[k] = right[j];
+            j += 1;
+        }
+        k += 1;
+    }
+
+    // Add elements left over from the other slice
+    // We can assume the rest of the slice is sorted
+    output[k..k + left.len() - i].copy_from_slice(&left[i..]);
+    output[k + left.len() - i..].copy_from_slice(&right[j..]);
+}
+
+// Co-ranking (merge path) split point search.
+// Returns how many of the first k elements of merge(left, right) come from left; the other k - i come from right.
+fn co_rank<T: PartialOrd>(k: usize, left: &[T], right: &[T]) -> usize {
+    let mut low = k.saturating_sub(right.len());
+    let mut high = k.min(left.len());
+    // Smallest i for which the left element after the split, left[i], comes after right[k - i - 1]:
+    // as long as left[i] is not bigger, merge would take it before right[k - i - 1], so the split needs more of left
+    while low < high {
+        let i = low + (high - low) / 2;
+        let j = k - i;
+        if j > 0 && i < left.len() && left[i] <= right[j - 1] {
+            low = i + 1;
+        } else {
+            high = i;
+        }
+    }
+    low
+}
+
+// WORKER POOL
+// A queue of jobs and the threads that run them. join queues one closure and runs the other on the calling thread;
+// when that is done, a queued closure that no worker has taken yet is taken back and run right there, and otherwise
+// the caller runs other queued jobs until a worker has finished it, so waiting threads never sit idle while there is
+// work, and nested joins cannot deadlock.
+
+type Job = Box<dyn FnOnce() + Send + 'static>;
+
+struct PoolState {
+    // Jobs that no thread has taken yet, each with the id that its join looks for
+    queue: VecDeque<(u64, Job)>,
+    next_id: u64,
+    shutdown: bool,
+}
+
+struct PoolShared {
+    state: Mutex<PoolState>,
+    // Signalled when a job is queued or finished, or on shutdown
+    changed: Condvar,
+}
+
+// What the joining thread learns about its queued closure
+#[derive(Default)]
+struct JobLatch {
+    done: AtomicBool,
+    panic: Mutex<Option<Box<dyn Any + Send>>>,
+}
+
+pub struct Pool {
+    shared: Arc<PoolShared>,
+    workers: Vec<JoinHandle<()>>,
+}
+
+impl Pool {
+    // A pool of "workers" threads. The threads that call join do their share of the work, so sorting with n threads
+    // takes n - 1 workers; with none, join runs both closures on the caller.
+    pub fn new(workers: usize) -> Self {
+        let shared = Arc::new(PoolShared {
+            state: Mutex::new(PoolState { queue: VecDeque::new(), next_id: 0, shutdown: false }),
+            changed: Condvar::new(),
+        });
+        let workers = (0..workers)
+            .map(|_| {
+                let shared = Arc::clone(&shared);
+                thread::spawn(move || worker_loop(&shared))
+            })
+            .collect();
+        Pool { shared, workers }
+    }
+
+    pub fn workers(&self) -> usize {
+        self.workers.len()
+    }
+
+    // Runs a and b, possibly at the same time, and returns once both have finished. A panic in either is passed on
+    // to the caller, after both have finished.
+    pub fn join<A: FnOnce() + Send, B: FnOnce() + Send>(&self, a: A, b: B) {
+        if self.workers.is_empty() {
+            a();
+            b();
+            return;
+        }
+        let latch = Arc::new(JobLatch::default());
+        let job: Box<dyn FnOnce() + Send + '_> = {
+            let latch = Arc::clone(&latch);
+            let shared = Arc::clone(&self.shared);
+            Box::new(move || {
+                let result = panic::catch_unwind(AssertUnwindSafe(b));
+                *latch.panic.lock().unwrap() = result.err();
+                // Set under the lock, so a joiner that just found the job missing cannot miss the signal
+                let state = shared.state.lock().unwrap();
+                latch.done.store(true, Ordering::Release);
+                drop(state);
+                shared.changed.notify_all();
+            })
+        };
+        // SAFETY: the job borrows from the caller's stack frame for '_. join does not return, or unwind, before the
+        // job has run to completion: the panic of a is caught, and wait_for only returns once the job has set done,
+        // after its last use of anything but the two Arcs it owns.
+        let job: Job = unsafe { std::mem::transmute::<Box<dyn FnOnce() + Send + '_>, Job>(job) };
+        let id = {
+            let mut state = self.shared.state.lock().unwrap();
+            state.next_id += 1;
+            let id = state.next_id;
+            state.queue.push_back((id, job));
+            id
+        };
+        self.shared.changed.notify_one();
+
+        let result = panic::catch_unwind(AssertUnwindSafe(a));
+        self.wait_for(id, &latch);
+        if let Err(payload) = result {
+            panic::resume_unwind(payload);
+        }
+        let payload = latch.panic.lock().unwrap().take();
+        if let Some(payload) = payload {
+            panic::resume_unwind(payload);
+        }
+    }
+
+    // Returns once the job queued with id has finished, running it here if nobody has taken it yet, and other
+    // queued jobs (the newest, and so smallest, first) while a worker runs it
+    fn wait_for(&self, id: u64, latch: &JobLatch) {
+        let mut state = self.shared.state.lock().unwrap();
+        while !latch.done.load(Ordering::Acquire) {
+            let own = state.queue.iter().position(|(queued, _)| *queued == id);
+            let job = match own {
+                Some(position) => state.queue.remove(position),
+                None => state.queue.pop_back(),
+            };
+            match job {
+                Some((_, job)) => {
+                    drop(state);
+                    job();
+                    state = self.shared.state.lock().unwrap();
+                }
+                None => state = self.shared.changed.wait(state).unwrap(),
+            }
+        }
+    }
+}
+
+// Takes the oldest, and so biggest, queued jobs first
+fn worker_loop(shared: &PoolShared) {
+    let mut state = shared.state.lock().unwrap();
+    loop {
+        if let Some((_, job)) = state.queue.pop_front() {
+            drop(state);
+            job();
+            state = shared.state.lock().unwrap();
+        } else if state.shutdown {
+            return;
+        } else {
+            state = shared.changed.wait(state).unwrap();
+        }
+    }
+}
+
+impl Drop for Pool {
+    fn drop(&mut self) {
+        self.shared.state.lock().unwrap().shutdown = true;
+        self.shared.changed.notify_all();
+        for worker in self.workers.drain(..) {
+            let _ = worker.join();
+        }
+    }
+}
+
+
+// PARALLEL SORT
+// Pool::join lets the halves borrow data directly instead of requiring 'static data.
+
+// Sorts data in place with up to "threads" threads, using scratch (the same length as data) as the other buffer.
+// The halves of the recursion are sorted on two threads until every thread has its own part,
+// and every merge above that is split across the threads of its part with co_rank.
+// Starts the threads for this one sort; a Sorter keeps them for the next.
+pub fn parallel_sort<T: PartialOrd + Copy + Send + Sync>(data: &mut [T], scratch: &mut [T], threads: usize) {
+    assert_eq!(data.len(), scratch.len(), "scratch must be as long as data");
+    let pool = Pool::new(if threads > 1 && data.len() > INSERTION_SORT_THRESHOLD { threads - 1 } else { 0 });
+    parallel_sort_on(&pool, data, scratch, threads);
+}
+
+// parallel_sort on the threads of pool
+fn parallel_sort_on<T: PartialOrd + Copy + Send + Sync>(pool: &Pool, data: &mut [T], scratch: &mut [T], threads: usize) {
+    if threads <= 1 || data.len() <= INSERTION_SORT_THRESHOLD {
+        sort_in_place(data, scratch);
+        return;
+    }
+    let middle = data.len() / 2;
+    let (left, right) = data.split_at_mut(middle);
+    let (left_scratch, right_scratch) = scratch.split_at_mut(middle);
+    pool.join(
+        || parallel_sort_into(pool, right, right_scratch, threads - threads / 2),
+        || parallel_sort_into(pool, left, left_scratch, threads / 2),
+    );
+    parallel_merge(pool, left_scratch, right_scratch, data, threads);
+}
+
+// The parallel counterpart of sort_into
+fn parallel_sort_into<T: PartialOrd + Copy + Send + Sync>(pool: &Pool, data: &mut [T], output: &mut [T], threads: usize) {
+    if threads <= 1 || data.len() <= INSERTION_SORT_THRESHOLD {
+        sort_into(data, output);
+        return;
+    }
+    let middle = data.len() / 2;
+    let (left, right) = data.split_at_mut(middle);
+    let (left_output, right_output) = output.split_at_mut(middle);
+    pool.join(
+        || parallel_sort_on(pool, right, right_output, threads - threads / 2),
+        || parallel_sort_on(pool, left, left_output, threads / 2),
+    );
+    parallel_merge(pool, left, right, output, threads);
+}
+
+// Merges like merge(), with the output split in two at its middle for every pair of threads. co_rank finds the
+// elements of left and right that make up each half, so both halves are merged independently.
+fn parallel_merge<T: PartialOrd + Copy + Send + Sync>(pool: &Pool, left: &[T], right: &[T], output: &mut [T], threads: usize) {
+    if threads <= 1 || output.len() < PARALLEL_MERGE_MIN_LEN {
+        merge(left, right, output);
+        return;
+    }
+    let k = output.len() / 2;
+    let i = co_rank(k, left, right);
+    let (low, high) = output.split_at_mut(k);
+    pool.join(
+        || parallel_merge(pool, &left[i..], &right[k - i..], high, threads - threads / 2),
+        || parallel_merge(pool, &left[..i], &right[..k - i], low, threads / 2),
+    );
+}
+
+// Returns a sorted copy of data, sorted with up to "threads" threads
+pub fn parallel_merge_sort<T: PartialOrd + Copy + Send + Sync>(data: &[T], threads: usize) -> Vec<T> {
+    let mut sorted = data.to_vec();
+    let mut scratch = data.to_vec();
+    parallel_sort(&mut sorted, &mut scratch, threads);
+    sorted
+}
+
+
+// SORTING CONTEXT
+// Holds the settings and the scratch buffer of repeated sorts, so a program makes one Sorter up front and hands it
+// every array it sorts. The buffer only grows, so once it fits the largest array, sorting allocates nothing, and the
+// worker threads live as long as the Sorter, so sorting starts no threads either.
+pub struct Sorter<T> {
+    threads: usize,
+    pool: Pool,
+    scratch: Vec<T>,
+}
+
+impl<T: PartialOrd + Copy + Send + Sync> Sorter<T> {
+    // A sorter that uses up to "threads" threads (at least 1)
+    pub fn new(threads: usize) -> Self {
+        let threads = threads.max(1);
+        Sorter { threads, pool: Pool::new(threads - 1), scratch: Vec::new() }
+    }
+
+    // A sorter with one thread per available core
+    pub fn with_available_parallelism() -> Self {
+        Sorter::new(thread::available_parallelism().map_or(1, |cores| cores.get()))
+    }
+
+    pub fn threads(&self) -> usize {
+        self.threads
+    }
+
+    // Sorts data in place, in ascending order
+    pub fn sort(&mut self, data: &mut [T]) {
+        if data.is_empty() {
+            return;
+        }
+        // The scratch contents do not matter, so the buffer is only filled, with copies of any element, when it grows
+        if self.scratch.len() < data.len() {
+            self.scratch.resize(data.len(), data[0]);
+        }
+        parallel_sort_on(&self.pool, data, &mut self.scratch[..data.len()], self.threads);
+    }
+
+    // Returns a sorted copy of data
+    pub fn sorted(&mut self, data: &[T]) -> Vec<T> {
+        let mut sorted = data.to_vec();
+        self.sort(&mut sorted);
+        sorted
+    }
+}
+
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // Ordered by key only, so equal keys show whether a sort kept them in input order
+    #[derive(Clone, Copy, Debug)]
+    struct Item {
+        key: u32,
+        index: u32,
+    }
+
+    impl PartialEq for Item {
+        fn eq(&self, other: &Self) -> bool {
+            self.key == other.key
+        }
+    }
+
+    impl PartialOrd for Item {
+        fn partial_cmp(&self, other: &Self) -> Option<std::cmp::Ordering> {
+            self.key.partial_cmp(&other.key)
+        }
+    }
+
+    // n items with keys below "range" from a xorshift generator, so small ranges give many equal keys
+    fn items(n: usize, range: u32, seed: u64) -> Vec<Item> {
+        let mut state = seed | 1;
+        (0..n)
+            .map(|index| {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                Item { key: (state % range as u64) as u32, index: index as u32 }
+            })
+            .collect()
+    }
+
+    // The std stable sort of data, as (key, index) pairs
+    fn expected(data: &[Item]) -> Vec<(u32, u32)> {
+        let mut sorted = data.to_vec();
+        sorted.sort_by_key(|item| item.key);
+        pairs(&sorted)
+    }
+
+    fn pairs(data: &[Item]) -> Vec<(u32, u32)> {
+        data.iter().map(|item| (item.key, item.index)).collect()
+    }
+
+    const SIZES: [usize; 12] = [0, 1, 2, 23, 24, 25, 100, 4095, 4096, 4097, 10_000, 200_000];
+
+    #[test]
+    fn merge_sort_is_stable() {
+        for &n in &SIZES {
+            for range in [1, 10, u32::MAX] {
+                let input = items(n, range, n as u64 + range as u64);
+                let mut sorted = input.clone();
+                merge_sort(&mut sorted);
+                assert_eq!(pairs(&sorted), expected(&input), "{} elements of range {}", n, range);
+            }
+        }
+    }
+
+    #[test]
+    fn parallel_sort_matches_std_stable_sort() {
+        for threads in 1..=16 {
+            for &n in &SIZES {
+                let input = items(n, if threads % 2 == 0 { 1000 } else { u32::MAX }, threads as u64 * 7919 + n as u64);
+                let mut sorted = input.clone();
+                let mut scratch = input.clone();
+                parallel_sort(&mut sorted, &mut scratch, threads);
+                assert_eq!(pairs(&sorted), expected(&input), "{} elements with {} threads", n, threads);
+            }
+        }
+    }
+
+    #[test]
+    fn co_rank_at_the_edges() {
+        let left = [1, 3, 5, 7];
+        let right = [2, 4, 6];
+        assert_eq!(co_rank(0, &left, &right), 0);
+        assert_eq!(co_rank(7, &left, &right), 4);
+        assert_eq!(co_rank(3, &left, &right), 2);
+        // One side empty
+        assert_eq!(co_rank(2, &left, &[]), 2);
+        assert_eq!(co_rank(2, &[], &right), 0);
+        // Every element of left before every one of right, and the other way round
+        assert_eq!(co_rank(3, &[1, 2, 3], &[4, 5, 6]), 3);
+        assert_eq!(co_rank(3, &[4, 5, 6], &[1, 2, 3]), 0);
+        // Equal elements are taken from left first, as merge does
+        assert_eq!(co_rank(2, &[5, 5], &[5, 5]), 2);
+        assert_eq!(co_rank(3, &[5, 5], &[5, 5]), 2);
+        assert_eq!(co_rank(1, &[5], &[4, 5]), 0);
+    }
+
+    #[test]
+    fn co_rank_splits_every_merge_like_merge() {
+        let mut left: Vec<u32> = items(50, 8, 1).iter().map(|item| item.key).collect();
+        let mut right: Vec<u32> = items(40, 8, 2).iter().map(|item| item.key).collect();
+        left.sort();
+        right.sort();
+        for k in 0..=left.len() + right.len() {
+            let i = co_rank(k, &left, &right);
+            let mut low = vec![0; k];
+            let mut high = vec![0; left.len() + right.len() - k];
+            merge(&left[..i], &right[..k - i], &mut low);
+            merge(&left[i..], &right[k - i..], &mut high);
+            let mut whole = vec![0; left.len() + right.len()];
+            merge(&left, &right, &mut whole);
+            assert_eq!([low, high].concat(), whole, "split at {}", k);
+        }
+    }
+
+    #[test]
+    fn sorter_is_reused_across_lengths() {
+        let mut sorter = Sorter::new(4);
+        for (round, &n) in [200_000, 10, 0, 5000, 1, 200_000, 4097].iter().enumerate() {
+            let input = items(n, 100, round as u64);
+            let mut sorted = input.clone();
+            sorter.sort(&mut sorted);
+            assert_eq!(pairs(&sorted), expected(&input), "{} elements in round {}", n, round);
+            assert_eq!(pairs(&sorter.sorted(&input)), expected(&input));
+        }
+    }
+
+    #[test]
+    #[should_panic(expected = "queued half")]
+    fn pool_join_passes_on_a_panic() {
+        let pool = Pool::new(2);
+        pool.join(|| {}, || panic!("queued half"));
+    }
+}